@@ -50,6 +50,7 @@ cmd_opt.add_argument('-grad_clip', default=5, type=float, help='gradient clip')
 cmd_opt.add_argument('-train_ratio', default=0.8, type=float, help='ratio for training')
 cmd_opt.add_argument('-dev_ratio', default=0.2, type=float, help='ratio for dev')
 cmd_opt.add_argument('-greedy_frac', default=0, type=float, help='prob for greedy decode')
+cmd_opt.add_argument('-native_gen', default=False, type=eval, help='sample row trees with the native TreeSampler?')
 
 cmd_opt.add_argument('-num_epochs', default=100000, type=int, help='num epochs')
 cmd_opt.add_argument('-batch_size', default=10, type=int, help='batch size')
@@ -72,6 +73,7 @@ cmd_opt.add_argument('-share_param', default=True, type=eval, help='share param
 cmd_opt.add_argument('-directed', default=False, type=eval, help='is directed graph?')
 cmd_opt.add_argument('-self_loop', default=False, type=eval, help='has self-loop?')
 cmd_opt.add_argument('-bfs_permute', default=False, type=eval, help='random permute with bfs?')
+cmd_opt.add_argument('-parallel_build', default=False, type=eval, help='build the row trees of a minibatch in parallel?')
 cmd_opt.add_argument('-display', default=False, type=eval, help='display progress?')
 
 cmd_args, _ = cmd_opt.parse_known_args()
@@ -0,0 +1,74 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BATCH_MEMO_H
+#define BATCH_MEMO_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <vector>
+
+// What the training loop reads of a prepared batch: the index export of
+// ExportIndices and, with bits_compress, the binary features of every depth
+// packed as by GetBinaryPacked.
+struct BatchMemoEntry
+{
+    size_t bytes() const;
+
+    int num_depths, num_levels;
+    std::vector<int> offsets, buf;
+    std::vector<int> n_bin_job_per_level;
+    std::vector< std::vector<int> > bin_lens;
+    std::vector< std::vector<uint32_t> > bin_pos, bin_neg;
+};
+
+// Entries of prepared batches by their request, so that batches repeated
+// across epochs are served without building their trees. Up to max_bytes of
+// entries are kept in memory, least recently used out first. With a spill
+// path, entries pushed out are appended to that file (truncated on open)
+// and read back from it on a later hit.
+class BatchMemo
+{
+ public:
+    BatchMemo(int64_t max_bytes, const char* spill_path);
+    ~BatchMemo();
+
+    // nullptr if the batch was never stored.
+    std::shared_ptr<const BatchMemoEntry> find(const std::vector<int>& key);
+    void insert(const std::vector<int>& key,
+                std::shared_ptr<const BatchMemoEntry> entry);
+
+    int64_t max_bytes, bytes_in_memory;
+
+ private:
+    struct Slot
+    {
+        std::shared_ptr<const BatchMemoEntry> entry;
+        std::list<const std::vector<int>*>::iterator lru_pos;
+    };
+    void evict();
+    std::shared_ptr<const BatchMemoEntry> read_spilled(int64_t offset, int64_t len);
+
+    std::map<std::vector<int>, Slot> entries;
+    // Keys of entries, most recently used first.
+    std::list<const std::vector<int>*> lru;
+    // (offset, length) in the spill file.
+    std::map<std::vector<int>, std::pair<int64_t, int64_t> > spilled;
+    int spill_fd;
+    int64_t spill_size;
+};
+
+#endif
@@ -0,0 +1,64 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BATCH_PIPELINE_H
+#define BATCH_PIPELINE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class TreeLibContext;
+
+// Builds minibatches on a worker thread ahead of their use. Each batch is
+// prepared in its own slot context, which borrows the graphs of the source
+// context, and batches are handed out in the order they were enqueued. The
+// slot returned by acquire() stays valid until the next acquire(), so with
+// two slots one batch is consumed while the next one is being built.
+// Graphs must all be registered before the pipeline is created, and while
+// it runs their batches must only be built through it: building a batch
+// still writes per-batch state into the GraphStructs.
+class BatchPipeline
+{
+ public:
+    BatchPipeline(TreeLibContext* source, int num_slots);
+    ~BatchPipeline();
+
+    void enqueue(int num_graphs, int* list_ids, int* list_start_node,
+                 int* list_col_start, int* list_col_end, int num_nodes);
+    TreeLibContext* acquire();
+
+ private:
+    struct Request
+    {
+        std::vector<int> ids, start_nodes, col_starts, col_ends;
+        int num_nodes;
+    };
+    void work();
+
+    TreeLibContext* source;
+    std::vector<TreeLibContext*> slots;
+    TreeLibContext* held;
+    std::deque<Request> pending;
+    std::deque<TreeLibContext*> free_slots, ready;
+    int num_outstanding;
+    bool stopping;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::thread worker;
+};
+
+#endif
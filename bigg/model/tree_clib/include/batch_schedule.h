@@ -0,0 +1,56 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef BATCH_SCHEDULE_H
+#define BATCH_SCHEDULE_H
+
+#include <cstdint>
+#include <vector>
+
+class GraphStruct;
+struct TreeConfig;
+
+// Tree work of a graph, counted from its target edges without building any
+// tree: the jobs (internal nodes with an edge below) each row tree would
+// add at every depth, over the col range PrepareTrain uses by default
+// under cfg.
+struct GraphCost
+{
+    GraphCost(GraphStruct* g, const TreeConfig& cfg);
+
+    std::vector<int64_t> jobs_per_depth;
+    std::vector<int> row_jobs;
+    int64_t num_jobs;
+};
+
+// A training step runs the tree levels one after another, so a batch costs
+// level_cost per level of its deepest tree plus one per job and per row.
+// Splits graphs into batches of at most batch_size graphs with costs as
+// even as a greedy fill gets them: the deepest graphs open the batches,
+// then each remaining graph, largest first, joins the cheapest batch with
+// room. Fills order with the positions in graphs batch by batch,
+// batch_sizes and batch_costs; returns the number of batches.
+int schedule_batches(std::vector<GraphStruct*>& graphs,
+                     const TreeConfig& cfg, int batch_size,
+                     double level_cost, std::vector<int>& order,
+                     std::vector<int>& batch_sizes,
+                     std::vector<double>& batch_costs);
+
+// Splits the rows of g into num_slices consecutive slices of about equal
+// jobs plus rows; fills starts[0..num_slices], starts[num_slices] being
+// num_nodes.
+void slice_rows(GraphStruct* g, const TreeConfig& cfg, int num_slices,
+                int* starts);
+
+#endif
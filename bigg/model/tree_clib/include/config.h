@@ -24,20 +24,19 @@
 
 typedef float Dtype;
 
-struct cfg
+// Flags of Init / InitCtx. Every context holds its own, so contexts set up
+// with different flags can live side by side.
+struct TreeConfig
 {
-    static int max_num_nodes;
-    static bool directed, self_loop, bfs_permute;
-    static int bits_compress;
-    static int dim_embed;
-    static int gpu;
-    static int seed;
-
-    static std::default_random_engine generator;
-
-    static void LoadParams(const int argc, const char** argv);
-
-    static void SetRandom();
+    int max_num_nodes = 1000000;
+    bool directed = false, self_loop = false;
+    bool bfs_permute = false, parallel_build = false;
+    int bits_compress = 0;
+    int dim_embed = 0;
+    int gpu = -1;
+    int seed = 1;
+
+    void LoadParams(const int argc, const char** argv);
 };
 
 #endif
@@ -0,0 +1,88 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef COUNTER_RNG_H
+#define COUNTER_RNG_H
+
+#include <cstdint>
+
+// Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2,
+// 3"): block b of a stream is the bijection of the counter
+// (b, stream, row, graph_id) under the key seed. A stream holds no shared
+// state, so any thread can draw the numbers of any (graph, row) and get the
+// same ones whatever the thread count or the order the streams are visited.
+// Meets UniformRandomBitGenerator, e.g. for std::shuffle.
+class CounterRng
+{
+ public:
+    typedef uint32_t result_type;
+
+    CounterRng() : CounterRng(0, 0, 0) {}
+
+    CounterRng(uint64_t seed, uint32_t graph_id, uint32_t row,
+               uint32_t stream = 0)
+        : pos(4)
+    {
+        key[0] = (uint32_t)seed;
+        key[1] = (uint32_t)(seed >> 32);
+        ctr[0] = 0;
+        ctr[1] = stream;
+        ctr[2] = row;
+        ctr[3] = graph_id;
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    result_type operator()()
+    {
+        if (pos == 4)
+        {
+            philox(ctr, key, out);
+            ctr[0]++;
+            pos = 0;
+        }
+        return out[pos++];
+    }
+
+    // Uniform in [0, 1) with 53 random bits.
+    double uniform()
+    {
+        uint32_t a = (*this)() >> 5, b = (*this)() >> 6;
+        return (a * 67108864.0 + b) * (1.0 / 9007199254740992.0);
+    }
+
+    static void philox(const uint32_t* counter, const uint32_t* k, uint32_t* res)
+    {
+        uint32_t c[4] = {counter[0], counter[1], counter[2], counter[3]};
+        uint32_t k0 = k[0], k1 = k[1];
+        for (int r = 0; r < 10; ++r)
+        {
+            uint64_t p0 = (uint64_t)0xD2511F53 * c[0];
+            uint64_t p1 = (uint64_t)0xCD9E8D57 * c[2];
+            uint32_t t[4] = {(uint32_t)(p1 >> 32) ^ c[1] ^ k0, (uint32_t)p1,
+                             (uint32_t)(p0 >> 32) ^ c[3] ^ k1, (uint32_t)p0};
+            c[0] = t[0]; c[1] = t[1]; c[2] = t[2]; c[3] = t[3];
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        res[0] = c[0]; res[1] = c[1]; res[2] = c[2]; res[3] = c[3];
+    }
+
+ private:
+    uint32_t key[2], ctr[4], out[4];
+    int pos;
+};
+
+#endif
@@ -0,0 +1,34 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef CPU_OPS_H
+#define CPU_OPS_H
+
+#include <cstdint>
+
+// Host counterpart of build_binary_mat: row i of outptr gets bit j of
+// bits[i * n_ints ...] as 1.0f / 0.0f for j < lens[i]; entries past lens[i]
+// are left untouched, exactly like the cuda kernel.
+void build_binary_mat_cpu(int n_rows, int n_ints, int n_feats, int* lens,
+                          uint32_t* bits, float* outptr);
+
+// Reference kernel for the packed binary features: for every row, the dense
+// (pos - neg) row that build_binary_mat would produce, padded with pad past
+// lens[i], times weight (n_feats x out_dim, row-major), written to
+// out (n_rows x out_dim). Only set bits are visited.
+void binary_packed_matmul(int n_rows, int n_ints, int n_feats, int out_dim,
+                          int* lens, uint32_t* bits_pos, uint32_t* bits_neg,
+                          float* weight, float pad, float* outptr);
+
+#endif
@@ -0,0 +1,92 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GRAPH_STORE_H
+#define GRAPH_STORE_H
+
+#include <cstdint>
+#include <memory>
+
+// On-disk graph series, as written by GraphStoreWriter in tree_lib.py. All
+// fields are little-endian; offsets are in bytes from the start of the file
+// and 8-byte aligned.
+//
+//   GraphStoreHeader
+//   GraphStoreSnapshot[num_snapshots]
+//   GraphStorePair[num_pairs]
+//   payload
+//
+// A snapshot is a lower-triangle CSR like CtypePrevGraph: int32
+// row_ptr[num_nodes + 1] counting entries, and the entries as interleaved
+// int32 (col, sign), so its rows can be used in place as GraphStruct's
+// previous-snapshot runs. A pair is one AddGraph call: the snapshot it
+// starts from and its num_edges signed target edges, int32 (x, y, sign)
+// each. Consecutive pairs of a series share their snapshots.
+struct GraphStoreHeader
+{
+    char magic[8];
+    int32_t version;
+    int32_t num_snapshots;
+    int32_t num_pairs;
+    int32_t reserved;
+};
+
+struct GraphStoreSnapshot
+{
+    int32_t num_nodes;
+    int32_t reserved;
+    int64_t row_ptr_offset;
+    int64_t rows_offset;
+};
+
+struct GraphStorePair
+{
+    int32_t snapshot;
+    int32_t num_edges;
+    int32_t n_left;
+    int32_t n_right;
+    int64_t edges_offset;
+};
+
+// Read-only mmap of a graph store file. GraphStructs built from the store
+// share the mapping, so it outlives the GraphStore.
+class GraphStore
+{
+ public:
+    // Maps the file at path and checks its header, the bounds of every
+    // section, the row pointers and the edge endpoints; returns nullptr if
+    // the file cannot be mapped or fails a check. Previous-snapshot rows are
+    // only read when a graph built from them is touched.
+    static GraphStore* open(const char* path);
+
+    const GraphStorePair& pair(int pair_id) const;
+    const GraphStoreSnapshot& snapshot(int snapshot_id) const;
+    const int32_t* row_ptr(int snapshot_id) const;
+    const int32_t* rows(int snapshot_id) const;
+    const int32_t* edges(int pair_id) const;
+
+    int num_snapshots, num_pairs;
+    std::shared_ptr<const char> data;
+    size_t size;
+
+ private:
+    GraphStore() : num_snapshots(0), num_pairs(0), size(0) {}
+    bool validate();
+
+    // Start of count T at offset, or nullptr if they are not all in the file.
+    template<typename T>
+    const T* at(int64_t offset, int64_t count) const;
+};
+
+#endif
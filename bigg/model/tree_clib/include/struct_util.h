@@ -17,55 +17,159 @@
 
 #include <vector>
 #include <map>
+#include <memory>
 #include <cassert>
 #include <atomic>
 #include <unordered_map>
 
+#include "tree_stats.h"  // NOLINT
+
 class AdjRow;
+class GraphStore;
 class AdjNode;
+class JobCollect;
+class NodeArena;
+class TreeShard;
+template<typename PtType> class PtHolder;
 
 const uint32_t ibits = 32;
+// Widest bit representation, which caps bits_compress at 256.
+const uint32_t max_bit_macros = 8;
 
 int num_ones(int n);
 
-class BitSet
+// Word loops over a bit representation of n_words uint32 words, unrolled at
+// compile time. Nothing here allocates; sets live in the NodeArena.
+template<uint32_t n_words>
+class FixedBitSet
 {
  public:
-    BitSet();
-    BitSet(uint32_t _n_bits);
-    BitSet left_shift(uint32_t n);
-    BitSet or_op(BitSet& another);
+    static void reset(uint32_t* bits)
+    {
+        for (uint32_t i = 0; i < n_words; ++i)
+            bits[i] = 0;
+    }
+
+    // dst = (lhs << n) | rhs, one word at a time from the top so that lhs
+    // and rhs may alias dst.
+    static void shift_or(uint32_t* dst, const uint32_t* lhs, uint32_t n,
+                         const uint32_t* rhs)
+    {
+        uint32_t block_shift = n / ibits;
+        n = n % ibits;
+        for (uint32_t i = n_words; i-- > 0;)
+        {
+            uint32_t word = 0;
+            if (i >= block_shift)
+            {
+                word = lhs[i - block_shift] << n;
+                if (n && i > block_shift)
+                    word |= lhs[i - block_shift - 1] >> (ibits - n);
+            }
+            dst[i] = word | rhs[i];
+        }
+    }
+};
+
+// A FixedBitSet width, picked from bits_compress by init (1, 2, 4 or 8
+// words), and its routines. Each NodeArena holds the one of its config.
+struct BitSet
+{
+    uint32_t n_words;
+    void (*reset)(uint32_t* bits);
+    void (*shift_or)(uint32_t* dst, const uint32_t* lhs, uint32_t n,
+                     const uint32_t* rhs);
 
-    void set(uint32_t pos);
-    bool get(uint32_t pos);
+    BitSet() { init(0); }
+    void init(int n_bits);
 
-    uint32_t n_bits, n_macros;
-    std::vector<uint32_t> macro_bits;
+    static inline void set(uint32_t* bits, uint32_t pos)
+    {
+        bits[pos / ibits] |= (uint32_t)1 << (pos % ibits);
+    }
+
+    static inline bool get(const uint32_t* bits, uint32_t pos)
+    {
+        return (bits[pos / ibits] >> (pos % ibits)) & 1;
+    }
 };
 
 class GraphStruct
 {
  public:
     GraphStruct(int graph_id, int num_nodes, int num_edges,
-                void* _prev_labels = nullptr,
+                void* _prev_row_ptr = nullptr,
+                void* _prev_cols = nullptr,
+                void* _prev_signs = nullptr,
                 void* _edge_pairs = nullptr,
                 void* _edge_signs = nullptr,
                 int n_left = -1,
                 int n_right = -1);
+    // Pair whose previous snapshot is the target of prev_graph, i.e. its
+    // previous snapshot with its delta applied. Rows share their base runs
+    // with prev_graph; a touched row only records its edits over the base,
+    // see PrevRow.
+    GraphStruct(int graph_id, GraphStruct* prev_graph,
+                int num_added, void* _added_pairs,
+                int num_removed, void* _removed_pairs);
+    // Pair pair_id of a graph store: the previous-snapshot runs point into
+    // the mapping instead of being copied.
+    GraphStruct(int graph_id, const GraphStore& store, int pair_id);
 
     void realize_nodes(int node_start, int node_end,
-                       int col_start, int col_end);
+                       int col_start, int col_end, JobCollect& jobs,
+                       PtHolder<AdjRow>& rows, NodeArena& arena);
     GraphStruct* permute();
-    std::map<int, std::vector<std::pair<int, int> > > edge_list;
-    std::vector<std::vector<int>> prev_adj;
+    // Target edges as CSR: row i is the run of (col, weight) pairs
+    // edge_cols[edge_row_ptr[i], edge_row_ptr[i + 1]), sorted by col.
+    std::vector<int> edge_row_ptr;
+    std::vector<std::pair<int, int> > edge_cols;
+    // Previous snapshot, one PrevRow per row.
+    struct PrevRow
+    {
+        // Sorted (col, sign) run of the row as some earlier snapshot had it.
+        std::pair<int, int>* base;
+        // Sorted (col, 1 if present else 0) overrides of base columns.
+        std::pair<int, int>* edits;
+        int base_len, num_edits;
+        // Indices in the page's blocks of the blocks holding base and edits.
+        int base_block, edit_block;
+    };
+    // Rows come in pages that AddGraphDelta shares between snapshots and
+    // copies on write. A page keeps alive the blocks its rows point into:
+    // the CSR block of AddGraph, the mapping of a GraphStore, or the blocks
+    // of the deltas that touched it.
+    static const int prev_page_bits = 5;
+    static const int prev_page_size = 1 << prev_page_bits;
+    struct PrevPage
+    {
+        PrevRow rows[prev_page_size];
+        std::vector<std::shared_ptr<const void> > blocks;
+    };
+    std::vector<std::shared_ptr<const PrevPage> > prev_pages;
+    inline const PrevRow& prev_row(int i) const
+    {
+        return prev_pages[i >> prev_page_bits]->rows[i & (prev_page_size - 1)];
+    }
     std::vector<AdjRow*> active_rows;
     std::vector<int> idx_map;
     int num_nodes, num_edges, graph_id;
     int node_start, node_end;
+    int n_left, n_right;
+
+ private:
+    // Maps an edge (x, y) to its (row, col) in the row trees.
+    void edge_row_col(int& x, int& y);
+    // Pages of rows run base_len[i] long from base + row_ptr[i], all in
+    // block.
+    void init_prev_pages(std::pair<int, int>* base, const int* row_ptr,
+                         std::shared_ptr<const void> block);
+    // Counting sort of num_edges edges into edge_row_ptr / edge_cols;
+    // edge(k, x, y, w) reads edge k.
+    template<typename EdgeFn>
+    void bucket_edges(int num_edges, EdgeFn edge);
 };
 
-extern std::vector<GraphStruct*> graph_list;
-extern std::vector<GraphStruct*> active_graphs;
 
 class AdjNode;
 
@@ -74,10 +178,11 @@ class JobCollect
  public:
     JobCollect();
     void reset();
-    void build_row_indices();
-    void build_row_indices_();
-    void build_row_summary();
-    int add_job(AdjNode* node);
+    void build_row_indices(std::vector<GraphStruct*>& graphs);
+    void build_row_indices_(std::vector<GraphStruct*>& graphs);
+    void build_row_summary(std::vector<GraphStruct*>& graphs);
+    void merge(std::vector<TreeShard*>& shards);
+    int add_job(AdjNode* node, AdjNode* lch, AdjNode* rch);
     void append_bool(std::vector< std::vector<int> >& list, int depth, int val);
     std::vector<AdjNode*> global_job_nodes;
     std::vector<int> job_position;
@@ -104,14 +209,22 @@ class JobCollect
     std::vector< std::vector<int> > bot_left_froms, bot_left_tos, next_left_froms, next_left_tos;  // NOLINT
     std::vector< std::vector<int> > step_inputs, step_nexts, step_froms, step_tos, step_indices;  // NOLINT
     int max_rowsum_steps, max_tree_depth, max_row_merge_steps;
+    // Only STAT_ADD_JOB_NS is kept here; prepare_batch moves it to the
+    // context after each build.
+    TreeStats stats;
 };
 
-extern JobCollect job_collect;
-
+// Cursor over one row's sorted (col, sign) edges and the matching row of the
+// previous snapshot. Both are borrowed views into GraphStruct storage, so the
+// automaton is cheap enough to live on the stack for each row.
 class ColAutomata
 {
  public:
-    ColAutomata(std::vector< std::pair<int, int> >& indices, std::vector<int>& prev_row);
+    // prev_edits, if any, override the previous row, see
+    // GraphStruct::PrevRow.
+    ColAutomata(std::pair<int, int>* indices, int num_indices,
+                std::pair<int, int>* prev_indices, int num_prev,
+                std::pair<int, int>* prev_edits = nullptr, int num_edits = 0);
     int add_edge(int col_idx);
     int next_edge();
     int last_edge();
@@ -119,8 +232,11 @@ class ColAutomata
     bool had_edge(int ix);
 
     std::pair<int, int> * indices;
-    std::vector<int> prev_row;
+    std::pair<int, int> * prev_indices;
+    std::pair<int, int> * prev_edits;
     int pos, num_indices;
+    int prev_pos, num_prev;
+    int edit_pos, num_edits;
 };
 
 class AdjNode;
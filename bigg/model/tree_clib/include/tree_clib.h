@@ -15,6 +15,8 @@
 #ifndef TREE_CLIB_H
 #define TREE_CLIB_H
 
+#include <cstdint>
+
 #include "config.h"  // NOLINT
 
 extern "C" int Init(const int argc, const char **argv);
@@ -23,9 +25,32 @@ extern "C" int PrepareTrain(int num_graphs, void* list_ids,
                             void* list_start_node, void* list_col_start,
                             void* list_col_end, int num_nodes, int new_batch);
 
-extern "C" int AddGraph(int graph_idx, int num_nodes, int num_edges, void* prev_labels,
+extern "C" int AddGraph(int graph_idx, int num_nodes, int num_edges,
+                        void* prev_row_ptr, void* prev_cols, void* prev_signs,
                         void* edge_pairs, void* edge_signs, int n_left, int n_right);
 
+extern "C" int AddGraphDelta(int graph_idx, int prev_graph_idx,
+                             int num_added, void* added_pairs,
+                             int num_removed, void* removed_pairs);
+
+// Graph stores: the AddGraph arguments of many pairs in one mmapped file,
+// see graph_store.h. Pair pair_id is added like AddGraph, with its
+// previous-snapshot rows read from the mapping in place. StoreOpen returns
+// null if the file cannot be mapped or fails validation. StoreGetPairs fills
+// {num_nodes, num_edges} per pair. Graphs keep the mapping alive, so the
+// store may be freed once they are added.
+class GraphStore;
+
+extern "C" GraphStore* StoreOpen(const char* path);
+
+extern "C" int StoreFree(GraphStore* store);
+
+extern "C" int StoreNumPairs(GraphStore* store);
+
+extern "C" int StoreGetPairs(GraphStore* store, void* _info);
+
+extern "C" int AddGraphFromStore(int graph_idx, GraphStore* store, int pair_id);
+
 extern "C" int NumLeafNodes(int depth);
 
 extern "C" int GetLeafLabels(int lr, int ar, int depth, void* _labels);
@@ -103,10 +128,314 @@ extern "C" int NumBinNodes(int depth);
 
 extern "C" int SetBinaryFeat(int d, void* _pos_feat_ptr, void* _neg_feat_ptr, int dev);
 
+// Packed form of SetBinaryFeat: NumBinNodes(d) + 2 rows of BinaryFeatWidth()
+// uint32 words each, plus the number of valid bits per row in lens. Bit j of
+// row i is the 1 that SetBinaryFeat would write at column j.
+extern "C" int BinaryFeatWidth();
+
+extern "C" int GetBinaryPacked(int d, void* _lens, void* _bits_pos, void* _bits_neg);
+
+// out[i] = sum_{j < lens[i]} (pos_ij - neg_ij) * weight[j]
+//        + pad * sum_{lens[i] <= j < n_feats} weight[j]
+// i.e. (dense pos - dense neg) times an n_feats x out_dim row-major weight,
+// with pad the value the dense matrix holds past lens. Stateless.
+extern "C" int BinaryPackedMatMul(int n_rows, int n_ints, int n_feats,
+                                  int out_dim, void* _lens, void* _bits_pos,
+                                  void* _bits_neg, void* _weight, float pad,
+                                  void* _out);
+
 extern "C" int GetNextStates(void* _state_idx);
 
 extern "C" int GetNumNextStates();
 
 extern "C" int GetCurPos(void* _pos);
 
+// All index arrays of the current minibatch in one int32 buffer, segment k
+// being buf[offsets[k], offsets[k + 1]). Segments, in order:
+//   per tree depth d, per lr in {0, 1}:
+//     bot_froms, bot_tos, prev_froms, prev_tos
+//   row indices: bot_from, bot_to, prev_from, prev_to
+//   root: has_ch, del leaf mask, add leaf mask, del labels, add labels
+//   per level lv:
+//     is_internal, has_left, num_left, has_right, num_right,
+//     left del/add leaf mask, right del/add leaf mask,
+//     left del/add labels, right del/add labels,
+//     bot_left_froms, bot_left_tos, next_left_froms, next_left_tos
+// GetIndexLayout fills {num_depths, num_levels, num_segments, total_len}.
+extern "C" int GetIndexLayout(void* _layout);
+
+extern "C" int ExportIndices(void* _offsets, void* _buf);
+
+// Phase timers and counters, only kept by builds with -DTREE_STATS (make
+// USE_STATS=1). GetStats fills int64 slots in StatId order followed by
+// max_stat_depth jobs-per-depth slots (tree_stats.h) and returns the number
+// of slots written, 0 without stats. ResetStats zeroes them, e.g. per step.
+extern "C" int GetStats(void* _buf);
+
+extern "C" int ResetStats();
+
+// Batch memo: with it on, PrepareTrain stores what it built under the
+// request (ids, row ranges and col ranges of the graphs), and a repeated
+// request, e.g. the same slice in a later epoch, is served from the memo
+// without building any tree. Only the index export
+// (GetIndexLayout / ExportIndices) and the binary features (MaxBinFeatDepth,
+// NumBinNodes, SetBinaryFeat, GetBinaryPacked) are valid for a served
+// batch. Up to max_bytes are kept in memory, least recently used first out;
+// with a spill_path, entries pushed out go to that file instead of being
+// dropped. max_bytes 0 and no spill_path turn the memo off. Batches built by
+// a BatchPipeline do not use it.
+extern "C" int SetBatchMemo(int64_t max_bytes, const char* spill_path);
+
+// Work balancing, from the tree jobs each graph's target edges imply (see
+// batch_schedule.h); nothing is built. GraphJobProfile fills up to
+// max_depth int64 job counts per tree depth and returns the number of
+// depths. ScheduleBatches splits the num_graphs graphs of list_ids into
+// batches of at most batch_size with even predicted cost, level_cost being
+// the cost of one tree level in jobs. It fills order (num_graphs ids, batch
+// by batch), batch_sizes and, unless null, batch_costs (doubles), and
+// returns the number of batches. SliceRows splits the rows of a graph into
+// num_slices consecutive slices of even cost and fills their
+// num_slices + 1 boundaries, to train on with PrepareTrain(num_nodes =
+// starts[k + 1] - starts[k]).
+extern "C" int GraphJobProfile(int graph_id, int max_depth, void* _jobs);
+
+extern "C" int ScheduleBatches(int num_graphs, void* list_ids, int batch_size,
+                               double level_cost, void* _order,
+                               void* _batch_sizes, void* _batch_costs);
+
+extern "C" int SliceRows(int graph_id, int num_slices, void* _starts);
+
+// Context API: each function above has a ...Ctx twin that takes the context
+// to work on first. The plain versions run on a default context.
+class TreeLibContext;
+
+// Returns a fresh, empty context with the flags parsed as Init does; the
+// ...Ctx functions read them from the context.
+extern "C" TreeLibContext* InitCtx(const int argc, const char **argv);
+
+extern "C" int FreeCtx(TreeLibContext* ctx);
+
+extern "C" int PrepareTrainCtx(TreeLibContext* ctx, int num_graphs,
+                               void* list_ids, void* list_start_node,
+                               void* list_col_start, void* list_col_end,
+                               int num_nodes, int new_batch);
+
+extern "C" int AddGraphCtx(TreeLibContext* ctx, int graph_idx, int num_nodes,
+                           int num_edges, void* prev_row_ptr, void* prev_cols,
+                           void* prev_signs, void* edge_pairs, void* edge_signs,
+                           int n_left, int n_right);
+
+extern "C" int AddGraphDeltaCtx(TreeLibContext* ctx, int graph_idx,
+                                int prev_graph_idx, int num_added,
+                                void* added_pairs, int num_removed,
+                                void* removed_pairs);
+
+extern "C" int AddGraphFromStoreCtx(TreeLibContext* ctx, int graph_idx,
+                                    GraphStore* store, int pair_id);
+
+extern "C" int GetLeafLabelsCtx(TreeLibContext* ctx, int lr, int ar, int depth,
+                                void* _labels);
+
+extern "C" int GetLeafMaskCtx(TreeLibContext* ctx, int lr, int ar, int depth,
+                              void* _leaf_mask);
+
+extern "C" int NumLeavesCtx(TreeLibContext* ctx, int lr, int ar, int depth);
+
+extern "C" int NumRowBotCtx(TreeLibContext* ctx);
+
+extern "C" int NumRowPrevCtx(TreeLibContext* ctx);
+
+extern "C" int SetRowIndicesCtx(TreeLibContext* ctx, void* _bot_from,
+                                void* _bot_to, void* _prev_from,
+                                void* _prev_to);
+
+extern "C" int TotalTreeNodesCtx(TreeLibContext* ctx);
+
+extern "C" int SetTreeEmbedIdsCtx(TreeLibContext* ctx, int depth, int lr,
+                                  void* _bot_from, void* _bot_to,
+                                  void* _prev_from, void* _prev_to);
+
+extern "C" int SetRowEmbedIdsCtx(TreeLibContext* ctx, int lr, int level,
+                                 void* _bot_from, void* _bot_to,
+                                 void* _prev_from, void* _prev_to,
+                                 void* _past_from, void* _past_to);
+
+extern "C" int MaxTreeDepthCtx(TreeLibContext* ctx);
+
+extern "C" int NumBottomDepCtx(TreeLibContext* ctx, int depth, int lr);
+
+extern "C" int NumPrevDepCtx(TreeLibContext* ctx, int depth, int lr);
+
+extern "C" int NumRowBottomDepCtx(TreeLibContext* ctx, int lr);
+
+extern "C" int NumRowPastDepCtx(TreeLibContext* ctx, int lv, int lr);
+
+extern "C" int NumRowTopDepCtx(TreeLibContext* ctx, int lv, int lr);
+
+extern "C" int RowSumStepsCtx(TreeLibContext* ctx);
+
+extern "C" int RowMergeStepsCtx(TreeLibContext* ctx);
+
+extern "C" int NumRowSumOutCtx(TreeLibContext* ctx, int lr);
+
+extern "C" int NumRowSumNextCtx(TreeLibContext* ctx, int lr);
+
+extern "C" int SetRowSumIdsCtx(TreeLibContext* ctx, int lr, void* _step_from,
+                               void* _step_to, void* _next_input,
+                               void* _next_states);
+
+extern "C" int SetRowSumInitCtx(TreeLibContext* ctx, void* _init_idx);
+
+extern "C" int SetRowSumLastCtx(TreeLibContext* ctx, void* _last_idx);
+
+extern "C" int HasChildCtx(TreeLibContext* ctx, void* _has_child);
+
+extern "C" int NumCurNodesCtx(TreeLibContext* ctx, int depth);
+
+extern "C" int GetInternalMaskCtx(TreeLibContext* ctx, int depth,
+                                  void* _internal_mask);
+
+extern "C" int NumInternalNodesCtx(TreeLibContext* ctx, int depth);
+
+extern "C" int GetChMaskCtx(TreeLibContext* ctx, int lr, int depth,
+                            void* _ch_mask);
+
+extern "C" int GetNumChCtx(TreeLibContext* ctx, int lr, int depth,
+                           void* _num_ch);
+
+extern "C" int SetLeftStateCtx(TreeLibContext* ctx, int depth, void* _bot_from,
+                               void* _bot_to, void* _prev_from, void* _prev_to);
+
+extern "C" int NumLeftBotCtx(TreeLibContext* ctx, int depth);
+
+extern "C" int LeftRightSelectCtx(TreeLibContext* ctx, int depth,
+                                  void* _left_from, void* _left_to,
+                                  void* _right_from, void* _right_to);
+
+extern "C" int MaxBinFeatDepthCtx(TreeLibContext* ctx);
+
+extern "C" int NumBinNodesCtx(TreeLibContext* ctx, int depth);
+
+extern "C" int SetBinaryFeatCtx(TreeLibContext* ctx, int d, void* _pos_feat_ptr,
+                                void* _neg_feat_ptr, int dev);
+
+extern "C" int BinaryFeatWidthCtx(TreeLibContext* ctx);
+
+extern "C" int GetBinaryPackedCtx(TreeLibContext* ctx, int d, void* _lens,
+                                  void* _bits_pos, void* _bits_neg);
+
+extern "C" int GetNextStatesCtx(TreeLibContext* ctx, void* _state_idx);
+
+extern "C" int GetNumNextStatesCtx(TreeLibContext* ctx);
+
+extern "C" int GetCurPosCtx(TreeLibContext* ctx, void* _pos);
+
+extern "C" int GetIndexLayoutCtx(TreeLibContext* ctx, void* _layout);
+
+extern "C" int ExportIndicesCtx(TreeLibContext* ctx, void* _offsets,
+                                void* _buf);
+
+extern "C" int GetStatsCtx(TreeLibContext* ctx, void* _buf);
+
+extern "C" int ResetStatsCtx(TreeLibContext* ctx);
+
+extern "C" int SetBatchMemoCtx(TreeLibContext* ctx, int64_t max_bytes,
+                               const char* spill_path);
+
+extern "C" int GraphJobProfileCtx(TreeLibContext* ctx, int graph_id,
+                                  int max_depth, void* _jobs);
+
+extern "C" int ScheduleBatchesCtx(TreeLibContext* ctx, int num_graphs,
+                                  void* list_ids, int batch_size,
+                                  double level_cost, void* _order,
+                                  void* _batch_sizes, void* _batch_costs);
+
+extern "C" int SliceRowsCtx(TreeLibContext* ctx, int graph_id, int num_slices,
+                            void* _starts);
+
+// Prefetching: batches enqueued on a pipeline are built on a worker thread.
+// PipelineAcquire blocks until the oldest one is ready and returns the
+// context holding it, to be read with the ...Ctx getters until the next
+// PipelineAcquire. A null ctx means the default context.
+class BatchPipeline;
+
+extern "C" BatchPipeline* PipelineCreate(TreeLibContext* ctx, int num_slots);
+
+extern "C" int PipelineEnqueue(BatchPipeline* pipe, int num_graphs,
+                               void* list_ids, void* list_start_node,
+                               void* list_col_start, void* list_col_end,
+                               int num_nodes);
+
+extern "C" TreeLibContext* PipelineAcquire(BatchPipeline* pipe);
+
+extern "C" int PipelineFree(BatchPipeline* pipe);
+
+// Native row sampling for RecurTreeGen: SamplerAddRow starts a walk over the
+// row tree of one row and returns its id. Each SamplerStep advances every
+// walk until it needs the model and returns the number of ops of the round
+// (0 once all walks are done). SamplerGetOps fills 8 int32 per op,
+//   {op, wave, out, in0, in1, depth, arg0, arg1}
+// sorted by wave, see SamplerOp in tree_sampler.h; S_BITS ops read rows of
+// SamplerGetBits (BinaryFeatWidth() words each). After evaluating the round,
+// SamplerSetProbs takes one float per op, read for the P_* ops only.
+// SamplerGetWalk fills {input_slot, done, summary_slot, num_edges}; a done
+// walk is read with SamplerWalkLL/SamplerGetEdges and then released, which
+// recycles its slots. Slot ids stay below SamplerNumSlots(). Walks are keyed
+// by (graph_id, row), graph_id being the caller's index of the graph being
+// sampled: given the seed, the edges sampled for a row depend neither on
+// the order rows are added in nor on how many walks are in flight.
+class TreeSampler;
+
+extern "C" TreeSampler* SamplerCreate(int seed, float greedy_frac);
+
+// SamplerCreate with the flags (bits_compress, self_loop) of ctx.
+extern "C" TreeSampler* SamplerCreateCtx(TreeLibContext* ctx, int seed,
+                                         float greedy_frac);
+
+extern "C" int SamplerFree(TreeSampler* sampler);
+
+extern "C" int SamplerAddRow(TreeSampler* sampler, int graph_id, int row,
+                             int col_start, int col_end, int lb, int ub,
+                             int num_prev, void* _prev_cols);
+
+// Batched SamplerAddRow, e.g. the next row of every graph being sampled;
+// previous-snapshot columns of row i are prev_cols[prev_ptr[i], prev_ptr[i + 1]).
+extern "C" int SamplerAddRows(TreeSampler* sampler, int num_rows,
+                              void* _graph_ids, void* _rows, void* _col_starts,
+                              void* _col_ends, void* _lbs, void* _ubs,
+                              void* _prev_ptr, void* _prev_cols,
+                              void* _walk_ids);
+
+extern "C" int SamplerStep(TreeSampler* sampler);
+
+extern "C" int SamplerGetOps(TreeSampler* sampler, void* _ops);
+
+extern "C" int SamplerNumBits(TreeSampler* sampler);
+
+extern "C" int SamplerGetBits(TreeSampler* sampler, void* _lens,
+                              void* _bits_pos, void* _bits_neg);
+
+extern "C" int SamplerSetProbs(TreeSampler* sampler, void* _probs);
+
+extern "C" int SamplerNumSlots(TreeSampler* sampler);
+
+extern "C" int SamplerGetWalk(TreeSampler* sampler, int walk_id, void* _info);
+
+extern "C" double SamplerWalkLL(TreeSampler* sampler, int walk_id);
+
+extern "C" int SamplerGetEdges(TreeSampler* sampler, int walk_id, void* _cols,
+                               void* _signs);
+
+extern "C" int SamplerRelease(TreeSampler* sampler, int walk_id);
+
+// Batched SamplerGetWalk, 4 ints per walk.
+extern "C" int SamplerGetWalks(TreeSampler* sampler, int num_walks,
+                               void* _walk_ids, void* _info);
+
+// ll of each done walk, and their edges back to back in walk order (sized
+// from the num_edges of SamplerGetWalks); the walks are released.
+extern "C" int SamplerCollect(TreeSampler* sampler, int num_walks,
+                              void* _walk_ids, void* _lls, void* _cols,
+                              void* _signs);
+
 #endif
@@ -0,0 +1,129 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TREE_SAMPLER_H
+#define TREE_SAMPLER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "config.h"  // NOLINT
+#include "counter_rng.h"  // NOLINT
+
+class AdjNode;
+class NodeArena;
+
+// Model evaluations a sampler asks for. P_* ops want the probability of a
+// decision back through set_probs(); S_* ops compute a new state into slot
+// out. Slots EMPTY_SLOT, POS_SLOT and NEG_SLOT hold the constant states of an
+// empty tree and of a leaf with an added / deleted edge.
+enum SamplerOp
+{
+    P_HAS_CH = 0,       // in0
+    P_HAS_LEFT = 1,     // in0, depth
+    P_HAS_RIGHT = 2,    // in0, depth
+    P_SIGN = 3,         // in0, arg0 = edge sign
+    S_TOPDOWN_LEFT = 4, // in0, depth, arg0 = has_left, arg1 = left n_cols
+    S_L2R = 5,          // in0, in1 = left state, depth, arg1 = right n_cols
+    S_TOPRIGHT = 6,     // in0, depth, arg0 = has_right
+    S_MERGE = 7,        // in0 = left state, in1 = right state
+    S_BITS = 8          // arg0 = n_cols, arg1 = row of the round's bit table
+};
+
+const int EMPTY_SLOT = 0, POS_SLOT = 1, NEG_SLOT = 2;
+const int sampler_op_fields = 8;
+
+// Native driver of RecurTreeGen.gen_row. Each walk samples the row tree of
+// one row; the sampler runs all walks in flight until each is blocked on a
+// decision, and hands out the model evaluations they need as one batch of
+// ops per round. Within a round an op only reads slots written in earlier
+// rounds or by ops of a lower wave, so a caller can evaluate the round wave
+// by wave. Ops of a wave come grouped by (op, leaf sign, depth), so all ops
+// one batched model call serves are contiguous, whichever frontier (row or
+// sampled graph) they belong to. The walk of row `row` of graph graph_id
+// draws its decisions from CounterRng(seed, graph_id, row), so it samples
+// the same tree whatever order the rows are added in and however the walks
+// in flight interleave.
+class TreeSampler
+{
+ public:
+    // Row trees follow cfg (bits_compress, self_loop), copied here.
+    TreeSampler(const TreeConfig& cfg, int seed, float greedy_frac);
+    ~TreeSampler();
+
+    // prev_cols: sorted columns of the row in the previous snapshot, which
+    // decide whether a leaf is an add or a delete.
+    int add_row(int graph_id, int row, int col_start, int col_end, int lb,
+                int ub, int num_prev, int* prev_cols);
+    int step();
+    void set_probs(float* probs);
+    void release(int walk_id);
+
+    struct Walk
+    {
+        int row, lb, ub;
+        CounterRng rng;
+        NodeArena* arena;
+        std::vector<int> prev_cols;
+        std::vector<int> slots;
+        std::vector<int> cols, signs;
+        int input_slot, summary, num_edges;
+        double ll;
+        bool done;
+
+        // Row-tree recursion of gen_row, one frame per expanded node.
+        struct Frame
+        {
+            int node, state, lb, ub, phase;
+            int left_state, right_state, topdown;
+            int num_left, num_right, rlb, rub;
+            bool has_left, has_right;
+        };
+        std::vector<Frame> stack;
+        int ret_state, ret_num;
+        // Decision the walk is blocked on.
+        int wait_op, wait_kind, leaf_node, leaf_sign;
+        float prob;
+        int leaf_state;
+        bool leaf_has;
+    };
+
+    std::vector<Walk*> walks;
+    std::vector<int> ops;
+    std::vector<int> bit_lens;
+    std::vector<uint32_t> bit_pos, bit_neg;
+    int num_slots;
+
+ private:
+    void run(Walk* w);
+    bool begin_leaf(Walk* w, int state, AdjNode* node, bool forced);
+    void finish_leaf(Walk* w, AdjNode* node, int sign, bool forced);
+    int emit(Walk* w, int op, int in0, int in1, int depth, int arg0,
+             int arg1, bool has_out);
+    int new_slot(Walk* w);
+    void push_frame(Walk* w, int node, int state, int lb, int ub);
+    void pop_frame(Walk* w, int state, int num);
+    bool decide(Walk* w, float p);
+    float fix_prob(float p);
+
+    TreeConfig cfg;
+    uint64_t seed;
+    float greedy_frac;
+    int round;
+    std::vector<int> free_slots, free_walks;
+    std::vector<NodeArena*> free_arenas;
+    std::vector<int> slot_round, slot_wave;
+};
+
+#endif
@@ -0,0 +1,95 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TREE_STATS_H
+#define TREE_STATS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+// Per-context phase timers and counters, read with GetStats. They are only
+// compiled in with -DTREE_STATS (make USE_STATS=1); otherwise the STAT_*
+// macros expand to nothing and GetStats reports no stats.
+// Keep in sync with TreeLib.STAT_NAMES in tree_lib.py.
+enum StatId
+{
+    STAT_ADD_GRAPH_NS = 0,  // AddGraph*: edge bucketing and prev rows
+    STAT_EDGES_ADDED,
+    STAT_NUM_BATCHES,       // PrepareTrain calls
+    STAT_PREPARE_NS,        // whole batch build
+    STAT_REALIZE_NS,        // row trees, add_job included
+    STAT_ADD_JOB_NS,        // summed over threads with parallel_build
+    STAT_ROW_INDICES_NS,
+    STAT_EXPORT_NS,         // index packing and export
+    STAT_BYTES_EXPORTED,    // by the index, binary feature and packed exports
+    STAT_ROWS_REALIZED,
+    STAT_NODES_ALLOCATED,   // tree nodes over all batches
+    STAT_JOBS,
+    STAT_ARENA_HIGH_WATER,  // most tree nodes in one batch
+    STAT_ARENA_BYTES,       // arena capacity, kept across batches
+    STAT_MEMO_HITS,         // batches served by SetBatchMemo
+    NUM_STATS
+};
+
+// Jobs per tree depth follow the NUM_STATS values in GetStats; deeper
+// levels are counted in the last slot.
+static const int max_stat_depth = 32;
+
+struct TreeStats
+{
+    int64_t values[NUM_STATS];
+    int64_t jobs_per_depth[max_stat_depth];
+
+    TreeStats() { reset(); }
+
+    void reset()
+    {
+        std::memset(values, 0, sizeof(values));
+        std::memset(jobs_per_depth, 0, sizeof(jobs_per_depth));
+    }
+};
+
+class ScopedStatTimer
+{
+ public:
+    ScopedStatTimer(TreeStats& stats, StatId id)
+        : value(stats.values[id]), start(std::chrono::steady_clock::now()) {}
+
+    ~ScopedStatTimer()
+    {
+        value += std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+ private:
+    int64_t& value;
+    std::chrono::steady_clock::time_point start;
+};
+
+#ifdef TREE_STATS
+#define STAT_CONCAT_(a, b) a##b
+#define STAT_CONCAT(a, b) STAT_CONCAT_(a, b)
+#define STAT_SCOPE(stats, id) ScopedStatTimer STAT_CONCAT(stat_timer_, __LINE__)((stats), (id))
+#define STAT_ADD(stats, id, n) ((stats).values[(id)] += (n))
+#define STAT_MAX(stats, id, n) \
+    ((stats).values[(id)] = std::max<int64_t>((stats).values[(id)], (n)))
+#else
+#define STAT_SCOPE(stats, id)
+#define STAT_ADD(stats, id, n)
+#define STAT_MAX(stats, id, n)
+#endif
+
+#endif
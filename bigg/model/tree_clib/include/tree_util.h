@@ -17,9 +17,13 @@
 
 #include <vector>
 #include <map>
+#include "config.h"  // NOLINT
 #include "struct_util.h"  // NOLINT
 
 class AdjNode;
+class NodeArena;
+class BatchMemo;
+struct BatchMemoEntry;
 extern int total_job_nums;
 extern std::vector<AdjNode*> global_job_nodes;
 
@@ -27,43 +31,137 @@ class AdjNode
 {
  public:
     AdjNode(){}
-    AdjNode(AdjNode* parent, int row, int col_begin, int col_end, int depth);
-    ~AdjNode();
-    void init(AdjNode* parent, int row, int col_begin, int col_end, int depth);
-    void split();
-    void update_bits(int weight);
+    void init(int idx, int parent, int row, int col_begin, int col_end,
+              int depth, NodeArena& arena);
+    void split(NodeArena& arena);
+    void update_bits(NodeArena& arena, int weight = 0);
 
-    AdjNode *parent, *lch, *rch;
+    // Children and parent are indices into the owning NodeArena, -1 if none.
+    int idx, parent, lch, rch;
     int global_idx;
     int row, col_begin, col_end, mid;
     int depth, n_cols;
     bool is_leaf, is_root;
     bool has_edge, is_lowlevel;
-    BitSet bits_rep_pos;
-    BitSet bits_rep_neg;
+    // n_words words each, owned by the arena; nullptr unless bits_compress
+    // is on.
+    uint32_t* bits_rep_pos;
+    uint32_t* bits_rep_neg;
     int weight = 0;
     int job_idx;
 };
 
-extern PtHolder<AdjNode> node_holder;
+// Contiguous storage for the AdjNodes of a minibatch. Nodes live in fixed-size
+// chunks that are never reallocated, so AdjNode* handed out stay valid until
+// the next reset(), and the chunks are kept for reuse across batches. With
+// bits_compress on, the bit representations sit in a parallel chunk of
+// bit words, so nodes stay small when they are not needed. The chunks are
+// laid out for n_words words per set; when Init picks another width they
+// are freed on the next reset() and allocated again.
+class NodeArena
+{
+ public:
+    // cfg is the config of the owner and must outlive the arena.
+    explicit NodeArena(const TreeConfig& cfg);
+    ~NodeArena();
+    void reset();
+    AdjNode* new_node(int parent, int row, int col_begin, int col_end,
+                      int depth);
+    inline AdjNode* get(int idx)
+    {
+        return chunks[idx >> chunk_bits] + (idx & (chunk_size - 1));
+    }
+
+    static const int chunk_bits = 12;
+    static const int chunk_size = 1 << chunk_bits;
+    std::vector<AdjNode*> chunks;
+    std::vector<uint32_t*> bit_chunks;
+    int num_nodes;
+    // Words per bit set in bit_chunks, 0 with bits_compress off, and the
+    // routines for that width.
+    uint32_t n_words;
+    BitSet bits;
+    const TreeConfig* cfg;
+
+ private:
+    void release();
+};
+
 
 class AdjRow
 {
  public:
     AdjRow(){}
-    AdjRow(int row, int col_start, int col_end);
-    ~AdjRow();
-    void init(int row, int col_start, int col_end);
+    AdjRow(int row, int col_start, int col_end, NodeArena& arena);
+    void init(int row, int col_start, int col_end, NodeArena& arena);
 
-    void insert_edges(std::vector<std::pair<int, int> >& edge_list, std::vector<int>& prev_row);
+    void insert_edges(std::pair<int, int>* indices, int num_indices,
+                      std::pair<int, int>* prev_indices, int num_prev,
+                      JobCollect& jobs, NodeArena& arena,
+                      std::pair<int, int>* prev_edits = nullptr,
+                      int num_edits = 0);
     AdjNode* root;
     int row, max_col;
 
  private:
-    void add_edges(AdjNode* node, ColAutomata* col_sm);
+    void add_edges(AdjNode* node, ColAutomata* col_sm, JobCollect& jobs,
+                   NodeArena& arena);
+};
+
+
+// Job lists and node/row pools private to one graph, so that PrepareTrain can
+// build the row trees of a minibatch in parallel and merge them afterwards.
+class TreeShard
+{
+ public:
+    explicit TreeShard(const TreeConfig& cfg);
+    void reset();
+
+    JobCollect job_collect;
+    NodeArena node_arena;
+    PtHolder<AdjRow> row_holder;
+};
+
+// Registered graphs and minibatch state of one model. Everything the
+// exported functions touch lives here, so independent contexts can build
+// batches concurrently.
+class TreeLibContext
+{
+ public:
+    TreeLibContext();
+    ~TreeLibContext();
+    // Empties active_graphs, freeing the permuted copies among them.
+    void clear_active_graphs();
+
+    // Flags of InitCtx; Init sets those of the default context.
+    TreeConfig cfg;
+
+    // False for contexts that borrow another context's graphs.
+    bool owns_graphs;
+    std::vector<GraphStruct*> graph_list;
+    std::vector<GraphStruct*> active_graphs;
+    // (node_start, node_end) of each active graph in the current batch.
+    std::vector<std::pair<int, int> > active_ranges;
+    JobCollect job_collect;
+    NodeArena node_arena;
+    PtHolder<AdjRow> row_holder;
+    // Shards holding the trees of the current batch, 0 for a serial build.
+    std::vector<TreeShard*> shard_list;
+    int num_active_shards;
+    // Index export of the current batch, filled on first use.
+    bool indices_cached;
+    int num_index_depths, num_index_levels;
+    std::vector<int> index_offsets, index_buf;
+    // Accumulated until ResetStats; see tree_stats.h.
+    TreeStats stats;
+    // Prepared batches by request (SetBatchMemo), nullptr when off, and the
+    // entry the current batch was served from, if any.
+    BatchMemo* batch_memo;
+    std::shared_ptr<const BatchMemoEntry> memo_entry;
 };
 
-extern PtHolder<AdjRow> row_holder;
+// Context behind the original, context-free API.
+TreeLibContext* default_context();
 
 
 #endif
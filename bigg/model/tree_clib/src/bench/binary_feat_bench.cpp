@@ -0,0 +1,86 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Host-side binary feature expansion (build_binary_mat_cpu) against a plain
+// per-bit loop that mirrors binary_build_kernel in cuda_ops.cu. Rows get a
+// random length in [1, bits] and the output is prefilled with a sentinel so
+// untouched tails are compared too; any mismatch is reported and fails.
+// Usage: binary_feat_bench [num_rows] [bits] [dim_embed]
+// Output is CSV: num_rows,bits,dim_embed,mode,us_per_call,mismatches
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "cpu_ops.h"  // NOLINT
+
+void reference_mat(int n_rows, int n_ints, int n_feats, int* lens,
+                   uint32_t* bits, float* outptr)
+{
+    for (int row = 0; row < n_rows; ++row)
+        for (int i = 0; i < lens[row]; ++i)
+        {
+            uint32_t bit = bits[row * n_ints + i / 32] & ((uint32_t)1 << (i % 32));
+            outptr[row * n_feats + i] = bit ? 1 : 0;
+        }
+}
+
+template<typename F>
+double time_us(F f, int reps)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r)
+        f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(t1 - t0).count() / reps;
+}
+
+int main(int argc, char** argv)
+{
+    int num_rows = argc > 1 ? atoi(argv[1]) : 100000;
+    int bits = argc > 2 ? atoi(argv[2]) : 256;
+    int dim_embed = argc > 3 ? atoi(argv[3]) : 256;
+    int n_ints = (bits + 31) / 32;
+
+    std::mt19937 rng(1);
+    std::vector<int> lens(num_rows);
+    std::vector<uint32_t> packed((size_t)num_rows * n_ints);
+    for (int i = 0; i < num_rows; ++i)
+        lens[i] = 1 + rng() % bits;
+    for (auto& w : packed)
+        w = rng();
+
+    std::vector<float> ref((size_t)num_rows * dim_embed, -5.0f);
+    std::vector<float> out((size_t)num_rows * dim_embed, -5.0f);
+    reference_mat(num_rows, n_ints, dim_embed, lens.data(), packed.data(), ref.data());
+    build_binary_mat_cpu(num_rows, n_ints, dim_embed, lens.data(), packed.data(), out.data());
+    long long bad = 0;
+    for (size_t i = 0; i < out.size(); ++i)
+        bad += out[i] != ref[i];
+
+    int reps = 20;
+    double t_ref = time_us([&]() {
+        reference_mat(num_rows, n_ints, dim_embed, lens.data(), packed.data(), ref.data());
+    }, reps);
+    double t_cpu = time_us([&]() {
+        build_binary_mat_cpu(num_rows, n_ints, dim_embed, lens.data(), packed.data(), out.data());
+    }, reps);
+
+    printf("num_rows,bits,dim_embed,mode,us_per_call,mismatches\n");
+    printf("%d,%d,%d,reference,%.1f,0\n", num_rows, bits, dim_embed, t_ref);
+    printf("%d,%d,%d,cpu_ops,%.1f,%lld\n", num_rows, bits, dim_embed, t_cpu, bad);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Packed binary features against the dense path PrepareBinary takes today:
+// "dense" expands pos and neg into -5/5-prefilled float matrices, subtracts
+// them and multiplies by a dim_embed x out_dim weight; "packed" feeds the
+// uint32 rows straight to binary_packed_matmul. Reports the host bytes each
+// mode hands over and the max abs difference of the products.
+// Usage: binary_packed_bench [num_rows] [bits] [dim_embed] [out_dim]
+// Output is CSV: num_rows,bits,dim_embed,out_dim,mode,bytes,us_per_call,max_diff
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "cpu_ops.h"  // NOLINT
+
+int num_rows, bits, dim_embed, out_dim, n_ints;
+std::vector<int> lens;
+std::vector<uint32_t> bits_pos, bits_neg;
+std::vector<float> weight, pos_feat, neg_feat, dense_out, packed_out;
+
+void run_dense()
+{
+    std::fill(pos_feat.begin(), pos_feat.end(), -5.0f);
+    std::fill(neg_feat.begin(), neg_feat.end(), 5.0f);
+    build_binary_mat_cpu(num_rows, n_ints, dim_embed, lens.data(), bits_pos.data(), pos_feat.data());
+    build_binary_mat_cpu(num_rows, n_ints, dim_embed, lens.data(), bits_neg.data(), neg_feat.data());
+    std::fill(dense_out.begin(), dense_out.end(), 0.0f);
+    for (int i = 0; i < num_rows; ++i)
+    {
+        float* out = dense_out.data() + (size_t)i * out_dim;
+        for (int j = 0; j < dim_embed; ++j)
+        {
+            float f = pos_feat[(size_t)i * dim_embed + j] - neg_feat[(size_t)i * dim_embed + j];
+            const float* wr = weight.data() + (size_t)j * out_dim;
+            for (int k = 0; k < out_dim; ++k)
+                out[k] += f * wr[k];
+        }
+    }
+}
+
+void run_packed()
+{
+    binary_packed_matmul(num_rows, n_ints, dim_embed, out_dim, lens.data(),
+                         bits_pos.data(), bits_neg.data(), weight.data(),
+                         -10.0f, packed_out.data());
+}
+
+template<typename F>
+double time_us(F f, int reps)
+{
+    auto t0 = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r)
+        f();
+    auto t1 = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(t1 - t0).count() / reps;
+}
+
+int main(int argc, char** argv)
+{
+    num_rows = argc > 1 ? atoi(argv[1]) : 20000;
+    bits = argc > 2 ? atoi(argv[2]) : 64;
+    dim_embed = argc > 3 ? atoi(argv[3]) : 256;
+    out_dim = argc > 4 ? atoi(argv[4]) : 256;
+    n_ints = (bits + 31) / 32;
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> unif(-0.1f, 0.1f);
+    lens.resize(num_rows);
+    bits_pos.resize((size_t)num_rows * n_ints);
+    bits_neg.resize((size_t)num_rows * n_ints);
+    for (int i = 0; i < num_rows; ++i)
+    {
+        lens[i] = 1 + rng() % bits;
+        for (int w = 0; w < n_ints; ++w)
+        {
+            // A column is added, deleted or untouched, never both.
+            uint32_t p = rng(), n = rng() & ~p;
+            bits_pos[(size_t)i * n_ints + w] = p;
+            bits_neg[(size_t)i * n_ints + w] = n;
+        }
+    }
+    weight.resize((size_t)dim_embed * out_dim);
+    for (auto& w : weight)
+        w = unif(rng);
+    pos_feat.resize((size_t)num_rows * dim_embed);
+    neg_feat.resize((size_t)num_rows * dim_embed);
+    dense_out.resize((size_t)num_rows * out_dim);
+    packed_out.resize((size_t)num_rows * out_dim);
+
+    int reps = 5;
+    double t_dense = time_us(run_dense, reps);
+    double t_packed = time_us(run_packed, reps);
+    double max_diff = 0;
+    for (size_t i = 0; i < dense_out.size(); ++i)
+        max_diff = std::max(max_diff, (double)std::fabs(dense_out[i] - packed_out[i]));
+
+    long long dense_bytes = 2LL * num_rows * dim_embed * sizeof(float);
+    long long packed_bytes = (long long)num_rows * (sizeof(int) + 2 * n_ints * sizeof(uint32_t));  // NOLINT
+    printf("num_rows,bits,dim_embed,out_dim,mode,bytes,us_per_call,max_diff\n");
+    printf("%d,%d,%d,%d,dense,%lld,%.1f,0\n", num_rows, bits, dim_embed, out_dim, dense_bytes, t_dense);  // NOLINT
+    printf("%d,%d,%d,%d,packed,%lld,%.1f,%g\n", num_rows, bits, dim_embed, out_dim, packed_bytes, t_packed, max_diff);  // NOLINT
+    return max_diff < 1e-3 ? 0 : 1;
+}
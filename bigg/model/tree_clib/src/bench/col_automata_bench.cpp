@@ -0,0 +1,94 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Per-row ColAutomata setup cost: the old heap-allocated automaton holding a
+// copy of the dense previous row, against the borrowed stack view.
+// Output is CSV: num_nodes,mode,rows,ns_per_row,checksum
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "config.h"  // NOLINT
+#include "struct_util.h"  // NOLINT
+
+struct DenseRowAutomata
+{
+    DenseRowAutomata(std::vector<int>& prev_row)
+    {
+        this->prev_row = prev_row;
+    }
+    bool had_edge(int ix) { return prev_row[ix] == 1; }
+    std::vector<int> prev_row;
+};
+
+double elapsed_ns(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double, std::nano>(
+        std::chrono::steady_clock::now() - t).count();
+}
+
+int main(int argc, char** argv)
+{
+    int avg_degree = argc > 1 ? atoi(argv[1]) : 20;  // NOLINT
+    std::default_random_engine rng(1);
+    printf("num_nodes,mode,rows,ns_per_row,checksum\n");
+    for (int n : {1000, 5000, 10000})
+    {
+        std::vector<std::vector<int> > dense(n);
+        std::vector<int> row_ptr(1, 0);
+        std::vector<std::pair<int, int> > prev_edges;
+        for (int i = 0; i < n; ++i)
+        {
+            dense[i].assign(i, 0);
+            if (i == 0)
+            {
+                row_ptr.push_back(0);
+                continue;
+            }
+            std::uniform_int_distribution<int> col(0, i - 1);
+            int deg = std::min(i, avg_degree / 2);
+            for (int k = 0; k < deg; ++k)
+                dense[i][col(rng)] = 1;
+            for (int j = 0; j < i; ++j)
+                if (dense[i][j])
+                    prev_edges.push_back(std::make_pair(j, 1));
+            row_ptr.push_back(prev_edges.size());
+        }
+
+        long long checksum = 0;
+        auto t = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; ++i)
+        {
+            auto* col_sm = new DenseRowAutomata(dense[i]);
+            checksum += i ? col_sm->had_edge(i - 1) : 0;
+            delete col_sm;
+        }
+        printf("%d,dense_copy,%d,%.1f,%lld\n", n, n, elapsed_ns(t) / n, checksum);
+
+        checksum = 0;
+        t = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; ++i)
+        {
+            int b = row_ptr[i];
+            ColAutomata col_sm(nullptr, 0, prev_edges.data() + b,
+                               row_ptr[i + 1] - b);
+            checksum += i ? col_sm.had_edge(i - 1) : 0;
+        }
+        printf("%d,borrowed_view,%d,%.1f,%lld\n", n, n, elapsed_ns(t) / n, checksum);
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Time to ingest one snapshot's target edges with AddGraph, i.e. to bucket
+// them into sorted rows, for growing edge counts on a fixed node count.
+//   edge_ingest_bench [num_nodes] [max_edges]
+// Output is CSV: num_nodes,num_edges,ms,ns_per_edge
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "tree_clib.h"  // NOLINT
+
+int main(int argc, char** argv)
+{
+    int n = argc > 1 ? atoi(argv[1]) : 1000000;
+    int max_edges = argc > 2 ? atoi(argv[2]) : 10000000;
+    const char* args[] = {"bench", "-bits_compress", "0", "-gpu", "-1"};
+    Init(5, args);
+
+    std::default_random_engine rng(1);
+    std::uniform_int_distribution<int> node(0, n - 1);
+    printf("num_nodes,num_edges,ms,ns_per_edge\n");
+    int gid = 0;
+    for (int m = 10000; m <= max_edges; m *= 10)
+    {
+        // Random pairs, either orientation; duplicates are fine for timing.
+        std::vector<int> pairs, signs(m, 1);
+        pairs.reserve(2 * m);
+        while ((int)pairs.size() < 2 * m)
+        {
+            int x = node(rng), y = node(rng);
+            if (x == y)
+                continue;
+            pairs.push_back(x);
+            pairs.push_back(y);
+        }
+        auto t = std::chrono::steady_clock::now();
+        AddGraph(gid++, n, m, nullptr, nullptr, nullptr, pairs.data(),
+                 signs.data(), -1, -1);
+        double ms = std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t).count();
+        printf("%d,%d,%.1f,%.1f\n", n, m, ms, ms * 1e6 / m);
+    }
+    return 0;
+}
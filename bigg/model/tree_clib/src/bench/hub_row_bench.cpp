@@ -0,0 +1,106 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Per-row tree construction cost on hub rows, where one side of the row is
+// dense. "hub" rows carry d new edges; "hub_prev" rows carry 8 new edges
+// against a previous row with d edges, which is what the had_edge cursor
+// has to skip through. A row tree with d edges over n columns has about
+// 2 d log2(n / d) nodes, as the top levels are shared, and "hub" rows should
+// cost a flat time per node, i.e. the last column should stay roughly flat
+// once d is large enough to hide the fixed cost of a row. "hub_prev" rows
+// should barely depend on d at all.
+// Output is CSV: num_cols,mode,degree,tree_nodes,ns_per_row,ns_per_node
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "tree_clib.h"  // NOLINT
+#include "struct_util.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+std::vector<std::pair<int, int> > sample_row(int n, int d, int sign,
+                                             std::default_random_engine& rng)
+{
+    std::uniform_int_distribution<int> col(0, n - 1);
+    std::vector<int> cols;
+    while ((int)cols.size() < d)
+    {
+        cols.push_back(col(rng));
+        if ((int)cols.size() == d)
+        {
+            std::sort(cols.begin(), cols.end());
+            cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+        }
+    }
+    std::vector<std::pair<int, int> > row;
+    for (int c : cols)
+        row.push_back(std::make_pair(c, sign));
+    return row;
+}
+
+int main(int argc, char** argv)
+{
+    const char* args[] = {"bench", "-bits_compress", "0", "-gpu", "-1"};
+    Init(5, args);
+
+    std::default_random_engine rng(1);
+    JobCollect jobs;
+    NodeArena arena(default_context()->cfg);
+    const int rows = 200;
+    printf("num_cols,mode,degree,tree_nodes,ns_per_row,ns_per_node\n");
+    for (int n : {1 << 10, 1 << 13, 1 << 16})
+    {
+        for (int d : {16, 128, 1024, 8192})
+        {
+            if (d > n / 2)
+                continue;
+            for (int hub_prev = 0; hub_prev < 2; ++hub_prev)
+            {
+                std::vector<std::vector<std::pair<int, int> > > cur, prev;
+                for (int r = 0; r < rows; ++r)
+                {
+                    cur.push_back(sample_row(n, hub_prev ? 8 : d, 1, rng));
+                    prev.push_back(hub_prev ? sample_row(n, d, 1, rng) :
+                                   std::vector<std::pair<int, int> >());
+                    // Columns present in both rows become deletions.
+                    for (auto& e : cur.back())
+                        if (std::binary_search(prev.back().begin(), prev.back().end(), e))
+                            e.second = -1;
+                }
+                double total = 0;
+                long long nodes = 0;
+                for (int r = 0; r < rows; ++r)
+                {
+                    jobs.reset();
+                    arena.reset();
+                    auto t = std::chrono::steady_clock::now();
+                    AdjRow row(n, 0, n, arena);
+                    row.insert_edges(cur[r].data(), cur[r].size(),
+                                     prev[r].data(), prev[r].size(), jobs, arena);
+                    total += std::chrono::duration<double, std::nano>(
+                        std::chrono::steady_clock::now() - t).count();
+                    nodes += arena.num_nodes;
+                }
+                double ns = total / rows;
+                printf("%d,%s,%d,%lld,%.0f,%.2f\n", n,
+                       hub_prev ? "hub_prev" : "hub", d, nodes / rows, ns,
+                       ns * rows / nodes);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,156 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Cost of the per-step leaf export that RecurTreeGen._predict_leaves does:
+// NumLeaves, GetLeafMask and GetLeafLabels for every depth, side and
+// add/delete. "copy" replays the old getters, which copied the per-depth
+// lists (and for NumLeaves the whole list of lists) before reading them.
+// Usage: leaf_label_bench [num_graphs] [num_nodes] [avg_degree]
+// Output is CSV: num_graphs,num_nodes,depths,mode,us_per_step
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "tree_clib.h"  // NOLINT
+#include "struct_util.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+TreeLibContext* ctx;
+
+int copy_num_leaves(int lr, int ar, int depth)
+{
+    std::vector<std::vector<int>> weights;
+    if (lr < 0)
+        weights = (ar > 0) ? ctx->job_collect.left_add_weights : ctx->job_collect.left_del_weights;
+    else
+        weights = (ar > 0) ? ctx->job_collect.right_add_weights : ctx->job_collect.right_del_weights;
+    if (depth >= (int)weights.size())
+        return 0;
+    return weights[depth].size();
+}
+
+void copy_get(const std::vector<std::vector<int> >& lists, int depth, int* out)
+{
+    std::vector<int> weights;
+    weights = lists[depth];
+    std::memcpy(out, weights.data(), weights.size() * sizeof(int));
+}
+
+void copy_step(int num_depths, std::vector<int>& buf)
+{
+    for (int d = 0; d < num_depths; ++d)
+        for (int lr = -1; lr <= 1; lr += 2)
+            for (int ar = -1; ar <= 1; ar += 2)
+            {
+                auto& masks = lr < 0 ? (ar < 0 ? ctx->job_collect.has_left_del_leaf : ctx->job_collect.has_left_add_leaf)
+                    : (ar < 0 ? ctx->job_collect.has_right_del_leaf : ctx->job_collect.has_right_add_leaf);
+                auto& labels = lr < 0 ? (ar > 0 ? ctx->job_collect.left_add_weights : ctx->job_collect.left_del_weights)
+                    : (ar > 0 ? ctx->job_collect.right_add_weights : ctx->job_collect.right_del_weights);
+                copy_get(masks, d, buf.data());
+                if (copy_num_leaves(lr, ar, d))
+                    copy_get(labels, d, buf.data());
+            }
+}
+
+void const_ref_step(int num_depths, std::vector<int>& buf)
+{
+    for (int d = 0; d < num_depths; ++d)
+        for (int lr = -1; lr <= 1; lr += 2)
+            for (int ar = -1; ar <= 1; ar += 2)
+            {
+                GetLeafMaskCtx(ctx, lr, ar, d, buf.data());
+                if (NumLeavesCtx(ctx, lr, ar, d))
+                    GetLeafLabelsCtx(ctx, lr, ar, d, buf.data());
+            }
+}
+
+int main(int argc, char** argv)
+{
+    int num_graphs = argc > 1 ? atoi(argv[1]) : 32;  // NOLINT
+    int n = argc > 2 ? atoi(argv[2]) : 2000;  // NOLINT
+    int avg_degree = argc > 3 ? atoi(argv[3]) : 10;  // NOLINT
+    const char* args[] = {"bench", "-bits_compress", "0", "-gpu", "-1"};
+    ctx = InitCtx(5, args);
+
+    std::default_random_engine rng(1);
+    for (int g = 0; g < num_graphs; ++g)
+    {
+        std::vector<int> prev_row_ptr(1, 0), prev_cols, prev_signs;
+        std::vector<int> edge_pairs, edge_signs;
+        for (int i = 0; i < n; ++i)
+        {
+            std::vector<int> cols;
+            if (i)
+            {
+                std::uniform_int_distribution<int> col(0, i - 1);
+                for (int k = 0; k < avg_degree / 2; ++k)
+                    cols.push_back(col(rng));
+            }
+            std::sort(cols.begin(), cols.end());
+            cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+            for (size_t k = 0; k < cols.size(); ++k)
+            {
+                edge_pairs.push_back(i);
+                edge_pairs.push_back(cols[k]);
+                edge_signs.push_back((k & 1) ? -1 : 1);
+                if (k & 1)
+                {
+                    prev_cols.push_back(cols[k]);
+                    prev_signs.push_back(1);
+                }
+            }
+            prev_row_ptr.push_back(prev_cols.size());
+        }
+        AddGraphCtx(ctx, g, n, edge_signs.size(), prev_row_ptr.data(),
+                    prev_cols.data(), prev_signs.data(), edge_pairs.data(),
+                    edge_signs.data(), -1, -1);
+    }
+    std::vector<int> ids(num_graphs), starts(num_graphs, 0);
+    std::vector<int> col_start(num_graphs, -1), col_end(num_graphs, -1);
+    for (int g = 0; g < num_graphs; ++g)
+        ids[g] = g;
+    PrepareTrainCtx(ctx, num_graphs, ids.data(), starts.data(),
+                    col_start.data(), col_end.data(), -1, 1);
+
+    // Every side/add-delete list of masks has one entry per internal node.
+    int num_depths = (int)ctx->job_collect.has_left.size();
+    size_t max_len = 0;
+    for (auto& l : ctx->job_collect.has_left)
+        max_len = std::max(max_len, l.size());
+    std::vector<int> buf(max_len + 1);
+
+    const int reps = 50;
+    printf("num_graphs,num_nodes,depths,mode,us_per_step\n");
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        auto t = std::chrono::steady_clock::now();
+        for (int r = 0; r < reps; ++r)
+        {
+            if (mode)
+                const_ref_step(num_depths, buf);
+            else
+                copy_step(num_depths, buf);
+        }
+        double us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - t).count() / reps;
+        printf("%d,%d,%d,%s,%.1f\n", num_graphs, n, num_depths,
+               mode ? "const_ref" : "copy", us);
+    }
+    return 0;
+}
@@ -0,0 +1,234 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Tree node throughput of PrepareTrain on a 100k-row batch, then the node
+// allocation of that batch alone: the nodes PrepareTrain made are allocated
+// again in the same order from a NodeArena ("arena") and from a replica of
+// the per-node pool it replaced ("holder": one heap AdjNode per node, linked
+// by pointers, with std::vector bit sets, recycled through a PtHolder).
+// heap_kb is what the pool holds on the heap after the batch (glibc only).
+// Usage: node_arena_bench [num_graphs] [num_nodes] [avg_degree] [bits_compress]
+// Output is CSV: mode,rows,tree_nodes,nodes_per_sec,peak_rss_kb,heap_kb
+
+#include <sys/resource.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include "tree_clib.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+static long heap_kb()
+{
+#ifdef __GLIBC__
+    return mallinfo2().uordblks / 1024;
+#else
+    return -1;
+#endif
+}
+
+// AdjNode as it was before NodeArena.
+struct HolderNode
+{
+    HolderNode(HolderNode* parent, int row, int col_begin, int col_end,
+               int depth, int bits)
+    {
+        init(parent, row, col_begin, col_end, depth, bits);
+    }
+
+    void init(HolderNode* parent, int row, int col_begin, int col_end,
+              int depth, int bits)
+    {
+        this->parent = parent;
+        lch = rch = nullptr;
+        this->row = row;
+        this->col_begin = col_begin;
+        this->col_end = col_end;
+        this->depth = depth;
+        mid = (col_begin + col_end) / 2;
+        n_cols = col_end - col_begin;
+        is_lowlevel = n_cols <= bits;
+        is_leaf = n_cols <= 1;
+        is_root = parent == nullptr;
+        if (is_lowlevel)
+        {
+            bits_rep_pos = std::vector<uint32_t>((bits + 31) / 32, 0);
+            bits_rep_neg = std::vector<uint32_t>((bits + 31) / 32, 0);
+        }
+        has_edge = false;
+        job_idx = -1;
+        weight = 0;
+    }
+
+    HolderNode *parent, *lch, *rch;
+    int global_idx, row, col_begin, col_end, mid, depth, n_cols;
+    bool is_leaf, is_root, has_edge, is_lowlevel;
+    std::vector<uint32_t> bits_rep_pos, bits_rep_neg;
+    int weight, job_idx;
+};
+
+int main(int argc, char** argv)
+{
+    int num_graphs = argc > 1 ? atoi(argv[1]) : 50;  // NOLINT
+    int n = argc > 2 ? atoi(argv[2]) : 2000;  // NOLINT
+    int avg_degree = argc > 3 ? atoi(argv[3]) : 10;  // NOLINT
+    std::string bits = argc > 4 ? argv[4] : "0";
+    const char* args[] = {"bench", "-bits_compress", bits.c_str(),
+                          "-embed_dim", "16", "-gpu", "-1"};
+    Init(7, args);
+
+    std::default_random_engine rng(1);
+    for (int g = 0; g < num_graphs; ++g)
+    {
+        std::vector<int> prev_row_ptr(1, 0), prev_cols, prev_signs;
+        std::vector<int> edge_pairs, edge_signs;
+        for (int i = 0; i < n; ++i)
+        {
+            std::vector<int> cols;
+            if (i)
+            {
+                std::uniform_int_distribution<int> col(0, i - 1);
+                for (int k = 0; k < avg_degree / 2; ++k)
+                    cols.push_back(col(rng));
+            }
+            std::sort(cols.begin(), cols.end());
+            cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+            // Every other sampled edge existed before and is now deleted.
+            for (size_t k = 0; k < cols.size(); ++k)
+            {
+                edge_pairs.push_back(i);
+                edge_pairs.push_back(cols[k]);
+                edge_signs.push_back((k & 1) ? -1 : 1);
+                if (k & 1)
+                {
+                    prev_cols.push_back(cols[k]);
+                    prev_signs.push_back(1);
+                }
+            }
+            prev_row_ptr.push_back(prev_cols.size());
+        }
+        AddGraph(g, n, edge_signs.size(), prev_row_ptr.data(),
+                 prev_cols.data(), prev_signs.data(), edge_pairs.data(),
+                 edge_signs.data(), -1, -1);
+    }
+
+    std::vector<int> ids(num_graphs), starts(num_graphs, 0);
+    std::vector<int> col_start(num_graphs, -1), col_end(num_graphs, -1);
+    for (int g = 0; g < num_graphs; ++g)
+        ids[g] = g;
+    // Warm-up fills the node pools, the timed runs reuse them.
+    PrepareTrain(num_graphs, ids.data(), starts.data(), col_start.data(),
+                 col_end.data(), -1, 1);
+    const int reps = 5;
+    auto t = std::chrono::steady_clock::now();
+    for (int r = 0; r < reps; ++r)
+        PrepareTrain(num_graphs, ids.data(), starts.data(), col_start.data(),
+                     col_end.data(), -1, 1);
+    double secs = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - t).count() / reps;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    int nodes = TotalTreeNodes();
+    printf("mode,rows,tree_nodes,nodes_per_sec,peak_rss_kb,heap_kb\n");
+    printf("prepare_train,%d,%d,%.0f,%ld,%ld\n", num_graphs * n, nodes,
+           nodes / secs, usage.ru_maxrss, heap_kb());
+
+    NodeArena& batch = default_context()->node_arena;
+    int bits_compress = atoi(bits.c_str());  // NOLINT
+    std::vector<int> node_parent(nodes), node_row(nodes), node_col_begin(nodes);
+    std::vector<int> node_col_end(nodes), node_depth(nodes);
+    for (int i = 0; i < nodes; ++i)
+    {
+        AdjNode* node = batch.get(i);
+        node_parent[i] = node->parent;
+        node_row[i] = node->row;
+        node_col_begin[i] = node->col_begin;
+        node_col_end[i] = node->col_end;
+        node_depth[i] = node->depth;
+    }
+
+    // Each pool is filled once untimed, as over earlier batches.
+    long heap_before = heap_kb();
+    NodeArena arena(default_context()->cfg);
+    double arena_secs = 0;
+    for (int r = 0; r <= reps; ++r)
+    {
+        t = std::chrono::steady_clock::now();
+        arena.reset();
+        for (int i = 0; i < nodes; ++i)
+        {
+            AdjNode* node = arena.new_node(node_parent[i], node_row[i], node_col_begin[i],
+                                           node_col_end[i], node_depth[i]);
+            if (node_parent[i] >= 0)
+            {
+                AdjNode* p = arena.get(node_parent[i]);
+                (p->lch < 0 ? p->lch : p->rch) = node->idx;
+            }
+        }
+        if (r)
+            arena_secs += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - t).count();
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    printf("arena,%d,%d,%.0f,%ld,%ld\n", num_graphs * n, nodes,
+           nodes * reps / arena_secs, usage.ru_maxrss,
+           heap_kb() - heap_before);
+
+    heap_before = heap_kb();
+    std::vector<HolderNode*> pt_buff;
+    std::vector<HolderNode*> made(nodes);
+    double holder_secs = 0;
+    for (int r = 0; r <= reps; ++r)
+    {
+        t = std::chrono::steady_clock::now();
+        size_t cur_pos = 0;
+        for (int i = 0; i < nodes; ++i)
+        {
+            HolderNode* p = node_parent[i] >= 0 ? made[node_parent[i]] : nullptr;
+            HolderNode* node;
+            if (cur_pos >= pt_buff.size())
+            {
+                node = new HolderNode(p, node_row[i], node_col_begin[i], node_col_end[i],
+                                      node_depth[i], bits_compress);
+                pt_buff.push_back(node);
+            } else {
+                node = pt_buff[cur_pos];
+                node->init(p, node_row[i], node_col_begin[i], node_col_end[i], node_depth[i],
+                           bits_compress);
+            }
+            cur_pos++;
+            made[i] = node;
+            if (p)
+                (p->lch ? p->rch : p->lch) = node;
+        }
+        if (r)
+            holder_secs += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - t).count();
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    printf("holder,%d,%d,%.0f,%ld,%ld\n", num_graphs * n, nodes,
+           nodes * reps / holder_secs, usage.ru_maxrss,
+           heap_kb() - heap_before);
+    for (auto* node : pt_buff)
+        delete node;
+    return 0;
+}
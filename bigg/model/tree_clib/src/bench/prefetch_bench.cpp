@@ -0,0 +1,110 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Training-step time with and without the prefetch pipeline. Each step
+// prepares a minibatch, exports its indices and then waits step_ms to stand
+// in for the GPU work that consumes it.
+// Usage: prefetch_bench [num_graphs] [num_nodes] [batch_size] [step_ms]
+// Output is CSV: mode,steps,ms_per_step
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "tree_clib.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+int main(int argc, char** argv)
+{
+    int num_graphs = argc > 1 ? atoi(argv[1]) : 64;  // NOLINT
+    int n = argc > 2 ? atoi(argv[2]) : 1000;  // NOLINT
+    int batch_size = argc > 3 ? atoi(argv[3]) : 16;  // NOLINT
+    int step_ms = argc > 4 ? atoi(argv[4]) : 20;  // NOLINT
+    const char* args[] = {"bench", "-bits_compress", "0", "-gpu", "-1"};
+    Init(5, args);
+
+    std::default_random_engine rng(1);
+    for (int g = 0; g < num_graphs; ++g)
+    {
+        std::vector<int> prev_row_ptr(n + 1, 0), edge_pairs, edge_signs;
+        for (int i = 1; i < n; ++i)
+        {
+            std::uniform_int_distribution<int> col(0, i - 1);
+            std::vector<int> cols = {col(rng), col(rng), col(rng)};
+            std::sort(cols.begin(), cols.end());
+            cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+            for (int c : cols)
+            {
+                edge_pairs.push_back(i);
+                edge_pairs.push_back(c);
+                edge_signs.push_back(1);
+            }
+        }
+        AddGraph(g, n, edge_signs.size(), prev_row_ptr.data(), nullptr,
+                 nullptr, edge_pairs.data(), edge_signs.data(), -1, -1);
+    }
+
+    const int steps = 20;
+    std::vector<std::vector<int> > batches;
+    std::uniform_int_distribution<int> pick(0, num_graphs - 1);
+    for (int s = 0; s < steps; ++s)
+    {
+        batches.push_back(std::vector<int>());
+        for (int b = 0; b < batch_size; ++b)
+            batches.back().push_back(pick(rng));
+    }
+    std::vector<int> starts(batch_size, 0), cols(batch_size, -1);
+    std::vector<int> offsets, buf;
+    auto consume = [&](TreeLibContext* ctx) {
+        int layout[4];
+        GetIndexLayoutCtx(ctx, layout);
+        offsets.resize(layout[2] + 1);
+        buf.resize(layout[3] + 1);
+        ExportIndicesCtx(ctx, offsets.data(), buf.data());
+        std::this_thread::sleep_for(std::chrono::milliseconds(step_ms));
+    };
+
+    printf("mode,steps,ms_per_step\n");
+    auto t = std::chrono::steady_clock::now();
+    for (int s = 0; s < steps; ++s)
+    {
+        PrepareTrain(batch_size, batches[s].data(), starts.data(), cols.data(),
+                     cols.data(), -1, 1);
+        consume(default_context());
+    }
+    double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - t).count();
+    printf("serial,%d,%.1f\n", steps, ms / steps);
+
+    auto* pipe = PipelineCreate(nullptr, 2);
+    t = std::chrono::steady_clock::now();
+    PipelineEnqueue(pipe, batch_size, batches[0].data(), starts.data(),
+                    cols.data(), cols.data(), -1);
+    for (int s = 0; s < steps; ++s)
+    {
+        if (s + 1 < steps)
+            PipelineEnqueue(pipe, batch_size, batches[s + 1].data(),
+                            starts.data(), cols.data(), cols.data(), -1);
+        consume(PipelineAcquire(pipe));
+    }
+    ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - t).count();
+    printf("prefetch,%d,%.1f\n", steps, ms / steps);
+    PipelineFree(pipe);
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Batches of ScheduleBatches against a random split of the same graphs into
+// batches of batch_size. Graph sizes are log-uniform up to max_nodes and a
+// few graphs get hub rows, so batch work is skewed. cost is the
+// ScheduleBatches cost model of each batch, ms the PrepareTrain plus
+// ExportIndices time of each batch, best of `reps` runs; cv is the standard
+// deviation over the mean, p50/p95/max are over the batches.
+// Usage: schedule_bench [num_graphs] [max_nodes] [batch_size] [reps]
+// Output is CSV: mode,batches,cost_mean,cost_cv,cost_max,ms_mean,ms_cv,p50_ms,p95_ms,max_ms
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "tree_clib.h"  // NOLINT
+
+static const double level_cost = 1000.0;
+
+static void report(const char* mode, std::vector<double> cost,
+                   std::vector<double> ms)
+{
+    auto mean_cv = [](const std::vector<double>& v, double& mean, double& cv) {
+        mean = 0;
+        for (double x : v)
+            mean += x;
+        mean /= v.size();
+        double var = 0;
+        for (double x : v)
+            var += (x - mean) * (x - mean);
+        cv = std::sqrt(var / v.size()) / mean;
+    };
+    double cost_mean, cost_cv, ms_mean, ms_cv;
+    mean_cv(cost, cost_mean, cost_cv);
+    mean_cv(ms, ms_mean, ms_cv);
+    std::sort(ms.begin(), ms.end());
+    auto pct = [&](double p) { return ms[(size_t)(p * (ms.size() - 1) + 0.5)]; };
+    printf("%s,%d,%.0f,%.3f,%.0f,%.2f,%.3f,%.2f,%.2f,%.2f\n", mode,
+           (int)ms.size(), cost_mean, cost_cv,
+           *std::max_element(cost.begin(), cost.end()), ms_mean, ms_cv,
+           pct(0.5), pct(0.95), ms.back());
+}
+
+int main(int argc, char** argv)
+{
+    int num_graphs = argc > 1 ? atoi(argv[1]) : 256;  // NOLINT
+    int max_nodes = argc > 2 ? atoi(argv[2]) : 2000;  // NOLINT
+    int batch_size = argc > 3 ? atoi(argv[3]) : 16;  // NOLINT
+    int reps = argc > 4 ? atoi(argv[4]) : 3;  // NOLINT
+    const char* args[] = {"bench", "-bits_compress", "0", "-gpu", "-1"};
+    Init(5, args);
+
+    std::default_random_engine rng(1);
+    std::uniform_real_distribution<double> log_size(std::log(50.0),
+                                                    std::log((double)max_nodes));
+    for (int g = 0; g < num_graphs; ++g)
+    {
+        int n = (int)std::exp(log_size(rng));
+        bool hubs = g % 8 == 0;
+        std::vector<int> edge_pairs, edge_signs;
+        for (int i = 1; i < n; ++i)
+        {
+            int degree = (hubs && i % 50 == 7) ? i / 2 : 3;
+            std::uniform_int_distribution<int> col(0, i - 1);
+            std::vector<int> cols;
+            for (int k = 0; k < std::min(degree, i); ++k)
+                cols.push_back(col(rng));
+            std::sort(cols.begin(), cols.end());
+            cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+            for (int c : cols)
+            {
+                edge_pairs.push_back(i);
+                edge_pairs.push_back(c);
+                edge_signs.push_back(1);
+            }
+        }
+        AddGraph(g, n, edge_signs.size(), nullptr, nullptr, nullptr,
+                 edge_pairs.data(), edge_signs.data(), -1, -1);
+    }
+
+    std::vector<int> ids(num_graphs), order(num_graphs), sizes(num_graphs);
+    std::vector<double> costs(num_graphs);
+    for (int g = 0; g < num_graphs; ++g)
+        ids[g] = g;
+    int num_batches = ScheduleBatches(num_graphs, ids.data(), batch_size,
+                                      level_cost, order.data(), sizes.data(),
+                                      costs.data());
+    std::vector<std::vector<int> > scheduled;
+    for (int b = 0, pos = 0; b < num_batches; pos += sizes[b++])
+        scheduled.push_back(std::vector<int>(order.begin() + pos,
+                                             order.begin() + pos + sizes[b]));
+    std::shuffle(ids.begin(), ids.end(), rng);
+    std::vector<std::vector<int> > random_split;
+    for (int pos = 0; pos < num_graphs; pos += batch_size)
+        random_split.push_back(std::vector<int>(
+            ids.begin() + pos, ids.begin() + std::min(pos + batch_size, num_graphs)));
+
+    std::vector<int> offsets, buf;
+    printf("mode,batches,cost_mean,cost_cv,cost_max,ms_mean,ms_cv,p50_ms,p95_ms,max_ms\n");
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        auto& batches = mode ? random_split : scheduled;
+        std::vector<double> batch_cost, batch_ms;
+        for (auto& batch : batches)
+        {
+            int n = batch.size();
+            // A single batch of all its graphs, to cost it the same way.
+            double cost;
+            ScheduleBatches(n, batch.data(), n, level_cost, order.data(),
+                            sizes.data(), &cost);
+            batch_cost.push_back(cost);
+            std::vector<int> starts(n, 0), cols(n, -1);
+            double best = 0;
+            for (int r = 0; r < reps; ++r)
+            {
+                auto t = std::chrono::steady_clock::now();
+                PrepareTrain(n, batch.data(), starts.data(), cols.data(),
+                             cols.data(), -1, 1);
+                int layout[4];
+                GetIndexLayout(layout);
+                offsets.resize(layout[2] + 1);
+                buf.resize(layout[3] + 1);
+                ExportIndices(offsets.data(), buf.data());
+                double ms = std::chrono::duration<double, std::milli>(
+                    std::chrono::steady_clock::now() - t).count();
+                best = r ? std::min(best, ms) : ms;
+            }
+            batch_ms.push_back(best);
+        }
+        report(mode ? "random" : "scheduled", batch_cost, batch_ms);
+    }
+    return 0;
+}
@@ -0,0 +1,292 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// End-to-end driver over the training hot paths, on synthetic snapshot
+// pairs shaped like the generators in utils/:
+//   er    G(n, p) whose next snapshot rewires 10% of its edges
+//   ba    Barabasi-Albert growth (ba_ts_generator.py), next snapshot
+//         attaches the next tenth of the nodes
+//   comm  three communities; the next snapshot moves 20% of the last
+//         community's edges outside (comm_decay_generator.py)
+// For every generator, size and average degree, num_pairs pairs are added
+// to a fresh context and trained on as one batch of whole graphs, timing
+//   add        AddGraph of all pairs
+//   prepare    PrepareTrain (row trees and build_row_indices_)
+//   row_idx    build_row_indices_ alone
+//   fenwick    build_row_indices, the Fenwick row-summary indices
+//   summary    build_row_summary
+//   export     GetIndexLayout + ExportIndices
+// each the best of `reps` runs. Configs run from small to large, so
+// peak_rss_mb, the process high-water mark, belongs to the largest config
+// so far.
+//   tree_clib_bench [max_nodes] [num_pairs] [reps]
+// Output is CSV, one line per config.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <set>
+#include <sys/resource.h>
+#include <vector>
+
+#include "tree_clib.h"  // NOLINT
+#include "struct_util.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+typedef std::pair<int, int> Edge;  // (row, col), row > col
+
+struct Pair
+{
+    int num_nodes;
+    std::vector<int> row_ptr, cols, signs;  // previous snapshot
+    std::vector<int> pairs, edge_signs;     // delta to the next one
+};
+
+static Edge make_edge(int x, int y)
+{
+    return x > y ? Edge(x, y) : Edge(y, x);
+}
+
+static Pair make_pair_of(int n, const std::set<Edge>& cur, const std::set<Edge>& next)
+{
+    Pair p;
+    p.num_nodes = n;
+    p.row_ptr.assign(n + 1, 0);
+    for (auto& e : cur)  // sorted by (row, col)
+    {
+        p.row_ptr[e.first + 1]++;
+        p.cols.push_back(e.second);
+        p.signs.push_back(1);
+    }
+    for (int i = 0; i < n; ++i)
+        p.row_ptr[i + 1] += p.row_ptr[i];
+    for (auto& e : next)
+        if (!cur.count(e))
+        {
+            p.pairs.push_back(e.first);
+            p.pairs.push_back(e.second);
+            p.edge_signs.push_back(1);
+        }
+    for (auto& e : cur)
+        if (!next.count(e))
+        {
+            p.pairs.push_back(e.first);
+            p.pairs.push_back(e.second);
+            p.edge_signs.push_back(-1);
+        }
+    return p;
+}
+
+static Edge random_pair(int lo0, int hi0, int lo1, int hi1, std::mt19937& rng)
+{
+    while (true)
+    {
+        int x = lo0 + rng() % (hi0 - lo0), y = lo1 + rng() % (hi1 - lo1);
+        if (x != y)
+            return make_edge(x, y);
+    }
+}
+
+static Pair gen_er(int n, double degree, std::mt19937& rng)
+{
+    std::set<Edge> cur;
+    size_t m = (size_t)(n * degree / 2);
+    while (cur.size() < m)
+        cur.insert(random_pair(0, n, 0, n, rng));
+    std::set<Edge> next(cur);
+    std::vector<Edge> edges(cur.begin(), cur.end());
+    std::shuffle(edges.begin(), edges.end(), rng);
+    for (size_t k = 0; k < m / 10; ++k)
+        next.erase(edges[k]);
+    while (next.size() < m)
+        next.insert(random_pair(0, n, 0, n, rng));
+    return make_pair_of(n, cur, next);
+}
+
+static Pair gen_ba(int n, double degree, std::mt19937& rng)
+{
+    int m = std::max(1, (int)(degree / 2));
+    std::set<Edge> g;
+    std::vector<int> repeated;
+    for (int i = 1; i <= m; ++i)  // star_graph(m)
+    {
+        g.insert(make_edge(0, i));
+        repeated.push_back(0);
+        repeated.push_back(i);
+    }
+    auto attach = [&](int source) {
+        std::set<int> targets;
+        while ((int)targets.size() < m)
+            targets.insert(repeated[rng() % repeated.size()]);
+        for (int t : targets)
+        {
+            g.insert(make_edge(source, t));
+            repeated.push_back(source);
+            repeated.push_back(t);
+        }
+    };
+    int split = std::max(m + 1, n - n / 10);
+    for (int source = m + 1; source < split; ++source)
+        attach(source);
+    std::set<Edge> cur(g);
+    for (int source = split; source < n; ++source)
+        attach(source);
+    return make_pair_of(n, cur, g);
+}
+
+static Pair gen_comm(int n, double degree, std::mt19937& rng)
+{
+    int c = n / 3;
+    int bounds[] = {0, c, 2 * c, n};
+    std::set<Edge> cur;
+    // 90% of each node's degree inside its community.
+    for (int k = 0; k < 3; ++k)
+    {
+        size_t m = (size_t)((bounds[k + 1] - bounds[k]) * degree * 0.9 / 2);
+        size_t target = cur.size() + m;
+        while (cur.size() < target)
+            cur.insert(random_pair(bounds[k], bounds[k + 1], bounds[k], bounds[k + 1], rng));
+    }
+    size_t m_ext = (size_t)(n * degree * 0.1 / 2);
+    size_t target = cur.size() + m_ext;
+    while (cur.size() < target)
+    {
+        Edge e = random_pair(0, n, 0, n, rng);
+        if (std::upper_bound(bounds, bounds + 4, e.first) != std::upper_bound(bounds, bounds + 4, e.second))
+            cur.insert(e);
+    }
+    std::vector<Edge> decay;
+    for (auto& e : cur)
+        if (e.first >= bounds[2] && e.second >= bounds[2])
+            decay.push_back(e);
+    std::shuffle(decay.begin(), decay.end(), rng);
+    std::set<Edge> next(cur);
+    size_t num_moved = decay.size() / 5;
+    for (size_t k = 0; k < num_moved; ++k)
+    {
+        next.erase(decay[k]);
+        Edge e;
+        do {
+            e = random_pair(bounds[2], n, 0, bounds[2], rng);
+        } while (next.count(e));
+        next.insert(e);
+    }
+    return make_pair_of(n, cur, next);
+}
+
+template<typename Fn>
+static double best_ms(int reps, Fn fn)
+{
+    double best = 1e30;
+    for (int r = 0; r < reps; ++r)
+    {
+        auto t = std::chrono::steady_clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - t).count());
+    }
+    return best;
+}
+
+int main(int argc, char** argv)
+{
+    int max_nodes = argc > 1 ? atoi(argv[1]) : 4096;
+    int num_pairs = argc > 2 ? atoi(argv[2]) : 8;
+    int reps = argc > 3 ? atoi(argv[3]) : 3;
+    const char* args[] = {"bench", "-bits_compress", "0", "-gpu", "-1"};
+
+    typedef Pair (*Generator)(int, double, std::mt19937&);
+    std::vector<std::pair<const char*, Generator> > generators = {
+        {"er", gen_er}, {"ba", gen_ba}, {"comm", gen_comm}};
+    printf("generator,num_nodes,degree,num_pairs,num_edges,tree_nodes,"
+           "add_ms,prepare_ms,row_idx_ms,fenwick_ms,summary_ms,export_ms,"
+           "rows_per_s,nodes_per_s,export_bytes,peak_rss_mb\n");
+    for (int n = 256; n <= max_nodes; n *= 4)
+    {
+        for (double degree : {4.0, 32.0})
+        {
+            for (auto& gen : generators)
+            {
+                std::mt19937 rng(n + (int)degree);
+                std::vector<Pair> pairs;
+                size_t num_edges = 0;
+                for (int i = 0; i < num_pairs; ++i)
+                {
+                    pairs.push_back(gen.second(n, degree, rng));
+                    num_edges += pairs.back().cols.size() + pairs.back().edge_signs.size();
+                }
+
+                TreeLibContext* ctx = nullptr;
+                double add_ms = best_ms(reps, [&]() {
+                    if (ctx)
+                        FreeCtx(ctx);
+                    ctx = InitCtx(5, args);
+                    for (int i = 0; i < num_pairs; ++i)
+                    {
+                        auto& p = pairs[i];
+                        AddGraphCtx(ctx, i, n, (int)p.edge_signs.size(),
+                                    p.row_ptr.data(), p.cols.data(), p.signs.data(),
+                                    p.pairs.data(), p.edge_signs.data(), -1, -1);
+                    }
+                });
+                std::vector<int> ids(num_pairs), starts(num_pairs, 0);
+                std::vector<int> col_starts(num_pairs, -1), col_ends(num_pairs, -1);
+                for (int i = 0; i < num_pairs; ++i)
+                    ids[i] = i;
+                double prepare_ms = best_ms(reps, [&]() {
+                    PrepareTrainCtx(ctx, num_pairs, ids.data(), starts.data(),
+                                    col_starts.data(), col_ends.data(), -1, 1);
+                });
+                int tree_nodes = TotalTreeNodesCtx(ctx);
+                auto& jobs = ctx->job_collect;
+                double row_idx_ms = best_ms(reps, [&]() {
+                    jobs.build_row_indices_(ctx->active_graphs);
+                });
+                double fenwick_ms = best_ms(reps, [&]() {
+                    jobs.build_row_indices(ctx->active_graphs);
+                });
+                double summary_ms = best_ms(reps, [&]() {
+                    jobs.build_row_summary(ctx->active_graphs);
+                });
+                // build_row_summary reuses buffers of the export, so rebuild.
+                PrepareTrainCtx(ctx, num_pairs, ids.data(), starts.data(),
+                                col_starts.data(), col_ends.data(), -1, 1);
+                std::vector<int> layout(4), offsets, buf;
+                double export_ms = best_ms(reps, [&]() {
+                    ctx->indices_cached = false;
+                    GetIndexLayoutCtx(ctx, layout.data());
+                    offsets.resize(layout[2] + 1);
+                    buf.resize(layout[3] + 1);
+                    ExportIndicesCtx(ctx, offsets.data(), buf.data());
+                });
+                size_t export_bytes = (offsets.size() + (size_t)layout[3]) * sizeof(int);
+                FreeCtx(ctx);
+
+                struct rusage usage;
+                getrusage(RUSAGE_SELF, &usage);
+                double rows = (double)n * num_pairs;
+                printf("%s,%d,%.0f,%d,%zu,%d,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.0f,%.0f,%zu,%.1f\n",
+                       gen.first, n, degree, num_pairs, num_edges, tree_nodes,
+                       add_ms, prepare_ms, row_idx_ms, fenwick_ms, summary_ms,
+                       export_ms, rows / prepare_ms * 1e3,
+                       tree_nodes / prepare_ms * 1e3, export_bytes,
+                       usage.ru_maxrss / 1024.0);
+                fflush(stdout);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,98 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Driver overhead of TreeSampler with a stand-in model: every P_* op gets a
+// fixed edge probability and S_* ops are not evaluated, so the numbers are
+// the native walk cost plus the round structure a model would see. Rows of
+// a num_nodes-node graph are sampled with walks_in_flight walks at a time.
+// Usage: tree_sampler_bench [num_nodes] [walks_in_flight] [edge_prob] [bits]
+// Output is CSV: num_nodes,walks,bits,rows_per_sec,rounds_per_row,ops_per_round,edges
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tree_clib.h"  // NOLINT
+#include "tree_sampler.h"  // NOLINT
+
+int main(int argc, char** argv)
+{
+    int num_nodes = argc > 1 ? atoi(argv[1]) : 5000;
+    int num_walks = argc > 2 ? atoi(argv[2]) : 64;
+    float edge_prob = argc > 3 ? atof(argv[3]) : 0.5;
+    std::string bits = argc > 4 ? argv[4] : "0";
+    const char* args[] = {"this", "-bits_compress", bits.c_str(), "-embed_dim", "256"};
+    Init(5, args);
+
+    std::mt19937 rng(1);
+    std::vector<std::vector<int> > prev(num_nodes);
+    for (int i = 0; i < num_nodes; ++i)
+        for (int k = 0; k < 5 && i; ++k)
+            prev[i].push_back(rng() % i);
+    for (auto& p : prev)
+    {
+        std::sort(p.begin(), p.end());
+        p.erase(std::unique(p.begin(), p.end()), p.end());
+    }
+
+    TreeSampler* sampler = SamplerCreate(1, 0);
+    long long rounds = 0, ops = 0, edges = 0;
+    int next_row = 0;
+    std::vector<int> in_flight;
+    auto t0 = std::chrono::steady_clock::now();
+    while (next_row < num_nodes || in_flight.size())
+    {
+        while ((int)in_flight.size() < num_walks && next_row < num_nodes)
+        {
+            int row = next_row++;
+            in_flight.push_back(SamplerAddRow(sampler, 0, row, -1, -1, 0, row,
+                                              prev[row].size(), prev[row].data()));
+        }
+        int n = SamplerStep(sampler);
+        if (n)
+        {
+            rounds++;
+            ops += n;
+            std::vector<float> probs(n, edge_prob);
+            SamplerSetProbs(sampler, probs.data());
+        }
+        std::vector<int> still;
+        for (int w : in_flight)
+        {
+            int info[4];
+            SamplerGetWalk(sampler, w, info);
+            if (info[1])
+            {
+                edges += info[3];
+                SamplerRelease(sampler, w);
+            } else {
+                still.push_back(w);
+            }
+        }
+        in_flight.swap(still);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    double secs = std::chrono::duration<double>(t1 - t0).count();
+    SamplerFree(sampler);
+
+    printf("num_nodes,walks,bits,rows_per_sec,rounds_per_row,ops_per_round,edges\n");
+    printf("%d,%d,%s,%.0f,%.2f,%.1f,%lld\n", num_nodes, num_walks, bits.c_str(),
+           num_nodes / secs, (double)rounds / num_nodes,
+           rounds ? (double)ops / rounds : 0.0, edges);
+    return 0;
+}
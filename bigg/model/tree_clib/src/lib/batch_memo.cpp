@@ -0,0 +1,162 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "batch_memo.h"  // NOLINT
+
+size_t BatchMemoEntry::bytes() const
+{
+    size_t n = sizeof(*this);
+    n += (offsets.size() + buf.size() + n_bin_job_per_level.size()) * sizeof(int);
+    for (size_t d = 0; d < bin_lens.size(); ++d)
+        n += bin_lens[d].size() * sizeof(int) +
+             (bin_pos[d].size() + bin_neg[d].size()) * sizeof(uint32_t);
+    return n;
+}
+
+// Spill records are the fields of an entry in order, each vector as its
+// int64 length followed by its elements.
+template<typename T>
+static void put_vec(std::vector<char>& out, const std::vector<T>& v)
+{
+    int64_t n = v.size();
+    out.insert(out.end(), reinterpret_cast<const char*>(&n),
+               reinterpret_cast<const char*>(&n + 1));
+    out.insert(out.end(), reinterpret_cast<const char*>(v.data()),
+               reinterpret_cast<const char*>(v.data() + n));
+}
+
+template<typename T>
+static void get_vec(const char*& p, const char* end, std::vector<T>& v)
+{
+    int64_t n;
+    assert(p + sizeof(n) <= end);
+    std::memcpy(&n, p, sizeof(n));
+    p += sizeof(n);
+    assert(n >= 0 && p + n * sizeof(T) <= end);
+    v.resize(n);
+    std::memcpy(v.data(), p, n * sizeof(T));
+    p += n * sizeof(T);
+}
+
+BatchMemo::BatchMemo(int64_t max_bytes, const char* spill_path)
+    : max_bytes(max_bytes), bytes_in_memory(0), spill_fd(-1), spill_size(0)
+{
+    if (spill_path && spill_path[0])
+    {
+        spill_fd = open(spill_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        assert(spill_fd >= 0);
+    }
+}
+
+BatchMemo::~BatchMemo()
+{
+    if (spill_fd >= 0)
+        close(spill_fd);
+}
+
+std::shared_ptr<const BatchMemoEntry> BatchMemo::find(const std::vector<int>& key)
+{
+    auto it = entries.find(key);
+    if (it != entries.end())
+    {
+        lru.splice(lru.begin(), lru, it->second.lru_pos);
+        return it->second.entry;
+    }
+    auto sp = spilled.find(key);
+    if (sp == spilled.end())
+        return nullptr;
+    auto entry = read_spilled(sp->second.first, sp->second.second);
+    insert(key, entry);
+    return entry;
+}
+
+void BatchMemo::insert(const std::vector<int>& key,
+                       std::shared_ptr<const BatchMemoEntry> entry)
+{
+    auto ins = entries.insert(std::make_pair(key, Slot()));
+    if (!ins.second)
+        return;
+    lru.push_front(&ins.first->first);
+    ins.first->second.entry = entry;
+    ins.first->second.lru_pos = lru.begin();
+    bytes_in_memory += entry->bytes();
+    while (bytes_in_memory > max_bytes && !lru.empty())
+        evict();
+}
+
+void BatchMemo::evict()
+{
+    auto it = entries.find(*lru.back());
+    assert(it != entries.end());
+    auto& entry = *it->second.entry;
+    if (spill_fd >= 0 && !spilled.count(it->first))
+    {
+        std::vector<char> rec;
+        int32_t dims[2] = {entry.num_depths, entry.num_levels};
+        rec.insert(rec.end(), reinterpret_cast<const char*>(dims),
+                   reinterpret_cast<const char*>(dims + 2));
+        put_vec(rec, entry.offsets);
+        put_vec(rec, entry.buf);
+        put_vec(rec, entry.n_bin_job_per_level);
+        for (size_t d = 0; d < entry.bin_lens.size(); ++d)
+        {
+            put_vec(rec, entry.bin_lens[d]);
+            put_vec(rec, entry.bin_pos[d]);
+            put_vec(rec, entry.bin_neg[d]);
+        }
+        ssize_t ret = pwrite(spill_fd, rec.data(), rec.size(), spill_size);
+        assert(ret == (ssize_t)rec.size());
+        (void)ret;
+        spilled[it->first] = std::make_pair(spill_size, (int64_t)rec.size());
+        spill_size += rec.size();
+    }
+    bytes_in_memory -= entry.bytes();
+    lru.pop_back();
+    entries.erase(it);
+}
+
+std::shared_ptr<const BatchMemoEntry> BatchMemo::read_spilled(int64_t offset,
+                                                              int64_t len)
+{
+    std::vector<char> rec(len);
+    ssize_t ret = pread(spill_fd, rec.data(), len, offset);
+    assert(ret == (ssize_t)len);
+    (void)ret;
+    auto entry = std::make_shared<BatchMemoEntry>();
+    const char* p = rec.data();
+    const char* end = p + len;
+    int32_t dims[2];
+    std::memcpy(dims, p, sizeof(dims));
+    p += sizeof(dims);
+    entry->num_depths = dims[0];
+    entry->num_levels = dims[1];
+    get_vec(p, end, entry->offsets);
+    get_vec(p, end, entry->buf);
+    get_vec(p, end, entry->n_bin_job_per_level);
+    while (p < end)
+    {
+        entry->bin_lens.push_back(std::vector<int>());
+        entry->bin_pos.push_back(std::vector<uint32_t>());
+        entry->bin_neg.push_back(std::vector<uint32_t>());
+        get_vec(p, end, entry->bin_lens.back());
+        get_vec(p, end, entry->bin_pos.back());
+        get_vec(p, end, entry->bin_neg.back());
+    }
+    return entry;
+}
@@ -0,0 +1,117 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cassert>
+#include "batch_pipeline.h"  // NOLINT
+#include "tree_clib.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+BatchPipeline::BatchPipeline(TreeLibContext* source, int num_slots)
+{
+    assert(num_slots >= 2);
+    this->source = source;
+    for (int i = 0; i < num_slots; ++i)
+    {
+        auto* slot = new TreeLibContext();
+        slot->owns_graphs = false;
+        slot->cfg = source->cfg;
+        slots.push_back(slot);
+        free_slots.push_back(slot);
+    }
+    held = nullptr;
+    num_outstanding = 0;
+    stopping = false;
+    worker = std::thread(&BatchPipeline::work, this);
+}
+
+BatchPipeline::~BatchPipeline()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    cond.notify_all();
+    worker.join();
+    for (auto* slot : slots)
+        delete slot;
+}
+
+void BatchPipeline::enqueue(int num_graphs, int* list_ids, int* list_start_node,
+                            int* list_col_start, int* list_col_end,
+                            int num_nodes)
+{
+    Request req;
+    req.ids.assign(list_ids, list_ids + num_graphs);
+    req.start_nodes.assign(list_start_node, list_start_node + num_graphs);
+    req.col_starts.assign(list_col_start, list_col_start + num_graphs);
+    req.col_ends.assign(list_col_end, list_col_end + num_graphs);
+    req.num_nodes = num_nodes;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.push_back(std::move(req));
+        num_outstanding++;
+    }
+    cond.notify_all();
+}
+
+TreeLibContext* BatchPipeline::acquire()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    assert(num_outstanding > 0);
+    if (held)
+    {
+        free_slots.push_back(held);
+        held = nullptr;
+        cond.notify_all();
+    }
+    cond.wait(guard, [this] { return !ready.empty(); });
+    held = ready.front();
+    ready.pop_front();
+    num_outstanding--;
+    return held;
+}
+
+void BatchPipeline::work()
+{
+    while (true)
+    {
+        Request req;
+        TreeLibContext* slot;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            cond.wait(guard, [this] {
+                return stopping || (!pending.empty() && !free_slots.empty());
+            });
+            if (stopping)
+                return;
+            req = std::move(pending.front());
+            pending.pop_front();
+            slot = free_slots.front();
+            free_slots.pop_front();
+        }
+        slot->graph_list = source->graph_list;
+        PrepareTrainCtx(slot, (int)req.ids.size(), req.ids.data(),
+                        req.start_nodes.data(), req.col_starts.data(),
+                        req.col_ends.data(), req.num_nodes, 1);
+        // Also fill the index export, so that acquire() hands over a batch
+        // that needs no more work on the consumer side.
+        int layout[4];
+        GetIndexLayoutCtx(slot, layout);
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            ready.push_back(slot);
+        }
+        cond.notify_all();
+    }
+}
@@ -0,0 +1,141 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+#include <numeric>
+#include <queue>
+
+#include "batch_schedule.h"  // NOLINT
+#include "config.h"  // NOLINT
+#include "struct_util.h"  // NOLINT
+
+// Jobs of the subtree over cols [lo, hi) holding the num_cols sorted cols,
+// the way AdjRow::add_edges splits it.
+static int64_t count_jobs(const std::pair<int, int>* cols, int num_cols,
+                          int lo, int hi, int depth,
+                          std::vector<int64_t>& jobs_per_depth)
+{
+    if (num_cols == 0 || hi - lo <= 1)
+        return 0;
+    if (depth >= (int)jobs_per_depth.size())
+        jobs_per_depth.resize(depth + 1, 0);
+    jobs_per_depth[depth]++;
+    int mid = (lo + hi) / 2;
+    int num_left = std::lower_bound(cols, cols + num_cols, mid,
+                                    [](const std::pair<int, int>& e, int c) {
+                                        return e.first < c;
+                                    }) - cols;
+    return 1 + count_jobs(cols, num_left, lo, mid, depth + 1, jobs_per_depth)
+             + count_jobs(cols + num_left, num_cols - num_left, mid, hi,
+                          depth + 1, jobs_per_depth);
+}
+
+GraphCost::GraphCost(GraphStruct* g, const TreeConfig& cfg)
+{
+    num_jobs = 0;
+    row_jobs.resize(g->num_nodes);
+    for (int i = 0; i < g->num_nodes; ++i)
+    {
+        // The col range of AdjRow::init, or (0, n_right) for bipartite
+        // graphs as tree_lib.py passes it.
+        int col_end = g->n_right >= 0 ? g->n_right : i + (cfg.self_loop ? 1 : 0);
+        int begin = g->edge_row_ptr[i];
+        row_jobs[i] = count_jobs(g->edge_cols.data() + begin,
+                                 g->edge_row_ptr[i + 1] - begin, 0, col_end, 0,
+                                 jobs_per_depth);
+        num_jobs += row_jobs[i];
+    }
+}
+
+int schedule_batches(std::vector<GraphStruct*>& graphs,
+                     const TreeConfig& cfg, int batch_size,
+                     double level_cost, std::vector<int>& order,
+                     std::vector<int>& batch_sizes,
+                     std::vector<double>& batch_costs)
+{
+    assert(batch_size > 0);
+    int n = (int)graphs.size();
+    int num_batches = (n + batch_size - 1) / batch_size;
+    std::vector<int> depth(n);
+    std::vector<int64_t> work(n);
+    #pragma omp parallel for schedule(dynamic)
+    for (int i = 0; i < n; ++i)
+    {
+        GraphCost cost(graphs[i], cfg);
+        depth[i] = (int)cost.jobs_per_depth.size();
+        work[i] = cost.num_jobs + graphs[i]->num_nodes;
+    }
+    std::vector<int> by_depth(n);
+    std::iota(by_depth.begin(), by_depth.end(), 0);
+    std::stable_sort(by_depth.begin(), by_depth.end(), [&](int a, int b) {
+        return depth[a] != depth[b] ? depth[a] > depth[b] : work[a] > work[b];
+    });
+    // The deepest graphs set the number of levels of every batch, so the
+    // others only add their work wherever they go.
+    std::vector<std::vector<int> > members(num_batches);
+    batch_costs.assign(num_batches, 0);
+    typedef std::pair<double, int> CostBatch;
+    std::priority_queue<CostBatch, std::vector<CostBatch>, std::greater<CostBatch> > open;  // NOLINT
+    for (int b = 0; b < num_batches; ++b)
+    {
+        int i = by_depth[b];
+        members[b].push_back(i);
+        batch_costs[b] = level_cost * depth[i] + work[i];
+        if (batch_size > 1)
+            open.push(CostBatch(batch_costs[b], b));
+    }
+    std::vector<int> rest(by_depth.begin() + num_batches, by_depth.end());
+    std::stable_sort(rest.begin(), rest.end(), [&](int a, int b) {
+        return work[a] > work[b];
+    });
+    for (int i : rest)
+    {
+        int b = open.top().second;
+        open.pop();
+        members[b].push_back(i);
+        batch_costs[b] += work[i];
+        if ((int)members[b].size() < batch_size)
+            open.push(CostBatch(batch_costs[b], b));
+    }
+    order.clear();
+    batch_sizes.clear();
+    for (auto& m : members)
+    {
+        order.insert(order.end(), m.begin(), m.end());
+        batch_sizes.push_back((int)m.size());
+    }
+    return num_batches;
+}
+
+void slice_rows(GraphStruct* g, const TreeConfig& cfg, int num_slices,
+                int* starts)
+{
+    assert(num_slices > 0 && num_slices <= g->num_nodes);
+    GraphCost cost(g, cfg);
+    double total = cost.num_jobs + g->num_nodes;
+    starts[0] = 0;
+    double acc = 0;
+    int k = 1;
+    for (int i = 0; i < g->num_nodes && k < num_slices; ++i)
+    {
+        acc += cost.row_jobs[i] + 1;
+        // Cut once the slice reaches its share, leaving a row for each
+        // slice still to come.
+        if (acc >= total * k / num_slices || g->num_nodes - (i + 1) == num_slices - k)
+            starts[k++] = i + 1;
+    }
+    starts[num_slices] = g->num_nodes;
+}
@@ -4,17 +4,7 @@
 #include "cuda_runtime.h"  // NOLINT
 #endif
 
-int cfg::max_num_nodes = 1000000;
-int cfg::bits_compress = 0;
-int cfg::dim_embed = 0;
-bool cfg::directed = false;
-bool cfg::self_loop = false;
-int cfg::gpu = -1;
-bool cfg::bfs_permute = false;
-int cfg::seed = 1;
-std::default_random_engine cfg::generator;
-
-void cfg::LoadParams(const int argc, const char** argv)
+void TreeConfig::LoadParams(const int argc, const char** argv)
 {
     for (int i = 1; i < argc; i += 2)
     {
@@ -34,9 +24,12 @@ void cfg::LoadParams(const int argc, const char** argv)
             seed = atoi(argv[i + 1]);  // NOLINT
         if (strcmp(argv[i], "-bfs_permute") == 0)
             bfs_permute = atoi(argv[i + 1]);  // NOLINT
+        if (strcmp(argv[i], "-parallel_build") == 0)
+            parallel_build = atoi(argv[i + 1]);  // NOLINT
     }
     std::cerr << "====== begin of tree_clib configuration ======" << std::endl;
     std::cerr << "| bfs_permute = " << bfs_permute << std::endl;
+    std::cerr << "| parallel_build = " << parallel_build << std::endl;
     std::cerr << "| max_num_nodes = " << max_num_nodes << std::endl;
     std::cerr << "| bits_compress = " << bits_compress << std::endl;
     std::cerr << "| dim_embed = " << dim_embed << std::endl;
@@ -51,9 +44,3 @@ void cfg::LoadParams(const int argc, const char** argv)
     }
 #endif
 }
-
-void cfg::SetRandom()
-{
-    std::srand(cfg::seed);
-    cfg::generator.seed(cfg::seed);
-}
@@ -0,0 +1,149 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cassert>
+#include <vector>
+#include "cpu_ops.h"  // NOLINT
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CPU_OPS_X86
+#endif
+
+namespace {
+
+typedef void (*expand_fn)(const uint32_t* bits, int len, float* feat);
+
+void expand_range(const uint32_t* bits, int start, int len, float* feat)
+{
+    for (int i = start; i < len; ++i)
+        feat[i] = (bits[i / 32] >> (i % 32)) & 1 ? 1 : 0;
+}
+
+void expand_row_scalar(const uint32_t* bits, int len, float* feat)
+{
+    expand_range(bits, 0, len, feat);
+}
+
+#ifdef CPU_OPS_X86
+
+__attribute__((target("avx2")))
+void expand_row_avx2(const uint32_t* bits, int len, float* feat)
+{
+    const __m256i sel = _mm256_setr_epi32(1 << 0, 1 << 1, 1 << 2, 1 << 3,
+                                          1 << 4, 1 << 5, 1 << 6, 1 << 7);
+    const __m256 ones = _mm256_set1_ps(1.0f);
+    int i = 0;
+    for (; i + 8 <= len; i += 8)
+    {
+        // i is a multiple of 8, so the 8 bits never straddle two words.
+        __m256i word = _mm256_set1_epi32((int)(bits[i / 32] >> (i % 32)));
+        __m256i hit = _mm256_cmpeq_epi32(_mm256_and_si256(word, sel), sel);
+        _mm256_storeu_ps(feat + i,
+                         _mm256_and_ps(_mm256_castsi256_ps(hit), ones));
+    }
+    expand_range(bits, i, len, feat);
+}
+
+__attribute__((target("avx512f")))
+void expand_row_avx512(const uint32_t* bits, int len, float* feat)
+{
+    const __m512i sel = _mm512_setr_epi32(1 << 0, 1 << 1, 1 << 2, 1 << 3,
+                                          1 << 4, 1 << 5, 1 << 6, 1 << 7,
+                                          1 << 8, 1 << 9, 1 << 10, 1 << 11,
+                                          1 << 12, 1 << 13, 1 << 14, 1 << 15);
+    const __m512i ones = _mm512_castps_si512(_mm512_set1_ps(1.0f));
+    int i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m512i word = _mm512_set1_epi32((int)(bits[i / 32] >> (i % 32)));
+        __mmask16 hit = _mm512_test_epi32_mask(word, sel);
+        _mm512_storeu_si512(feat + i, _mm512_maskz_mov_epi32(hit, ones));
+    }
+    // Tails shorter than 16 bits are common (bits_compress is small), and
+    // plain stores beat a masked 512-bit store there.
+    expand_range(bits, i, len, feat);
+}
+
+#endif
+
+expand_fn pick_expand()
+{
+#ifdef CPU_OPS_X86
+    if (__builtin_cpu_supports("avx512f"))
+        return expand_row_avx512;
+    if (__builtin_cpu_supports("avx2"))
+        return expand_row_avx2;
+#endif
+    return expand_row_scalar;
+}
+
+}  // namespace
+
+void build_binary_mat_cpu(int n_rows, int n_ints, int n_feats, int* lens,
+                          uint32_t* bits, float* outptr)
+{
+    static expand_fn expand = pick_expand();
+    #pragma omp parallel for
+    for (int row = 0; row < n_rows; ++row)
+    {
+        assert(lens[row] <= n_ints * 32 && lens[row] <= n_feats);
+        expand(bits + (long long)row * n_ints, lens[row],
+               outptr + (long long)row * n_feats);
+    }
+}
+
+void binary_packed_matmul(int n_rows, int n_ints, int n_feats, int out_dim,
+                          int* lens, uint32_t* bits_pos, uint32_t* bits_neg,
+                          float* weight, float pad, float* outptr)
+{
+    // tail[j] = sum of weight rows j..n_feats-1, for the padded columns.
+    std::vector<float> tail((size_t)(n_feats + 1) * out_dim, 0);
+    for (int j = n_feats - 1; j >= 0; --j)
+        for (int k = 0; k < out_dim; ++k)
+            tail[(size_t)j * out_dim + k] = tail[(size_t)(j + 1) * out_dim + k] + weight[(size_t)j * out_dim + k];  // NOLINT
+
+    #pragma omp parallel for
+    for (int row = 0; row < n_rows; ++row)
+    {
+        int len = lens[row];
+        assert(len <= n_ints * 32 && len <= n_feats);
+        float* out = outptr + (size_t)row * out_dim;
+        const float* pad_sum = tail.data() + (size_t)len * out_dim;
+        for (int k = 0; k < out_dim; ++k)
+            out[k] = pad * pad_sum[k];
+        for (int w = 0; w * 32 < len; ++w)
+        {
+            uint32_t live = len - w * 32 >= 32 ? ~(uint32_t)0 : ((uint32_t)1 << (len - w * 32)) - 1;  // NOLINT
+            uint32_t pos = bits_pos[(size_t)row * n_ints + w] & live;
+            uint32_t neg = bits_neg[(size_t)row * n_ints + w] & live;
+            // Columns set in both cancel out.
+            uint32_t both = pos & neg;
+            pos ^= both;
+            neg ^= both;
+            for (; pos; pos &= pos - 1)
+            {
+                const float* wr = weight + (size_t)(w * 32 + __builtin_ctz(pos)) * out_dim;  // NOLINT
+                for (int k = 0; k < out_dim; ++k)
+                    out[k] += wr[k];
+            }
+            for (; neg; neg &= neg - 1)
+            {
+                const float* wr = weight + (size_t)(w * 32 + __builtin_ctz(neg)) * out_dim;  // NOLINT
+                for (int k = 0; k < out_dim; ++k)
+                    out[k] -= wr[k];
+            }
+        }
+    }
+}
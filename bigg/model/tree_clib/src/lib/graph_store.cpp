@@ -0,0 +1,141 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <cassert>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "graph_store.h"  // NOLINT
+
+static const char store_magic[8] = {'B', 'I', 'G', 'G', 'S', 'E', 'R', '1'};
+static const int32_t store_version = 1;
+
+GraphStore* GraphStore::open(const char* path)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+    struct stat st;
+    void* addr = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(GraphStoreHeader))
+        addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED)
+        return nullptr;
+    auto* store = new GraphStore();
+    size_t len = st.st_size;
+    store->size = len;
+    store->data = std::shared_ptr<const char>(static_cast<const char*>(addr),
+                                              [len](const char* p) {
+                                                  munmap(const_cast<char*>(p), len);
+                                              });
+    if (!store->validate())
+    {
+        delete store;
+        return nullptr;
+    }
+    return store;
+}
+
+// The file is untrusted, so these checks are not asserts and stay on under
+// NDEBUG; the accessors below then only index into tables known to be in
+// the file.
+bool GraphStore::validate()
+{
+    auto* header = at<GraphStoreHeader>(0, 1);
+    if (!header || std::memcmp(header->magic, store_magic, sizeof(store_magic)) ||
+        header->version != store_version)
+        return false;
+    if (header->num_snapshots < 0 || header->num_pairs < 0)
+        return false;
+    num_snapshots = header->num_snapshots;
+    num_pairs = header->num_pairs;
+    if (!at<GraphStoreSnapshot>(sizeof(GraphStoreHeader), num_snapshots) ||
+        !at<GraphStorePair>(sizeof(GraphStoreHeader) +
+                            sizeof(GraphStoreSnapshot) * (int64_t)num_snapshots,
+                            num_pairs))
+        return false;
+    for (int i = 0; i < num_snapshots; ++i)
+    {
+        auto& s = snapshot(i);
+        if (s.num_nodes < 0)
+            return false;
+        const int32_t* ptr = at<int32_t>(s.row_ptr_offset, s.num_nodes + (int64_t)1);
+        if (!ptr || ptr[0] != 0)
+            return false;
+        for (int j = 0; j < s.num_nodes; ++j)
+            if (ptr[j] > ptr[j + 1])
+                return false;
+        if (!at<int32_t>(s.rows_offset, 2 * (int64_t)ptr[s.num_nodes]))
+            return false;
+    }
+    for (int i = 0; i < num_pairs; ++i)
+    {
+        auto& p = pair(i);
+        if (p.snapshot < 0 || p.snapshot >= num_snapshots || p.num_edges < 0)
+            return false;
+        const int32_t* e = at<int32_t>(p.edges_offset, 3 * (int64_t)p.num_edges);
+        if (!e)
+            return false;
+        // Edge endpoints index the rows of the snapshot.
+        int n = snapshot(p.snapshot).num_nodes;
+        for (int64_t k = 0; k < 3 * (int64_t)p.num_edges; k += 3)
+            if (e[k] < 0 || e[k] >= n || e[k + 1] < 0 || e[k + 1] >= n)
+                return false;
+    }
+    return true;
+}
+
+template<typename T>
+const T* GraphStore::at(int64_t offset, int64_t count) const
+{
+    if (offset < 0 || offset % (int64_t)alignof(T) || count < 0 ||
+        offset > (int64_t)size ||
+        count > ((int64_t)size - offset) / (int64_t)sizeof(T))
+        return nullptr;
+    return reinterpret_cast<const T*>(data.get() + offset);
+}
+
+const GraphStoreSnapshot& GraphStore::snapshot(int snapshot_id) const
+{
+    assert(snapshot_id >= 0 && snapshot_id < num_snapshots);
+    auto* table = reinterpret_cast<const GraphStoreSnapshot*>(data.get() + sizeof(GraphStoreHeader));
+    return table[snapshot_id];
+}
+
+const GraphStorePair& GraphStore::pair(int pair_id) const
+{
+    assert(pair_id >= 0 && pair_id < num_pairs);
+    auto* table = reinterpret_cast<const GraphStorePair*>(
+        data.get() + sizeof(GraphStoreHeader) + sizeof(GraphStoreSnapshot) * num_snapshots);
+    return table[pair_id];
+}
+
+const int32_t* GraphStore::row_ptr(int snapshot_id) const
+{
+    return reinterpret_cast<const int32_t*>(data.get() + snapshot(snapshot_id).row_ptr_offset);
+}
+
+const int32_t* GraphStore::rows(int snapshot_id) const
+{
+    return reinterpret_cast<const int32_t*>(data.get() + snapshot(snapshot_id).rows_offset);
+}
+
+const int32_t* GraphStore::edges(int pair_id) const
+{
+    return reinterpret_cast<const int32_t*>(data.get() + pair(pair_id).edges_offset);
+}
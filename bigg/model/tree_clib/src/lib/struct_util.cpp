@@ -4,150 +4,365 @@
 #include <queue>
 #include <unordered_set>
 #include <cassert>
+#include <cmath>
 
 #include "config.h"  // NOLINT
+#include "graph_store.h"  // NOLINT
 #include "struct_util.h"  // NOLINT
 #include "tree_util.h"  // NOLINT
 
-std::vector<GraphStruct*> graph_list = std::vector<GraphStruct*>();
-std::vector<GraphStruct*> active_graphs;
 
-BitSet::BitSet()
+template<uint32_t n_words>
+static void use_width(BitSet& b)
 {
-    n_bits = n_macros = 0;
-    macro_bits.clear();
+    b.n_words = n_words;
+    b.reset = FixedBitSet<n_words>::reset;
+    b.shift_or = FixedBitSet<n_words>::shift_or;
 }
 
-BitSet::BitSet(uint32_t _n_bits)
+void BitSet::init(int n_bits)
 {
-    n_bits = _n_bits;
-    n_macros = n_bits / ibits;
-    if (n_bits % ibits)
-        n_macros++;
-    macro_bits.clear();
-    for (uint32_t i = 0; i < n_macros; ++i)
-        macro_bits.push_back(0);
+    assert(n_bits >= 0 && n_bits <= (int)(max_bit_macros * ibits));
+    if (n_bits <= 32)
+        use_width<1>(*this);
+    else if (n_bits <= 64)
+        use_width<2>(*this);
+    else if (n_bits <= 128)
+        use_width<4>(*this);
+    else
+        use_width<8>(*this);
 }
 
-void BitSet::set(uint32_t pos)
-{
-    uint32_t m = pos / ibits;
-    pos = pos % ibits;
-    macro_bits[m] |= (1 << pos);
-}
-
-bool BitSet::get(uint32_t pos)
+int num_ones(int n)
 {
-    uint32_t m = pos / ibits;
-    pos = pos % ibits;
-    return (macro_bits[m] & ((uint32_t)1 << pos)) > 0;
+    int cnt = 0;
+    while (n) {
+        n &= (n - 1);
+        cnt += 1;
+    }
+    return cnt;
 }
 
-BitSet BitSet::left_shift(uint32_t n)
+void GraphStruct::edge_row_col(int& x, int& y)
 {
-    BitSet bs(n_bits);
-    uint32_t prev = 0;
-    uint32_t topn;
-    uint32_t block_shift = n / ibits;
-    n = n % ibits;
-    for (uint32_t i = 0; i < block_shift; ++i)
-        bs.macro_bits[i] = 0;
-    for (uint32_t i = block_shift; i < n_macros; ++i)
+    if (n_left < 0 || n_right < 0)
     {
-        topn = n ? macro_bits[i - block_shift] >> (ibits - n) : 0;
-        bs.macro_bits[i] = (macro_bits[i - block_shift] << n) + prev;
-        prev = topn;
+        if (x < y)
+        {
+            int t = x; x = y; y = t;
+        }
+    } else {
+        if (x > y)
+        {
+            int t = x; x = y; y = t;
+        }
+        assert(x < n_left);
+        y -= n_left;
+        assert(y >= 0 && y < n_right);
     }
-    return bs;
+    assert(x >= 0 && x < num_nodes);
 }
 
-BitSet BitSet::or_op(BitSet& another)
+// Inputs this large are bucketed on all threads.
+static const int parallel_bucket_edges = 1 << 16;
+
+template<typename EdgeFn>
+void GraphStruct::bucket_edges(int num_edges, EdgeFn edge)
 {
-    BitSet bs(n_bits);
-    for (uint32_t i = 0; i < n_macros; ++i)
+    bool parallel = num_edges >= parallel_bucket_edges;
+    std::vector<int> rows(num_edges);
+    std::vector<std::pair<int, int> > cols(num_edges);
+    edge_row_ptr.assign(num_nodes + 1, 0);
+    // Pass 1: row counts.
+    #pragma omp parallel for if(parallel)
+    for (int k = 0; k < num_edges; ++k)
     {
-        bs.macro_bits[i] = macro_bits[i] | another.macro_bits[i];
+        int x, y, w;
+        edge(k, x, y, w);
+        assert(w != 0);
+        edge_row_col(x, y);
+        rows[k] = x;
+        cols[k] = std::make_pair(y, w);
+        #pragma omp atomic
+        edge_row_ptr[x + 1]++;
     }
-    return bs;
-}
-
-int num_ones(int n)
-{
-    int cnt = 0;
-    while (n) {
-        n &= (n - 1);
-        cnt += 1;
+    for (int i = 0; i < num_nodes; ++i)
+        edge_row_ptr[i + 1] += edge_row_ptr[i];
+    // Pass 2: scatter. Threads claim slots in any order, so every row is
+    // sorted afterwards, on (col, weight) to stay deterministic.
+    std::vector<int> cursor(edge_row_ptr.begin(), edge_row_ptr.end() - 1);
+    edge_cols.resize(num_edges);
+    #pragma omp parallel for if(parallel)
+    for (int k = 0; k < num_edges; ++k)
+    {
+        int pos;
+        #pragma omp atomic capture
+        pos = cursor[rows[k]]++;
+        edge_cols[pos] = cols[k];
     }
-    return cnt;
+    #pragma omp parallel for schedule(dynamic, 256) if(parallel)
+    for (int i = 0; i < num_nodes; ++i)
+        if (edge_row_ptr[i + 1] - edge_row_ptr[i] > 1)
+            std::sort(edge_cols.begin() + edge_row_ptr[i],
+                      edge_cols.begin() + edge_row_ptr[i + 1]);
 }
 
-GraphStruct::GraphStruct(int graph_id, int num_nodes, int num_edges, void* _prev_labels,
+GraphStruct::GraphStruct(int graph_id, int num_nodes, int num_edges,
+                         void* _prev_row_ptr, void* _prev_cols, void* _prev_signs,
                          void* _edge_pairs, void* _edge_signs, int n_left, int n_right)
 {
     this->num_nodes = num_nodes;
     this->num_edges = num_edges;
     this->graph_id = graph_id;
+    this->n_left = n_left;
+    this->n_right = n_right;
 
-    edge_list.clear();
     active_rows.clear();
     idx_map.clear();
-    prev_adj.clear();
-
-    if(_prev_labels == nullptr)
-        return;
-    int* prev_labels = static_cast<int*>(_prev_labels);
-    prev_adj.push_back(std::vector<int>());
 
-    int k = 0;
-    for (int i = 1; i < num_nodes; i++)
+    auto block = std::make_shared<std::vector<std::pair<int, int> > >();
+    // No previous snapshot means every row starts out empty.
+    std::vector<int> empty_row_ptr;
+    int* row_ptr = static_cast<int*>(_prev_row_ptr);
+    if (row_ptr != nullptr)
     {
-        std::vector<int> row(prev_labels + k, prev_labels + k + i);
-        prev_adj.push_back(row);
-        k += i;
+        int* prev_cols = static_cast<int*>(_prev_cols);
+        int* prev_signs = static_cast<int*>(_prev_signs);
+        block->reserve(row_ptr[num_nodes]);
+        for (int i = 0; i < num_nodes; ++i)
+        {
+            assert(row_ptr[i] <= row_ptr[i + 1]);
+            for (int k = row_ptr[i]; k < row_ptr[i + 1]; ++k)
+            {
+                assert(k == row_ptr[i] || prev_cols[k - 1] < prev_cols[k]);
+                block->push_back(std::make_pair(prev_cols[k], prev_signs[k]));
+            }
+        }
+    } else {
+        empty_row_ptr.assign(num_nodes + 1, 0);
+        row_ptr = empty_row_ptr.data();
     }
-//    std::cout << "Prev Size: " << prev_adj.size() << std::endl;
-//    for (auto v : prev_adj) {
-//        for (auto a : v) {
-//            std::cout << a << " ";
-//        }
-//        std::cout << std::endl;
-//    }
-    if (_edge_pairs == nullptr)
-        return;
+    init_prev_pages(block->data() - row_ptr[0], row_ptr, block);
     int* edge_pairs = static_cast<int*>(_edge_pairs);
     int* edge_signs = static_cast<int*>(_edge_signs);
-    for (int i = 0; i < num_edges; ++i)
+    if (edge_pairs == nullptr)
+        num_edges = 0;
+    bucket_edges(num_edges, [=](int k, int& x, int& y, int& w) {
+        x = edge_pairs[k * 2];
+        y = edge_pairs[k * 2 + 1];
+        w = edge_signs[k];
+    });
+}
+
+void GraphStruct::init_prev_pages(std::pair<int, int>* base, const int* row_ptr,
+                                  std::shared_ptr<const void> block)
+{
+    int num_pages = (num_nodes + prev_page_size - 1) >> prev_page_bits;
+    prev_pages.clear();
+    for (int p = 0; p < num_pages; ++p)
     {
-        int x = edge_pairs[i * 2];
-        int y = edge_pairs[i * 2 + 1];
-        int weight = edge_signs[i];
-        assert(weight != 0);
-        if (n_left < 0 || n_right < 0)
+        auto page = std::make_shared<PrevPage>();
+        page->blocks.push_back(block);
+        for (int j = 0; j < prev_page_size; ++j)
         {
-            if (x < y)
+            int i = (p << prev_page_bits) + j;
+            auto& r = page->rows[j];
+            r.base = i < num_nodes ? base + row_ptr[i] : nullptr;
+            r.base_len = i < num_nodes ? row_ptr[i + 1] - row_ptr[i] : 0;
+            r.edits = nullptr;
+            r.num_edits = 0;
+            r.base_block = r.edit_block = 0;
+        }
+        prev_pages.push_back(page);
+    }
+}
+
+// Most edits a delta row keeps over a base of base_len entries before it is
+// compacted. Touching a row rewrites its edits, so this bounds that cost at
+// O(sqrt(base_len)) while a compaction, O(base_len), comes at most every
+// sqrt(base_len) edits.
+static int compact_edits(int base_len)
+{
+    return 16 + (int)std::sqrt((double)base_len);
+}
+
+GraphStruct::GraphStruct(int graph_id, GraphStruct* prev_graph,
+                         int num_added, void* _added_pairs,
+                         int num_removed, void* _removed_pairs)
+{
+    this->num_nodes = prev_graph->num_nodes;
+    this->num_edges = num_added + num_removed;
+    this->graph_id = graph_id;
+    this->n_left = prev_graph->n_left;
+    this->n_right = prev_graph->n_right;
+
+    active_rows.clear();
+    idx_map.clear();
+
+    // Start from prev_graph's pages and, in one new block, rewrite the
+    // edits of the rows its delta touches; a row is compacted into a new
+    // base once its edits outgrow compact_edits, so touching a row stays
+    // cheap. Only the pages of touched rows are copied.
+    prev_pages = prev_graph->prev_pages;
+    auto& delta_ptr = prev_graph->edge_row_ptr;
+    auto& delta = prev_graph->edge_cols;
+    auto block = std::make_shared<std::vector<std::pair<int, int> > >();
+    std::vector<std::pair<int, int> > merged;
+    // (row, offset in block) of each touched row, -row - 1 if compacted.
+    std::vector<std::pair<int, int> > row_offset;
+    for (int i = 0; i < num_nodes; ++i)
+    {
+        if (delta_ptr[i + 1] == delta_ptr[i])
+            continue;
+        auto& r = prev_row(i);
+        merged.clear();
+        int k = 0;
+        for (int d = delta_ptr[i]; d < delta_ptr[i + 1]; ++d)
+        {
+            int col = delta[d].first;
+            for (; k < r.num_edits && r.edits[k].first < col; ++k)
+                merged.push_back(r.edits[k]);
+            bool edited = k < r.num_edits && r.edits[k].first == col;
+            auto* base = std::lower_bound(r.base, r.base + r.base_len, col,
+                                          [](const std::pair<int, int>& e, int c) {
+                                              return e.first < c;
+                                          });
+            bool in_base = base < r.base + r.base_len && base->first == col &&
+                           base->second == 1;
+            bool had = edited ? r.edits[k].second == 1 : in_base;
+            bool has = delta[d].second > 0;
+            assert(had != has);
+            (void)had;
+            if (has != in_base)
+                merged.push_back(std::make_pair(col, has ? 1 : 0));
+            if (edited)
+                k++;
+        }
+        for (; k < r.num_edits; ++k)
+            merged.push_back(r.edits[k]);
+        row_offset.push_back(std::make_pair(i, (int)block->size()));
+        if ((int)merged.size() <= compact_edits(r.base_len))
+        {
+            block->insert(block->end(), merged.begin(), merged.end());
+            continue;
+        }
+        // Compact: the base with its edits applied becomes the new base.
+        row_offset.back().first = -i - 1;
+        size_t e = 0;
+        for (int b = 0; b < r.base_len; ++b)
+        {
+            for (; e < merged.size() && merged[e].first < r.base[b].first; ++e)
+                if (merged[e].second == 1)
+                    block->push_back(merged[e]);
+            if (e < merged.size() && merged[e].first == r.base[b].first)
             {
-                int t = x; x = y; y = t;
+                if (merged[e++].second == 1)
+                    block->push_back(std::make_pair(r.base[b].first, 1));
+            } else {
+                block->push_back(r.base[b]);
             }
-        } else {
-            if (x > y)
+        }
+        for (; e < merged.size(); ++e)
+            if (merged[e].second == 1)
+                block->push_back(merged[e]);
+    }
+    // The block is final, so runs can point into it now. Touched rows come
+    // in increasing order, so each page is copied once.
+    std::shared_ptr<PrevPage> page;
+    int page_id = -1, new_block = -1;
+    for (size_t j = 0; j <= row_offset.size(); ++j)
+    {
+        bool last = j == row_offset.size();
+        bool compacted = !last && row_offset[j].first < 0;
+        int i = last ? -1 : compacted ? -row_offset[j].first - 1 : row_offset[j].first;
+        if (page && (last || (i >> prev_page_bits) != page_id))
+        {
+            // Keep only the blocks some row of the page still points to.
+            std::vector<int> block_ids(page->blocks.size(), -1);
+            for (auto& r : page->rows)
+                block_ids[r.base_block] = block_ids[r.edit_block] = 0;
+            std::vector<std::shared_ptr<const void> > blocks;
+            for (size_t b = 0; b < block_ids.size(); ++b)
+                if (block_ids[b] == 0)
+                {
+                    block_ids[b] = blocks.size();
+                    blocks.push_back(page->blocks[b]);
+                }
+            for (auto& r : page->rows)
             {
-                int t = x; x = y; y = t;
+                r.base_block = block_ids[r.base_block];
+                r.edit_block = block_ids[r.edit_block];
             }
-            assert(x < n_left);
-            y -= n_left;
-            assert(y >= 0 && y < n_right);
+            page->blocks.swap(blocks);
+            prev_pages[page_id] = page;
+            page = nullptr;
+        }
+        if (last)
+            break;
+        if (!page)
+        {
+            page_id = i >> prev_page_bits;
+            page = std::make_shared<PrevPage>(*prev_pages[page_id]);
+            new_block = page->blocks.size();
+            page->blocks.push_back(block);
+        }
+        int begin = row_offset[j].second;
+        int end = j + 1 < row_offset.size() ? row_offset[j + 1].second : (int)block->size();
+        auto& r = page->rows[i & (prev_page_size - 1)];
+        if (compacted)
+        {
+            r.base = block->data() + begin;
+            r.base_len = end - begin;
+            r.base_block = new_block;
+            r.edits = nullptr;
+            r.num_edits = 0;
+        } else {
+            r.edits = end > begin ? block->data() + begin : nullptr;
+            r.num_edits = end - begin;
         }
-        if (!edge_list.count(x))
-            edge_list[x] = std::vector<std::pair<int, int> >();
-        edge_list[x].push_back(std::make_pair(y, weight));
+        r.edit_block = new_block;
     }
 
-    for (auto it = edge_list.begin(); it != edge_list.end(); ++it)
-        std::sort(it->second.begin(), it->second.end(),
-        [](const std::pair<int, int> &left, const std::pair<int, int> &right) {
-            return left.first < right.first;
-        });
+    int* added_pairs = static_cast<int*>(_added_pairs);
+    int* removed_pairs = static_cast<int*>(_removed_pairs);
+    bucket_edges(num_added + num_removed, [=](int k, int& x, int& y, int& w) {
+        int* pairs = k < num_added ? added_pairs + k * 2 : removed_pairs + (k - num_added) * 2;
+        x = pairs[0];
+        y = pairs[1];
+        w = k < num_added ? 1 : -1;
+    });
+}
+
+GraphStruct::GraphStruct(int graph_id, const GraphStore& store, int pair_id)
+{
+    static_assert(sizeof(std::pair<int, int>) == 2 * sizeof(int32_t),
+                  "store rows are read as std::pair<int, int>");
+    auto& pair = store.pair(pair_id);
+    int snapshot_id = pair.snapshot;
+    this->num_nodes = store.snapshot(snapshot_id).num_nodes;
+    this->num_edges = pair.num_edges;
+    this->graph_id = graph_id;
+    this->n_left = pair.n_left;
+    this->n_right = pair.n_right;
+
+    active_rows.clear();
+    idx_map.clear();
+
+    const int32_t* row_ptr = store.row_ptr(snapshot_id);
+    // The mapping is read-only; prev runs are never written through.
+    auto* rows = reinterpret_cast<std::pair<int, int>*>(const_cast<int32_t*>(store.rows(snapshot_id)));
+    for (int i = 0; i < num_nodes; ++i)
+        assert(row_ptr[i] <= row_ptr[i + 1]);
+    init_prev_pages(rows, row_ptr, store.data);
+
+    const int32_t* edges = store.edges(pair_id);
+    bucket_edges(num_edges, [=](int k, int& x, int& y, int& w) {
+        x = edges[k * 3];
+        y = edges[k * 3 + 1];
+        w = edges[k * 3 + 2];
+    });
 }
+
 /* TODO: remove entirely. */
 GraphStruct* GraphStruct::permute()
 {
@@ -156,29 +371,43 @@ GraphStruct* GraphStruct::permute()
 
 
 void GraphStruct::realize_nodes(int node_start, int node_end, int col_start,
-                                int col_end)
+                                int col_end, JobCollect& jobs,
+                                PtHolder<AdjRow>& rows, NodeArena& arena)
 {
     active_rows.clear();
     for (int i = node_start; i < node_end; ++i)
-        active_rows.push_back(row_holder.get_pt(i, col_start, col_end));
+        active_rows.push_back(rows.get_pt(i, col_start, col_end, arena));
 
     for (int i = node_start; i < node_end; ++i)
     {
         // Starts at 0.
         auto* row = active_rows[i - node_start];
-        row->insert_edges(edge_list[i], prev_adj[i]);
+        int num_row_edges = edge_row_ptr[i + 1] - edge_row_ptr[i];
+        std::pair<int, int>* row_edges = nullptr;
+        if (num_row_edges)
+            row_edges = edge_cols.data() + edge_row_ptr[i];
+        row->insert_edges(row_edges, num_row_edges,
+                          prev_row(i).base, prev_row(i).base_len, jobs, arena,
+                          prev_row(i).edits, prev_row(i).num_edits);
     }
     this->node_start = node_start;
     this->node_end = node_end;
 }
 
 
-ColAutomata::ColAutomata(std::vector<std::pair<int, int> >& _indices, std::vector<int>& prev_row)
+ColAutomata::ColAutomata(std::pair<int, int>* indices, int num_indices,
+                         std::pair<int, int>* prev_indices, int num_prev,
+                         std::pair<int, int>* prev_edits, int num_edits)
 {
-    this->indices = _indices.data();
+    this->prev_edits = prev_edits;
+    this->edit_pos = 0;
+    this->num_edits = num_edits;
+    this->indices = indices;
     this->pos = 0;
-    this->num_indices = (int)_indices.size();
-    this->prev_row = prev_row;
+    this->num_indices = num_indices;
+    this->prev_indices = prev_indices;
+    this->prev_pos = 0;
+    this->num_prev = num_prev;
 }
 
 int ColAutomata::add_edge(int col_idx)
@@ -203,24 +432,49 @@ int ColAutomata::last_edge()
     return this->indices[this->num_indices - 1].first;
 }
 
-bool ColAutomata::has_edge(int range_start, int range_end)
+// First position in [lo, n) whose column is >= col. Gallops from lo so that
+// hits near the cursor stay O(1) and far ones cost O(log d).
+static int gallop_lower_bound(std::pair<int, int>* cols, int lo, int n, int col)
 {
-    for (int i = pos; i < this->num_indices; ++i)
+    if (lo >= n || cols[lo].first >= col)
+        return lo;
+    int step = 1, hi = lo + 1;
+    while (hi < n && cols[hi].first < col)
     {
-        if (this->indices[i].first >= range_start && this->indices[i].first < range_end)
-            return true;
-        if (this->indices[i].first >= range_end)
-            break;
+        lo = hi;
+        step <<= 1;
+        hi = lo + step;
     }
-    return false;
+    if (hi > n)
+        hi = n;
+    auto* it = std::lower_bound(cols + lo + 1, cols + hi, col,
+                                [](const std::pair<int, int>& e, int c) {
+                                    return e.first < c;
+                                });
+    return it - cols;
 }
 
-bool ColAutomata::had_edge(int ix) {
-    assert(ix < this->prev_row.size());
-    bool had_edge = this->prev_row[ix] == 1 ? true: false;
-    return had_edge;
+bool ColAutomata::has_edge(int range_start, int range_end)
+{
+    int i = gallop_lower_bound(this->indices, pos, this->num_indices, range_start);
+    return i < this->num_indices && this->indices[i].first < range_end;
 }
 
+bool ColAutomata::had_edge(int ix) {
+    // Queries arrive in increasing column order during the tree walk, so the
+    // cursor over the sorted previous row only ever moves forward.
+    assert(prev_pos == 0 || prev_indices[prev_pos - 1].first < ix);
+    if (num_edits)
+    {
+        edit_pos = gallop_lower_bound(prev_edits, edit_pos, num_edits, ix);
+        if (edit_pos < num_edits && prev_edits[edit_pos].first == ix)
+            return prev_edits[edit_pos].second == 1;
+    }
+    prev_pos = gallop_lower_bound(prev_indices, prev_pos, num_prev, ix);
+    if (prev_pos < num_prev && prev_indices[prev_pos].first == ix)
+        return prev_indices[prev_pos].second == 1;
+    return false;
+}
 
 template<typename PtType>
 PtHolder<PtType>::PtHolder()
@@ -244,7 +498,6 @@ void PtHolder<PtType>::clear()
     cur_pos = 0;
 }
 
-template class PtHolder<AdjNode>;
 template class PtHolder<AdjRow>;
 
 
@@ -291,8 +544,9 @@ void JobCollect::reset()
     }
 }
 
-int JobCollect::add_job(AdjNode* node)
+int JobCollect::add_job(AdjNode* node, AdjNode* lch, AdjNode* rch)
 {
+    STAT_SCOPE(stats, STAT_ADD_JOB_NS);
     int job_id = global_job_nodes.size();
     int cur_depth = node->depth;
     std::vector<int>* _vpt = nullptr;
@@ -324,7 +578,7 @@ int JobCollect::add_job(AdjNode* node)
     } else {
         for (int i = 0; i < 2; ++i)
         {
-            auto* ch = (i == 0) ? node->lch : node->rch;
+            auto* ch = (i == 0) ? lch : rch;
             if (ch->has_edge && !ch->is_leaf && !ch->is_lowlevel)
             {
                 prev_froms[i][cur_depth].push_back(job_position[ch->job_idx]);
@@ -361,16 +615,227 @@ void JobCollect::append_bool(std::vector< std::vector<int> >& list,
     list[depth].push_back(val);
 }
 
-void JobCollect::build_row_indices_()
+typedef std::vector< std::vector<int> > IntLists;
+
+// Concatenates get(shard)[d] of every shard into dst[d] in shard order. When
+// val_off is given, val_off[s][d + depth_shift] is added to each value copied
+// from shard s. Chunk positions come from a prefix sum, so the copies run in
+// parallel.
+template<typename Getter>
+static void concat_lists(IntLists& dst, std::vector<JobCollect*>& shards,
+                         Getter get, const IntLists* val_off, int depth_shift)
+{
+    int n_shards = (int)shards.size();
+    size_t depth = 0;
+    for (auto* sh : shards)
+        depth = std::max(depth, get(sh).size());
+    std::vector< std::vector<size_t> > pos(n_shards + 1,
+                                           std::vector<size_t>(depth, 0));
+    for (int s = 0; s < n_shards; ++s)
+    {
+        auto& src = get(shards[s]);
+        for (size_t d = 0; d < depth; ++d)
+            pos[s + 1][d] = pos[s][d] + (d < src.size() ? src[d].size() : 0);
+    }
+    dst.resize(depth);
+    for (size_t d = 0; d < depth; ++d)
+        dst[d].resize(pos[n_shards][d]);
+
+    #pragma omp parallel for
+    for (int s = 0; s < n_shards; ++s)
+    {
+        auto& src = get(shards[s]);
+        for (size_t d = 0; d < src.size(); ++d)
+        {
+            int off = 0;
+            if (val_off != nullptr && d + depth_shift < (*val_off)[s].size())
+                off = (*val_off)[s][d + depth_shift];
+            int* out = dst[d].data() + pos[s][d];
+            for (size_t k = 0; k < src[d].size(); ++k)
+                out[k] = src[d][k] + off;
+        }
+    }
+}
+
+template<typename Getter>
+static void concat_flat(std::vector<int>& dst, std::vector<JobCollect*>& shards,
+                        Getter get)
+{
+    dst.clear();
+    for (auto* sh : shards)
+    {
+        auto& src = get(sh);
+        dst.insert(dst.end(), src.begin(), src.end());
+    }
+}
+
+// Per-shard, per-depth start offsets of the entries counted by get.
+template<typename Getter>
+static IntLists prefix_offsets(std::vector<JobCollect*>& shards, Getter get)
+{
+    size_t depth = 0;
+    for (auto* sh : shards)
+        depth = std::max(depth, get(sh).size());
+    IntLists off(shards.size(), std::vector<int>(depth + 1, 0));
+    std::vector<int> total(depth + 1, 0);
+    for (size_t s = 0; s < shards.size(); ++s)
+    {
+        auto& cnt = get(shards[s]);
+        for (size_t d = 0; d <= depth; ++d)
+        {
+            off[s][d] = total[d];
+            if (d < cnt.size())
+                total[d] += cnt[d];
+        }
+    }
+    return off;
+}
+
+void JobCollect::merge(std::vector<TreeShard*>& tree_shards)
+{
+    reset();
+    std::vector<JobCollect*> shards;
+    for (auto* t : tree_shards)
+        shards.push_back(&(t->job_collect));
+    auto cell_off = prefix_offsets(shards, [](JobCollect* c) -> std::vector<int>& {
+        return c->n_cell_job_per_level; });
+    auto bin_off = prefix_offsets(shards, [](JobCollect* c) -> std::vector<int>& {
+        return c->n_bin_job_per_level; });
+    std::vector< std::vector<int> > internal_cnt(shards.size());
+    for (size_t s = 0; s < shards.size(); ++s)
+        for (auto& v : shards[s]->has_left)
+            internal_cnt[s].push_back(v.size());
+    size_t max_int_depth = 0;
+    for (auto& c : internal_cnt)
+        max_int_depth = std::max(max_int_depth, c.size());
+    IntLists internal_off(shards.size(), std::vector<int>(max_int_depth + 1, 0));
+    for (size_t d = 0; d <= max_int_depth; ++d)
+    {
+        int total = 0;
+        for (size_t s = 0; s < shards.size(); ++s)
+        {
+            internal_off[s][d] = total;
+            if (d < internal_cnt[s].size())
+                total += internal_cnt[s][d];
+        }
+    }
+
+    // Job ids and positions.
+    for (size_t s = 0; s < shards.size(); ++s)
+    {
+        auto* sh = shards[s];
+        int job_base = global_job_nodes.size();
+        for (size_t j = 0; j < sh->global_job_nodes.size(); ++j)
+        {
+            auto* node = sh->global_job_nodes[j];
+            auto& off = node->is_lowlevel ? bin_off[s] : cell_off[s];
+            job_position.push_back(sh->job_position[j] + off[node->depth]);
+            node->job_idx += job_base;
+            global_job_nodes.push_back(node);
+        }
+        for (int k = 0; k < 2; ++k)
+        {
+            auto& src = k ? sh->n_bin_job_per_level : sh->n_cell_job_per_level;
+            auto& dst = k ? n_bin_job_per_level : n_cell_job_per_level;
+            if (dst.size() < src.size())
+                dst.resize(src.size(), 0);
+            for (size_t d = 0; d < src.size(); ++d)
+                dst[d] += src[d];
+        }
+        if (binary_feat_nodes.size() < sh->binary_feat_nodes.size())
+            binary_feat_nodes.resize(sh->binary_feat_nodes.size());
+        for (size_t d = 0; d < sh->binary_feat_nodes.size(); ++d)
+            binary_feat_nodes[d].insert(binary_feat_nodes[d].end(),
+                                        sh->binary_feat_nodes[d].begin(),
+                                        sh->binary_feat_nodes[d].end());
+    }
+
+    // Per-row lists.
+    concat_flat(has_ch, shards, [](JobCollect* c) -> std::vector<int>& { return c->has_ch; });
+    concat_flat(root_add_weights, shards, [](JobCollect* c) -> std::vector<int>& { return c->root_add_weights; });
+    concat_flat(root_del_weights, shards, [](JobCollect* c) -> std::vector<int>& { return c->root_del_weights; });
+    concat_flat(is_root_add_leaf, shards, [](JobCollect* c) -> std::vector<int>& { return c->is_root_add_leaf; });
+    concat_flat(is_root_del_leaf, shards, [](JobCollect* c) -> std::vector<int>& { return c->is_root_del_leaf; });
+
+    // Per-depth labels, which carry no indices.
+#define CONCAT_LABELS(name) \
+    concat_lists(name, shards, [](JobCollect* c) -> IntLists& { return c->name; }, nullptr, 0)
+    CONCAT_LABELS(is_internal);
+    CONCAT_LABELS(has_left);
+    CONCAT_LABELS(has_right);
+    CONCAT_LABELS(num_left);
+    CONCAT_LABELS(num_right);
+    CONCAT_LABELS(has_left_add_leaf);
+    CONCAT_LABELS(has_left_del_leaf);
+    CONCAT_LABELS(has_right_add_leaf);
+    CONCAT_LABELS(has_right_del_leaf);
+    CONCAT_LABELS(left_add_weights);
+    CONCAT_LABELS(left_del_weights);
+    CONCAT_LABELS(right_add_weights);
+    CONCAT_LABELS(right_del_weights);
+    CONCAT_LABELS(bot_left_froms);
+#undef CONCAT_LABELS
+
+    // Index lists: froms point at jobs one level down, tos at this level.
+    for (int i = 0; i < 2; ++i)
+    {
+        concat_lists(bot_froms[i], shards, [i](JobCollect* c) -> IntLists& { return c->bot_froms[i]; }, nullptr, 0);
+        concat_lists(bot_tos[i], shards, [i](JobCollect* c) -> IntLists& { return c->bot_tos[i]; }, &cell_off, 0);
+        concat_lists(prev_froms[i], shards, [i](JobCollect* c) -> IntLists& { return c->prev_froms[i]; }, &cell_off, 1);
+        concat_lists(prev_tos[i], shards, [i](JobCollect* c) -> IntLists& { return c->prev_tos[i]; }, &cell_off, 0);
+    }
+    concat_lists(bot_left_tos, shards, [](JobCollect* c) -> IntLists& { return c->bot_left_tos; }, &internal_off, 0);
+    concat_lists(next_left_froms, shards, [](JobCollect* c) -> IntLists& { return c->next_left_froms; }, &cell_off, 1);
+    concat_lists(next_left_tos, shards, [](JobCollect* c) -> IntLists& { return c->next_left_tos; }, &internal_off, 0);
+
+    // Only low-level nodes, which bits_compress turns on, are binary jobs.
+    if (n_bin_job_per_level.empty())
+        return;
+    // Bottom ids of low-level children are 2 + their binary job position,
+    // which cannot be told apart from the leaf labels by value alone; walk the
+    // jobs in merged order and rewrite those entries from the nodes instead.
+    std::vector<int> n_bot[2], n_bot_left;
+    for (auto* t : tree_shards)
+        for (auto* node : t->job_collect.global_job_nodes)
+        {
+            int d = node->depth;
+            if ((int)n_bot_left.size() <= d)
+            {
+                n_bot_left.resize(d + 1, 0);
+                n_bot[0].resize(d + 1, 0);
+                n_bot[1].resize(d + 1, 0);
+            }
+            for (int i = 0; i < 2; ++i)
+            {
+                auto* ch = t->node_arena.get((i == 0) ? node->lch : node->rch);
+                bool ch_cell = ch->has_edge && !ch->is_leaf && !ch->is_lowlevel;
+                bool ch_bin = ch->has_edge && !ch->is_leaf && ch->is_lowlevel;
+                if (i == 0 && !ch_cell)
+                {
+                    int k = n_bot_left[d]++;
+                    if (ch_bin)
+                        bot_left_froms[d][k] = 2 + job_position[ch->job_idx];
+                }
+                if (!node->is_lowlevel && !ch_cell)
+                {
+                    int k = n_bot[i][d]++;
+                    if (ch_bin)
+                        bot_froms[i][d][k] = 2 + job_position[ch->job_idx];
+                }
+            }
+        }
+}
+
+void JobCollect::build_row_indices_(std::vector<GraphStruct*>& graphs)
 {
     row_prev_from.clear();
     row_prev_to.clear();
     row_bot_from.clear();
     row_bot_to.clear();
     int offset = 0;
-    for (size_t i = 0; i < active_graphs.size(); ++i)
+    for (size_t i = 0; i < graphs.size(); ++i)
     {
-        auto* g = active_graphs[i];
+        auto* g = graphs[i];
         int ub = g->active_rows.size() - 1; // Don't need last token for auto-regression.
         // Push back a start of sequence token.
         row_bot_from.push_back(0);
@@ -410,7 +875,7 @@ void JobCollect::build_row_indices_()
     }
 }
 
-void JobCollect::build_row_indices()
+void JobCollect::build_row_indices(std::vector<GraphStruct*>& graphs)
 {
     for (int i = 0; i < 2; ++i)
     {
@@ -433,10 +898,10 @@ void JobCollect::build_row_indices()
     bool has_next = false;
     std::vector<int> used_cnts;
     used_cnts.clear();
-    for (size_t i = 0; i < active_graphs.size(); ++i)
+    for (size_t i = 0; i < graphs.size(); ++i)
     {
         used_cnts.push_back(0);
-        auto* g = active_graphs[i];
+        auto* g = graphs[i];
         layer_sizes.push_back(g->active_rows.size());
         int prev_correct = g->node_start & 1;
         used_cnts[i] += prev_correct;
@@ -497,9 +962,9 @@ void JobCollect::build_row_indices()
         int old_offset = 0;
         prev_offset = 0;
         offset = 0;
-        for (size_t i = 0; i < active_graphs.size(); ++i)
+        for (size_t i = 0; i < graphs.size(); ++i)
         {
-            auto* g = active_graphs[i];
+            auto* g = graphs[i];
             int prev_correct = (g->node_start & (1 << lv)) > 0;
             int ub = (layer_sizes[i] + prev_correct) / 2;
             for (int j = 0; j < ub; ++j)
@@ -529,7 +994,7 @@ void JobCollect::build_row_indices()
     max_row_merge_steps = lv;
 }
 
-void JobCollect::build_row_summary()
+void JobCollect::build_row_summary(std::vector<GraphStruct*>& graphs)
 {
     layer_sizes.clear();
     tree_idx_map.clear();
@@ -542,9 +1007,9 @@ void JobCollect::build_row_summary()
     std::vector<int> used_cnts, past_cnts;
     used_cnts.clear();
     past_cnts.clear();
-    for (size_t i = 0; i < active_graphs.size(); ++i)
+    for (size_t i = 0; i < graphs.size(); ++i)
     {
-        auto* g = active_graphs[i];
+        auto* g = graphs[i];
         layer_sizes.push_back(g->active_rows.size());
         tree_idx_map.push_back(std::unordered_map<int, int>());
         used_cnts.push_back(0);
@@ -555,7 +1020,7 @@ void JobCollect::build_row_summary()
     bool has_job = true;
     int layer = 0;
     int global_offset = 4;
-    if (cfg::bits_compress && n_bin_job_per_level.size())
+    if (n_bin_job_per_level.size())
         global_offset += n_bin_job_per_level[0];
     int past_start_offset = global_offset;
     global_offset += tot_past;
@@ -566,8 +1031,11 @@ void JobCollect::build_row_summary()
         int past_offset = past_start_offset;
         for (size_t i = 0; i < layer_sizes.size(); ++i)
         {
-            auto* g = active_graphs[i];
+            auto* g = graphs[i];
             int num_rows = (int)g->active_rows.size(), cnt = 0;
+            // A layer holds up to num_rows + 1 slots once shifted by the bit
+            // of node_start, so keying by layer * num_rows would collide.
+            int stride = num_rows + 1;
             int cur_bit = (g->node_start & (1 << layer)) > 0;
             if (layer == 0)
             {
@@ -576,7 +1044,7 @@ void JobCollect::build_row_summary()
                     auto* root = g->active_rows[j]->root;
                     if (root->has_edge && !root->is_leaf && !root->is_lowlevel)
                     {
-                        tree_idx_map[i][layer * num_rows + j + cur_bit] = cnt + global_offset;  // NOLINT
+                        tree_idx_map[i][layer * stride + j + cur_bit] = cnt + global_offset;  // NOLINT
                         cnt += 1;
                     } else {
                         // TODO: edge sign.
@@ -586,16 +1054,16 @@ void JobCollect::build_row_summary()
                         }
                         if (root->has_edge && !root->is_leaf)
                             bid = 3 + job_position[root->job_idx];
-                        tree_idx_map[i][layer * num_rows + j + cur_bit] = bid;
+                        tree_idx_map[i][layer * stride + j + cur_bit] = bid;
                     }
                 }
             } else {
                 for (int j = 0; j < layer_sizes[i]; ++j)
-                    tree_idx_map[i][layer * num_rows + j + cur_bit] = (global_offset + j);  // NOLINT
+                    tree_idx_map[i][layer * stride + j + cur_bit] = (global_offset + j);  // NOLINT
                 cnt = layer_sizes[i];
             }
             if (cur_bit) {
-                tree_idx_map[i][layer * num_rows] = past_offset + used_cnts[i];
+                tree_idx_map[i][layer * stride] = past_offset + used_cnts[i];
                 used_cnts[i] += 1;
             }
             global_offset += cnt;
@@ -603,7 +1071,7 @@ void JobCollect::build_row_summary()
         }
         for (size_t i = 0; i < layer_sizes.size(); ++i)
         {
-            auto* g = active_graphs[i];
+            auto* g = graphs[i];
             int bit = (g->node_start & (1 << layer)) > 0;
             layer_sizes[i] = (layer_sizes[i] + bit) / 2;
             if (layer_sizes[i] || used_cnts[i] != past_cnts[i])
@@ -617,9 +1085,9 @@ void JobCollect::build_row_summary()
     global_offset = 0;
     max_rowsum_steps = 0;
     next_state_froms.clear();
-    for (size_t i = 0; i < active_graphs.size(); ++i)
+    for (size_t i = 0; i < graphs.size(); ++i)
     {
-        auto* g = active_graphs[i];
+        auto* g = graphs[i];
         int num_nodes = (int)g->active_rows.size();
         for (int j = 0; j < num_nodes + 1; ++j)
         {
@@ -643,7 +1111,7 @@ void JobCollect::build_row_summary()
                     int prev_bit = (g->node_start & (1 << layer)) > 0;
                     int pos = 2 * k - num_prev + prev_bit;
                     assert(pos >= 0);
-                    src = tree_idx_map[i][layer * num_nodes + pos];
+                    src = tree_idx_map[i][layer * (num_nodes + 1) + pos];
                     if (j < num_nodes)
                     {
                         assert(step < (int)step_inputs.size());
@@ -686,5 +1154,3 @@ void JobCollect::build_row_summary()
     }
     max_rowsum_steps -= 1;
 }
-
-JobCollect job_collect;
@@ -0,0 +1,471 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <tuple>
+#include "config.h"  // NOLINT
+#include "tree_sampler.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+namespace {
+
+enum Phase
+{
+    ENTER, ROOT_LEAF_DONE, HAS_CH_DONE, EXPAND, LEFT_LEAF_DONE,
+    HAS_LEFT_DONE, TOPDOWN, LEFT_DONE, L2R, HAS_RIGHT_DONE, RIGHT,
+    RIGHT_LEAF_DONE, TOPRIGHT, RIGHT_DONE, SUMMARY
+};
+
+}  // namespace
+
+TreeSampler::TreeSampler(const TreeConfig& cfg, int seed, float greedy_frac)
+    : cfg(cfg), seed(seed), greedy_frac(greedy_frac), round(0)
+{
+    num_slots = NEG_SLOT + 1;
+}
+
+TreeSampler::~TreeSampler()
+{
+    for (auto* w : walks)
+        if (w)
+        {
+            free_arenas.push_back(w->arena);
+            delete w;
+        }
+    for (auto* arena : free_arenas)
+        delete arena;
+}
+
+int TreeSampler::new_slot(Walk* w)
+{
+    int slot;
+    if (free_slots.size())
+    {
+        slot = free_slots.back();
+        free_slots.pop_back();
+    } else {
+        slot = num_slots++;
+        slot_round.resize(num_slots, -1);
+        slot_wave.resize(num_slots, 0);
+    }
+    w->slots.push_back(slot);
+    return slot;
+}
+
+int TreeSampler::add_row(int graph_id, int row, int col_start, int col_end,
+                         int lb, int ub, int num_prev, int* prev_cols)
+{
+    Walk* w = new Walk();
+    w->row = row;
+    w->rng = CounterRng(seed, graph_id, row);
+    w->lb = lb;
+    w->ub = ub;
+    if (free_arenas.size())
+    {
+        w->arena = free_arenas.back();
+        free_arenas.pop_back();
+    } else {
+        w->arena = new NodeArena(cfg);
+    }
+    w->arena->reset();
+    w->prev_cols.assign(prev_cols, prev_cols + num_prev);
+    assert(std::is_sorted(w->prev_cols.begin(), w->prev_cols.end()));
+    w->input_slot = new_slot(w);
+    w->summary = -1;
+    w->num_edges = 0;
+    w->ll = 0;
+    w->done = false;
+    w->wait_op = -1;
+
+    AdjRow adj_row;
+    adj_row.init(row, col_start, col_end, *(w->arena));
+    push_frame(w, adj_row.root->idx, w->input_slot, lb, ub);
+
+    int walk_id;
+    if (free_walks.size())
+    {
+        walk_id = free_walks.back();
+        free_walks.pop_back();
+        walks[walk_id] = w;
+    } else {
+        walk_id = walks.size();
+        walks.push_back(w);
+    }
+    return walk_id;
+}
+
+void TreeSampler::release(int walk_id)
+{
+    Walk* w = walks[walk_id];
+    assert(w && w->done);
+    for (int slot : w->slots)
+        free_slots.push_back(slot);
+    free_arenas.push_back(w->arena);
+    delete w;
+    walks[walk_id] = nullptr;
+    free_walks.push_back(walk_id);
+}
+
+int TreeSampler::emit(Walk* w, int op, int in0, int in1, int depth, int arg0,
+                      int arg1, bool has_out)
+{
+    int wave = 0;
+    for (int in : {in0, in1})
+        if (in >= 0 && slot_round[in] == round)
+            wave = std::max(wave, slot_wave[in] + 1);
+    int out = has_out ? new_slot(w) : -1;
+    if (has_out)
+    {
+        slot_round[out] = round;
+        slot_wave[out] = wave;
+    }
+    int rec[sampler_op_fields] = {op, wave, out, in0, in1, depth, arg0, arg1};
+    ops.insert(ops.end(), rec, rec + sampler_op_fields);
+    return has_out ? out : (int)(ops.size() / sampler_op_fields) - 1;
+}
+
+float TreeSampler::fix_prob(float p)
+{
+    float q = p * (1 - greedy_frac);
+    if (p >= 0.5)
+        q += greedy_frac;
+    return q;
+}
+
+bool TreeSampler::decide(Walk* w, float p)
+{
+    return w->rng.uniform() < p;
+}
+
+void TreeSampler::push_frame(Walk* w, int node, int state, int lb, int ub)
+{
+    assert(lb <= ub);
+    Walk::Frame f;
+    f.node = node;
+    f.state = state;
+    f.lb = lb;
+    f.ub = ub;
+    f.phase = ENTER;
+    f.left_state = f.right_state = f.topdown = -1;
+    f.num_left = f.num_right = f.rlb = f.rub = 0;
+    f.has_left = f.has_right = false;
+    w->stack.push_back(f);
+}
+
+void TreeSampler::pop_frame(Walk* w, int state, int num)
+{
+    w->stack.pop_back();
+    w->ret_state = state;
+    w->ret_num = num;
+    if (w->stack.empty())
+    {
+        w->done = true;
+        w->summary = state;
+        w->num_edges = num;
+    }
+}
+
+// The leaf half of sample_leaf: edge sign from the previous snapshot, then
+// either a P_SIGN decision or, when the leaf is known to hold an edge, none.
+bool TreeSampler::begin_leaf(Walk* w, int state, AdjNode* node, bool forced)
+{
+    if (node->n_cols == 0)
+    {
+        w->leaf_state = EMPTY_SLOT;
+        w->leaf_has = false;
+        return false;
+    }
+    bool had_edge = std::binary_search(w->prev_cols.begin(), w->prev_cols.end(),
+                                       node->col_begin);
+    w->leaf_sign = had_edge ? -1 : 1;
+    w->leaf_node = node->idx;
+    if (forced)
+    {
+        finish_leaf(w, node, w->leaf_sign, true);
+        return false;
+    }
+    w->wait_kind = P_SIGN;
+    w->wait_op = emit(w, P_SIGN, state, -1, node->depth, w->leaf_sign, 0, false);
+    return true;
+}
+
+void TreeSampler::finish_leaf(Walk* w, AdjNode* node, int sign, bool forced)
+{
+    if (sign != 0)
+    {
+        w->cols.push_back(node->col_begin);
+        w->signs.push_back(sign);
+    }
+    node->has_edge = sign != 0;
+    node->update_bits(*(w->arena), sign);
+    w->leaf_state = sign > 0 ? POS_SLOT : (sign < 0 ? NEG_SLOT : EMPTY_SLOT);
+    w->leaf_has = sign != 0;
+}
+
+// Advances w through gen_row until it is blocked on a decision or done.
+void TreeSampler::run(Walk* w)
+{
+    NodeArena& arena = *(w->arena);
+    while (!w->done)
+    {
+        auto& f = w->stack.back();
+        AdjNode* node = arena.get(f.node);
+        AdjNode* lch = node->lch >= 0 ? arena.get(node->lch) : nullptr;
+        AdjNode* rch = node->rch >= 0 ? arena.get(node->rch) : nullptr;
+        switch (f.phase)
+        {
+        case ENTER:
+            if (!node->is_root)
+            {
+                f.phase = EXPAND;
+                break;
+            }
+            if (node->is_leaf)
+            {
+                f.phase = ROOT_LEAF_DONE;
+                if (begin_leaf(w, f.state, node, false))
+                    return;
+                break;
+            }
+            f.phase = HAS_CH_DONE;
+            w->wait_kind = P_HAS_CH;
+            w->wait_op = emit(w, P_HAS_CH, f.state, -1, node->depth, 0, 0, false);
+            return;
+        case ROOT_LEAF_DONE:
+            pop_frame(w, w->leaf_state, w->leaf_has);
+            break;
+        case HAS_CH_DONE:
+        {
+            float p = w->prob;
+            bool has_edge = decide(w, fix_prob(p));
+            if (f.ub == 0 || node->n_cols <= 0)
+                has_edge = false;
+            if (f.lb)
+                has_edge = true;
+            w->ll += has_edge ? log(p) : log(1 - p);
+            node->has_edge = has_edge;
+            if (!has_edge)
+                pop_frame(w, EMPTY_SLOT, 0);
+            else
+                f.phase = EXPAND;
+            break;
+        }
+        case EXPAND:
+            assert(!node->is_leaf);
+            node->split(arena);
+            lch = arena.get(node->lch);
+            rch = arena.get(node->rch);
+            if (lch->is_leaf)
+            {
+                f.phase = LEFT_LEAF_DONE;
+                if (begin_leaf(w, f.state, lch, false))
+                    return;
+                break;
+            }
+            f.phase = HAS_LEFT_DONE;
+            w->wait_kind = P_HAS_LEFT;
+            w->wait_op = emit(w, P_HAS_LEFT, f.state, -1, node->depth, 0, 0, false);
+            return;
+        case LEFT_LEAF_DONE:
+            f.left_state = w->leaf_state;
+            f.has_left = w->leaf_has;
+            f.num_left = f.has_left;
+            f.phase = TOPDOWN;
+            break;
+        case HAS_LEFT_DONE:
+        {
+            float p = w->prob;
+            f.has_left = decide(w, fix_prob(p));
+            if (f.ub == 0)
+                f.has_left = false;
+            if (f.lb > rch->n_cols)
+                f.has_left = true;
+            w->ll += f.has_left ? log(p) : log(1 - p);
+            f.phase = TOPDOWN;
+            break;
+        }
+        case TOPDOWN:
+            f.state = emit(w, S_TOPDOWN_LEFT, f.state, -1, node->depth,
+                           f.has_left, lch->n_cols, true);
+            f.phase = L2R;
+            if (!lch->is_leaf)
+            {
+                if (f.has_left)
+                {
+                    f.phase = LEFT_DONE;
+                    push_frame(w, lch->idx, f.state, std::max(0, f.lb - rch->n_cols),
+                               std::min(lch->n_cols, f.ub));
+                } else {
+                    f.left_state = EMPTY_SLOT;
+                    f.num_left = 0;
+                }
+            }
+            break;
+        case LEFT_DONE:
+            f.left_state = w->ret_state;
+            f.num_left = w->ret_num;
+            f.phase = L2R;
+            break;
+        case L2R:
+            f.topdown = emit(w, S_L2R, f.state, f.left_state, node->depth, 0,
+                             rch->n_cols, true);
+            f.rlb = std::max(0, f.lb - f.num_left);
+            f.rub = std::min(rch->n_cols, f.ub - f.num_left);
+            f.phase = RIGHT;
+            if (!f.has_left)  // Know it has edge, not in left => it's in right.
+                f.has_right = true;
+            else if (rch->is_leaf)
+                f.has_right = false;  // To be sampled by the leaf.
+            else {
+                f.phase = HAS_RIGHT_DONE;
+                w->wait_kind = P_HAS_RIGHT;
+                w->wait_op = emit(w, P_HAS_RIGHT, f.topdown, -1, node->depth, 0, 0, false);
+                return;
+            }
+            break;
+        case HAS_RIGHT_DONE:
+        {
+            float p = w->prob;
+            f.has_right = decide(w, fix_prob(p));
+            if (f.rub == 0)
+                f.has_right = false;
+            if (f.rlb)
+                f.has_right = true;
+            w->ll += f.has_right ? log(p) : log(1 - p);
+            f.phase = RIGHT;
+            break;
+        }
+        case RIGHT:
+            if (rch->is_leaf)
+            {
+                f.phase = RIGHT_LEAF_DONE;
+                if (begin_leaf(w, f.topdown, rch, f.has_right))
+                    return;
+            } else {
+                f.phase = TOPRIGHT;
+            }
+            break;
+        case RIGHT_LEAF_DONE:
+            f.right_state = w->leaf_state;
+            f.has_right = w->leaf_has;
+            f.num_right = f.has_right;
+            f.phase = TOPRIGHT;
+            break;
+        case TOPRIGHT:
+            f.topdown = emit(w, S_TOPRIGHT, f.topdown, -1, node->depth,
+                             f.has_right, 0, true);
+            f.phase = SUMMARY;
+            if (!rch->is_leaf)
+            {
+                if (f.has_right)
+                {
+                    f.phase = RIGHT_DONE;
+                    push_frame(w, rch->idx, f.topdown, f.rlb, f.rub);
+                } else {
+                    f.right_state = EMPTY_SLOT;
+                    f.num_right = 0;
+                }
+            }
+            break;
+        case RIGHT_DONE:
+            f.right_state = w->ret_state;
+            f.num_right = w->ret_num;
+            f.phase = SUMMARY;
+            break;
+        case SUMMARY:
+        {
+            int summary;
+            if (node->is_lowlevel)
+            {
+                node->update_bits(arena);
+                int n_ints = (cfg.bits_compress + ibits - 1) / ibits;
+                bit_lens.push_back(node->n_cols);
+                bit_pos.insert(bit_pos.end(), node->bits_rep_pos, node->bits_rep_pos + n_ints);
+                bit_neg.insert(bit_neg.end(), node->bits_rep_neg, node->bits_rep_neg + n_ints);
+                summary = emit(w, S_BITS, -1, -1, node->depth, node->n_cols,
+                               (int)bit_lens.size() - 1, true);
+            } else {
+                summary = emit(w, S_MERGE, f.left_state, f.right_state,
+                               node->depth, 0, 0, true);
+            }
+            pop_frame(w, summary, f.num_left + f.num_right);
+            break;
+        }
+        }
+    }
+}
+
+int TreeSampler::step()
+{
+    round++;
+    ops.clear();
+    bit_lens.clear();
+    bit_pos.clear();
+    bit_neg.clear();
+    for (auto* w : walks)
+    {
+        if (!w || w->done)
+            continue;
+        if (w->wait_op >= 0)
+        {
+            w->wait_op = -1;
+            if (w->wait_kind == P_SIGN)
+            {
+                // torch.bernoulli(p) in sample_leaf.
+                float p = w->prob;
+                bool take = decide(w, p);
+                w->ll += take ? log(p) : log(1 - p);
+                finish_leaf(w, w->arena->get(w->leaf_node),
+                            take ? w->leaf_sign : 0, false);
+            }
+        }
+        run(w);
+    }
+    // Hand the round out wave by wave, and within a wave grouped by op kind,
+    // leaf sign and depth, so each batch the model needs is one contiguous
+    // run across all walks. Blocked walks follow their op.
+    int n = ops.size() / sampler_op_fields;
+    std::vector<int> order(n), pos(n);
+    for (int i = 0; i < n; ++i)
+        order[i] = i;
+    auto key = [this](int i) {
+        const int* rec = ops.data() + i * sampler_op_fields;
+        return std::make_tuple(rec[1], rec[0], rec[0] == P_SIGN ? rec[6] : 0, rec[5]);
+    };
+    std::stable_sort(order.begin(), order.end(), [&key](int a, int b) {
+        return key(a) < key(b);
+    });
+    std::vector<int> sorted(ops.size());
+    for (int i = 0; i < n; ++i)
+    {
+        pos[order[i]] = i;
+        std::copy(ops.begin() + order[i] * sampler_op_fields,
+                  ops.begin() + (order[i] + 1) * sampler_op_fields,
+                  sorted.begin() + i * sampler_op_fields);
+    }
+    ops.swap(sorted);
+    for (auto* w : walks)
+        if (w && w->wait_op >= 0)
+            w->wait_op = pos[w->wait_op];
+    return n;
+}
+
+void TreeSampler::set_probs(float* probs)
+{
+    for (auto* w : walks)
+        if (w && w->wait_op >= 0)
+            w->prob = probs[w->wait_op];
+}
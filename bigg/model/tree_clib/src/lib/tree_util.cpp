@@ -2,30 +2,18 @@
 #include <algorithm>
 #include <cassert>
 
+#include "batch_memo.h"  // NOLINT
 #include "config.h"  // NOLINT
 #include "tree_util.h"  // NOLINT
 #include "struct_util.h"  // NOLINT
 
 
-AdjNode::AdjNode(AdjNode* parent, int row, int col_begin, int col_end,
-                 int depth)
+void AdjNode::init(int idx, int parent, int row, int col_begin, int col_end,
+                   int depth, NodeArena& arena)
 {
-    this->init(parent, row, col_begin, col_end, depth);
-}
-
-AdjNode::~AdjNode()
-{
-    if (this->lch != nullptr)
-        delete this->lch;
-    if (this->rch != nullptr)
-        delete this->rch;
-}
-
-void AdjNode::init(AdjNode* parent, int row, int col_begin, int col_end,
-                   int depth)
-{
-    this->lch = nullptr;
-    this->rch = nullptr;
+    this->idx = idx;
+    this->lch = -1;
+    this->rch = -1;
     this->parent = parent;
     this->row = row;
     this->col_begin = col_begin;
@@ -33,21 +21,21 @@ void AdjNode::init(AdjNode* parent, int row, int col_begin, int col_end,
     this->depth = depth;
     this->mid = (col_begin + col_end) / 2;
     this->n_cols = col_end - col_begin;
-    this->is_lowlevel = this->n_cols <= cfg::bits_compress;
+    this->is_lowlevel = this->n_cols <= arena.cfg->bits_compress;
     this->is_leaf = (this->n_cols <= 1);
-    this->is_root = (this->parent == nullptr);
-    if (is_lowlevel) {
-         this->bits_rep_pos = BitSet(cfg::bits_compress);
-         this->bits_rep_neg = BitSet(cfg::bits_compress);
+    this->is_root = (this->parent < 0);
+    if (is_lowlevel && bits_rep_pos) {
+         arena.bits.reset(this->bits_rep_pos);
+         arena.bits.reset(this->bits_rep_neg);
     }
     this->has_edge = false;
     this->job_idx = -1;
     this->weight = 0;
 }
 
-void AdjNode::update_bits(int weight = 0)
+void AdjNode::update_bits(NodeArena& arena, int weight)
 {
-    if (!is_lowlevel)
+    if (!is_lowlevel || !bits_rep_pos)
         return;
     if (is_leaf)
     {
@@ -55,76 +43,145 @@ void AdjNode::update_bits(int weight = 0)
         {
             assert(weight != 0);
             if (weight > 0) {
-                bits_rep_pos.set(0);
+                BitSet::set(bits_rep_pos, 0);
             }
             else {
-                bits_rep_neg.set(0);
+                BitSet::set(bits_rep_neg, 0);
             }
         }
 
     } else {
-        bits_rep_pos = lch->bits_rep_pos.left_shift(rch->n_cols);
-        bits_rep_pos = bits_rep_pos.or_op(rch->bits_rep_pos);
-        bits_rep_neg = lch->bits_rep_neg.left_shift(rch->n_cols);
-        bits_rep_neg = bits_rep_neg.or_op(rch->bits_rep_neg);
+        auto* lch = arena.get(this->lch);
+        auto* rch = arena.get(this->rch);
+        arena.bits.shift_or(bits_rep_pos, lch->bits_rep_pos, rch->n_cols, rch->bits_rep_pos);  // NOLINT
+        arena.bits.shift_or(bits_rep_neg, lch->bits_rep_neg, rch->n_cols, rch->bits_rep_neg);  // NOLINT
     }
 }
 
-void AdjNode::split()
+void AdjNode::split(NodeArena& arena)
 {
-    if (this->lch != nullptr && this->rch != nullptr)
+    if (this->lch >= 0 && this->rch >= 0)
         return;
     if (this->is_leaf)
         return;
-    this->lch = node_holder.get_pt(this, row, col_begin, mid, depth + 1);
-    this->rch = node_holder.get_pt(this, row, mid, col_end, depth + 1);
+    this->lch = arena.new_node(idx, row, col_begin, mid, depth + 1)->idx;
+    this->rch = arena.new_node(idx, row, mid, col_end, depth + 1)->idx;
+}
+
+// Words per bit set under cfg.
+static uint32_t bit_words(const TreeConfig& cfg)
+{
+    BitSet bits;
+    bits.init(cfg.bits_compress);
+    return cfg.bits_compress ? bits.n_words : 0;
+}
+
+NodeArena::NodeArena(const TreeConfig& cfg)
+{
+    chunks.clear();
+    bit_chunks.clear();
+    num_nodes = 0;
+    this->cfg = &cfg;
+    n_words = bit_words(cfg);
+    bits.init(cfg.bits_compress);
 }
 
-AdjRow::AdjRow(int row, int col_start, int col_end)
+NodeArena::~NodeArena()
 {
-    init(row, col_start, col_end);
+    release();
+}
+
+void NodeArena::release()
+{
+    for (auto* chunk : chunks)
+        delete[] chunk;
+    for (auto* chunk : bit_chunks)
+        delete[] chunk;
+    chunks.clear();
+    bit_chunks.clear();
+}
+
+void NodeArena::reset()
+{
+    num_nodes = 0;
+    if (n_words != bit_words(*cfg))
+    {
+        release();
+        n_words = bit_words(*cfg);
+    }
+    bits.init(cfg->bits_compress);
+}
+
+AdjNode* NodeArena::new_node(int parent, int row, int col_begin, int col_end,
+                             int depth)
+{
+    if ((num_nodes >> chunk_bits) >= (int)chunks.size())
+    {
+        auto* chunk = new AdjNode[chunk_size];
+        uint32_t* bits = nullptr;
+        uint32_t w = n_words;
+        assert(w == bit_words(*cfg));
+        if (w)
+        {
+            bits = new uint32_t[2 * chunk_size * w];
+            bit_chunks.push_back(bits);
+        }
+        for (int i = 0; i < chunk_size; ++i)
+        {
+            chunk[i].bits_rep_pos = bits ? bits + 2 * i * w : nullptr;
+            chunk[i].bits_rep_neg = bits ? bits + (2 * i + 1) * w : nullptr;
+        }
+        chunks.push_back(chunk);
+    }
+    int idx = num_nodes++;
+    AdjNode* node = get(idx);
+    node->init(idx, parent, row, col_begin, col_end, depth, *this);
+    return node;
 }
 
-AdjRow::~AdjRow()
+AdjRow::AdjRow(int row, int col_start, int col_end, NodeArena& arena)
 {
-    if (this->root != nullptr)
-        delete this->root;
+    init(row, col_start, col_end, arena);
 }
 
-void AdjRow::init(int row, int col_start, int col_end)
+void AdjRow::init(int row, int col_start, int col_end, NodeArena& arena)
 {
     this->row = row;
-    assert(!cfg::directed);
+    assert(!arena.cfg->directed);
     int max_col = row;
-    if (cfg::self_loop)
+    if (arena.cfg->self_loop)
         max_col += 1;
     if (col_start < 0 || col_end < 0)
     {
         col_start = 0;
         col_end = max_col;
     }
-    this->root = node_holder.get_pt(nullptr, row, col_start, col_end, 0);
+    this->root = arena.new_node(-1, row, col_start, col_end, 0);
 }
 
 
-void AdjRow::insert_edges(std::vector<std::pair<int, int> >& edge_list, std::vector<int>& prev_row)
+void AdjRow::insert_edges(std::pair<int, int>* indices, int num_indices,
+                          std::pair<int, int>* prev_indices, int num_prev,
+                          JobCollect& jobs, NodeArena& arena,
+                          std::pair<int, int>* prev_edits, int num_edits)
 {
-    auto* col_sm = new ColAutomata(edge_list, prev_row);
-    this->add_edges(this->root, col_sm);
-    delete col_sm;
+    ColAutomata col_sm(indices, num_indices, prev_indices, num_prev,
+                       prev_edits, num_edits);
+    this->add_edges(this->root, &col_sm, jobs, arena);
 }
 
-void AdjRow::add_edges(AdjNode* node, ColAutomata* col_sm)
+void AdjRow::add_edges(AdjNode* node, ColAutomata* col_sm, JobCollect& jobs,
+                       NodeArena& arena)
 {
     if (node->is_root)
     {
         node->has_edge = col_sm->num_indices > 0;
-        job_collect.has_ch.push_back(node->has_edge);
+        jobs.has_ch.push_back(node->has_edge);
         // Handle the edge case where the root is a leaf.
         int is_root_leaf = node->is_leaf;
         if (!is_root_leaf || node->row == 0) {
-            job_collect.is_root_del_leaf.push_back(false);
-            job_collect.is_root_add_leaf.push_back(false);
+            jobs.is_root_del_leaf.push_back(false);
+            jobs.is_root_add_leaf.push_back(false);
         }
         else { // Not the first row, but root is a leaf node.
             int weight;
@@ -132,17 +189,17 @@ void AdjRow::add_edges(AdjNode* node, ColAutomata* col_sm)
                 weight = col_sm->add_edge(node->col_begin);
             else
                 weight = 0;
-            node->update_bits(weight);
+            node->update_bits(arena, weight);
             node->weight = weight;
             bool had_edge = col_sm->had_edge(node->col_begin);
             if (had_edge) {
-                job_collect.root_del_weights.push_back(weight);
-                job_collect.is_root_del_leaf.push_back(true);
-                job_collect.is_root_add_leaf.push_back(false);
+                jobs.root_del_weights.push_back(weight);
+                jobs.is_root_del_leaf.push_back(true);
+                jobs.is_root_add_leaf.push_back(false);
             } else {
-                job_collect.root_add_weights.push_back(weight);
-                job_collect.is_root_del_leaf.push_back(false);
-                job_collect.is_root_add_leaf.push_back(true);
+                jobs.root_add_weights.push_back(weight);
+                jobs.is_root_del_leaf.push_back(false);
+                jobs.is_root_add_leaf.push_back(true);
             }
 
         }
@@ -151,98 +208,100 @@ void AdjRow::add_edges(AdjNode* node, ColAutomata* col_sm)
     }
     if (!node->has_edge) // Remove empty nodes.
         return;
-    job_collect.append_bool(job_collect.is_internal, node->depth,
+    jobs.append_bool(jobs.is_internal, node->depth,
                             !(node->is_leaf));
     if (node->is_leaf) {
         if (!node->is_root) {
             int weight = col_sm->add_edge(node->col_begin);
             assert(weight != 0);
-            node->update_bits(weight);
+            node->update_bits(arena, weight);
             node->weight = weight;
 //        if (node->is_root) { // Still want to make sign predictions for roots that happen to be leaves.
 //           assert(node->has_edge);
-//           job_collect.root_weights.push_back(weight);
+//           jobs.root_weights.push_back(weight);
 //        }
         }
     } else {
-        node->split();
+        node->split(arena);
+        auto* lch = arena.get(node->lch);
+        auto* rch = arena.get(node->rch);
         // Is there a child somewhere to the left.
         bool has_left = (col_sm->next_edge() < node->mid);
         if (has_left)
-            this->add_edges(node->lch, col_sm);
-        job_collect.append_bool(job_collect.has_left, node->depth, has_left);
-        job_collect.append_bool(job_collect.num_left, node->depth,
-                                node->lch->n_cols);
+            this->add_edges(lch, col_sm, jobs, arena);
+        jobs.append_bool(jobs.has_left, node->depth, has_left);
+        jobs.append_bool(jobs.num_left, node->depth,
+                                lch->n_cols);
         // lch and rch are always made. So we can run this regardless.
         // Is the lch a leaf. If it's not but no edges were added to it, add_edges is never called on it
         // so the tree doesn't descend that far anyway. So these are only leaves reached via ML training.
-        int left_leaf_weight = node->lch->weight; // Can be -1, 0, 1
-        bool has_left_leaf = node->lch->is_leaf;
+        int left_leaf_weight = lch->weight; // Can be -1, 0, 1
+        bool has_left_leaf = lch->is_leaf;
         if(!has_left_leaf) {
-            job_collect.append_bool(job_collect.has_left_add_leaf, node->depth, false);
-            job_collect.append_bool(job_collect.has_left_del_leaf, node->depth, false);
+            jobs.append_bool(jobs.has_left_add_leaf, node->depth, false);
+            jobs.append_bool(jobs.has_left_del_leaf, node->depth, false);
         }
         if (has_left_leaf) {
-            if (col_sm->had_edge(node->lch->col_begin)) { // Had an edge, can only be -1 or 0
+            if (col_sm->had_edge(lch->col_begin)) { // Had an edge, can only be -1 or 0
                 assert(left_leaf_weight <= 0);
-                job_collect.append_bool(job_collect.left_del_weights, node->depth, left_leaf_weight);
-                job_collect.append_bool(job_collect.has_left_add_leaf, node->depth, false);
-                job_collect.append_bool(job_collect.has_left_del_leaf, node->depth, true);
+                jobs.append_bool(jobs.left_del_weights, node->depth, left_leaf_weight);
+                jobs.append_bool(jobs.has_left_add_leaf, node->depth, false);
+                jobs.append_bool(jobs.has_left_del_leaf, node->depth, true);
             }
             else { // Didn't have an edge, so can only be 1 or 0
                 assert(left_leaf_weight >= 0);
-                job_collect.append_bool(job_collect.left_add_weights, node->depth, left_leaf_weight);
-                job_collect.append_bool(job_collect.has_left_add_leaf, node->depth, true);
-                job_collect.append_bool(job_collect.has_left_del_leaf, node->depth, false);
+                jobs.append_bool(jobs.left_add_weights, node->depth, left_leaf_weight);
+                jobs.append_bool(jobs.has_left_add_leaf, node->depth, true);
+                jobs.append_bool(jobs.has_left_del_leaf, node->depth, false);
             }
         }
 
         bool has_right = has_left ?
             col_sm->has_edge(node->mid, node->col_end) : true; // Know it has edge, not in left => in right.
         if (has_right)
-            this->add_edges(node->rch, col_sm);
-        job_collect.append_bool(job_collect.has_right, node->depth, has_right);
-        job_collect.append_bool(job_collect.num_right, node->depth,
-                                node->rch->n_cols);
-        int right_leaf_weight = node->rch->weight;
-        bool has_right_leaf = node->rch->is_leaf;
+            this->add_edges(rch, col_sm, jobs, arena);
+        jobs.append_bool(jobs.has_right, node->depth, has_right);
+        jobs.append_bool(jobs.num_right, node->depth,
+                                rch->n_cols);
+        int right_leaf_weight = rch->weight;
+        bool has_right_leaf = rch->is_leaf;
         // We don't need to do any prediction if it doesn't have left (as it has an edge).
         if(!has_right_leaf || (has_right_leaf && !has_left)) {
-            job_collect.append_bool(job_collect.has_right_add_leaf, node->depth, false);
-            job_collect.append_bool(job_collect.has_right_del_leaf, node->depth, false);
+            jobs.append_bool(jobs.has_right_add_leaf, node->depth, false);
+            jobs.append_bool(jobs.has_right_del_leaf, node->depth, false);
         }
-//        job_collect.append_bool(job_collect.has_right_leaf, node->depth, has_right_leaf);
+//        jobs.append_bool(jobs.has_right_leaf, node->depth, has_right_leaf);
         else {
             assert(has_right_leaf && has_left);
-            if (col_sm->had_edge(node->rch->col_begin)) { // Can only be deletion.
+            if (col_sm->had_edge(rch->col_begin)) { // Can only be deletion.
                 assert(right_leaf_weight <= 0);
-                job_collect.append_bool(job_collect.right_del_weights, node->depth, right_leaf_weight);
-                job_collect.append_bool(job_collect.has_right_add_leaf, node->depth, false);
-                job_collect.append_bool(job_collect.has_right_del_leaf, node->depth, true);
+                jobs.append_bool(jobs.right_del_weights, node->depth, right_leaf_weight);
+                jobs.append_bool(jobs.has_right_add_leaf, node->depth, false);
+                jobs.append_bool(jobs.has_right_del_leaf, node->depth, true);
             }
             else { // Can only be addition.
                 assert(right_leaf_weight >= 0);
-                job_collect.append_bool(job_collect.right_add_weights, node->depth, right_leaf_weight);
-                job_collect.append_bool(job_collect.has_right_add_leaf, node->depth, true);
-                job_collect.append_bool(job_collect.has_right_del_leaf, node->depth, false);
+                jobs.append_bool(jobs.right_add_weights, node->depth, right_leaf_weight);
+                jobs.append_bool(jobs.has_right_add_leaf, node->depth, true);
+                jobs.append_bool(jobs.has_right_del_leaf, node->depth, false);
             }
         }
-        node->update_bits();
-        node->job_idx = job_collect.add_job(node);
+        node->update_bits(arena);
+        node->job_idx = jobs.add_job(node, lch, rch);
 
-        int cur_idx = (int)job_collect.has_left[node->depth].size() - 1;
-        auto* ch = node->lch;
+        int cur_idx = (int)jobs.has_left[node->depth].size() - 1;
+        auto* ch = lch;
         if (ch->has_edge && !ch->is_leaf && !ch->is_lowlevel)
         {
-            int pos = job_collect.job_position[ch->job_idx];
-            job_collect.append_bool(job_collect.next_left_froms, node->depth,
+            int pos = jobs.job_position[ch->job_idx];
+            jobs.append_bool(jobs.next_left_froms, node->depth,
                                     pos);
-            job_collect.append_bool(job_collect.next_left_tos, node->depth,
+            jobs.append_bool(jobs.next_left_tos, node->depth,
                                     cur_idx);
         } else {
             int bid = -1;
             if (ch->has_edge && !ch->is_leaf) {
-                bid = 2 + job_collect.job_position[ch->job_idx];
+                bid = 2 + jobs.job_position[ch->job_idx];
                 std::cout << "2+ triggered in add edges" << std::endl;
             }
 
@@ -255,14 +314,61 @@ void AdjRow::add_edges(AdjNode* node, ColAutomata* col_sm)
                 bid = 0;
             }
             assert(bid != -1);
-            job_collect.append_bool(job_collect.bot_left_froms, node->depth,
+            jobs.append_bool(jobs.bot_left_froms, node->depth,
                                     bid);
-            job_collect.append_bool(job_collect.bot_left_tos, node->depth,
+            jobs.append_bool(jobs.bot_left_tos, node->depth,
                                     cur_idx);
         }
     }
 }
 
 
-PtHolder<AdjNode> node_holder;
-PtHolder<AdjRow> row_holder;
+TreeShard::TreeShard(const TreeConfig& cfg) : node_arena(cfg)
+{
+}
+
+void TreeShard::reset()
+{
+    job_collect.reset();
+    node_arena.reset();
+    row_holder.reset();
+}
+
+TreeLibContext::TreeLibContext() : node_arena(cfg)
+{
+    owns_graphs = true;
+    num_active_shards = 0;
+    indices_cached = false;
+    batch_memo = nullptr;
+}
+
+TreeLibContext::~TreeLibContext()
+{
+    clear_active_graphs();
+    if (owns_graphs)
+        for (auto* g : graph_list)
+            delete g;
+    for (auto* shard : shard_list)
+    {
+        shard->row_holder.clear();
+        delete shard;
+    }
+    row_holder.clear();
+    delete batch_memo;
+}
+
+void TreeLibContext::clear_active_graphs()
+{
+    // permute() may hand back the registered graph itself, which belongs to
+    // graph_list (of the source context, for a pipeline slot).
+    for (auto* g : active_graphs)
+        if (g != graph_list[g->graph_id])
+            delete g;
+    active_graphs.clear();
+}
+
+TreeLibContext* default_context()
+{
+    static TreeLibContext* ctx = new TreeLibContext();
+    return ctx;
+}
@@ -0,0 +1,75 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A context with SetBatchMemo must export what a context without it builds
+// for the same requests, replayed over several epochs: with room for every
+// batch, with a cap that evicts, and with a cap that spills to a file.
+
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "test_util.h"  // NOLINT
+
+int main(int argc, char** argv)
+{
+    std::mt19937 rng(1);
+    std::vector<TestGraph> graphs;
+    std::vector<int> sizes;
+    for (int g = 0; g < 8; ++g)
+    {
+        sizes.push_back(20 + rng() % 150);
+        graphs.push_back(random_graph(sizes.back(), rng));
+    }
+    auto batches = random_batches(10, sizes, rng);
+    std::vector<int> order;
+    for (int epoch = 0; epoch < 3; ++epoch)
+        for (int b = 0; b < (int)batches.size(); ++b)
+            order.push_back((b * 3 + epoch) % batches.size());
+
+    std::string spill_path = std::string(argv[0]) + ".spill";
+    struct MemoConfig { int64_t max_bytes; const char* spill_path; };
+    const MemoConfig configs[] = {{int64_t(1) << 30, nullptr},
+                                  {20000, nullptr},
+                                  {20000, spill_path.c_str()}};
+    for (int bits : {0, 8})
+    {
+        TreeLibContext* ctx = test_context(bits);
+        for (int g = 0; g < (int)graphs.size(); ++g)
+            add_test_graph(ctx, g, graphs[g]);
+        std::vector<BatchDump> expected;
+        for (auto& b : batches)
+        {
+            prepare(ctx, b);
+            expected.push_back(dump_batch(ctx));
+        }
+        for (auto& config : configs)
+        {
+            TreeLibContext* memo_ctx = test_context(bits);
+            for (int g = 0; g < (int)graphs.size(); ++g)
+                add_test_graph(memo_ctx, g, graphs[g]);
+            SetBatchMemoCtx(memo_ctx, config.max_bytes, config.spill_path);
+            for (int b : order)
+            {
+                prepare(memo_ctx, batches[b]);
+                CHECK(dump_batch(memo_ctx) == expected[b]);
+            }
+            FreeCtx(memo_ctx);
+        }
+        FreeCtx(ctx);
+    }
+    std::remove(spill_path.c_str());
+    return test_result("batch_memo_test");
+}
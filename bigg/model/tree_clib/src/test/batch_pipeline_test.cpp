@@ -0,0 +1,71 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Batches handed over by a BatchPipeline must export what PrepareTrain
+// builds for the same requests, in the order they were enqueued; slot
+// contexts borrow the graphs of their source, also under -bfs_permute.
+
+#include <random>
+#include <vector>
+
+#include "test_util.h"  // NOLINT
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::vector<TestGraph> graphs;
+    std::vector<int> sizes;
+    for (int g = 0; g < 8; ++g)
+    {
+        sizes.push_back(20 + rng() % 150);
+        graphs.push_back(random_graph(sizes.back(), rng));
+    }
+    auto batches = random_batches(12, sizes, rng);
+    for (int bits : {0, 8})
+        for (const char* permute : {"0", "1"})
+        {
+            TreeLibContext* ctx = test_context(bits, "-bfs_permute", permute);
+            for (int g = 0; g < (int)graphs.size(); ++g)
+                add_test_graph(ctx, g, graphs[g]);
+            std::vector<BatchDump> expected;
+            for (auto& b : batches)
+            {
+                prepare(ctx, b);
+                expected.push_back(dump_batch(ctx));
+            }
+            for (int num_slots : {2, 3})
+            {
+                auto* pipe = PipelineCreate(ctx, num_slots);
+                // Keep up to num_slots batches in flight.
+                size_t queued = 0;
+                for (size_t i = 0; i < batches.size(); ++i)
+                {
+                    for (; queued < batches.size() && queued < i + num_slots; ++queued)
+                    {
+                        auto& b = batches[queued];
+                        PipelineEnqueue(pipe, b.ids.size(), b.ids.data(),
+                                        b.starts.data(), b.col_starts.data(),
+                                        b.col_ends.data(), b.num_nodes);
+                    }
+                    CHECK(dump_batch(PipelineAcquire(pipe)) == expected[i]);
+                }
+                PipelineFree(pipe);
+            }
+            // The source graphs outlive the slots and still build the same.
+            prepare(ctx, batches[0]);
+            CHECK(dump_batch(ctx) == expected[0]);
+            FreeCtx(ctx);
+        }
+    return test_result("batch_pipeline_test");
+}
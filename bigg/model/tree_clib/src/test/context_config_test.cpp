@@ -0,0 +1,71 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Each context keeps the flags it was created with: contexts with
+// different -bits_compress and -self_loop used side by side must build what
+// each builds on its own.
+
+#include <random>
+#include <vector>
+
+#include "test_util.h"  // NOLINT
+
+static std::vector<BatchDump> run(TreeLibContext* ctx,
+                                  std::vector<TestBatch>& batches)
+{
+    std::vector<BatchDump> dumps;
+    for (auto& b : batches)
+    {
+        prepare(ctx, b);
+        dumps.push_back(dump_batch(ctx));
+    }
+    return dumps;
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::vector<TestGraph> graphs;
+    std::vector<int> sizes;
+    for (int g = 0; g < 4; ++g)
+    {
+        sizes.push_back(50 + rng() % 200);
+        graphs.push_back(random_graph(sizes.back(), rng));
+    }
+    auto batches = random_batches(8, sizes, rng);
+    auto make = [&](int bits, const char* self_loop) {
+        TreeLibContext* ctx = test_context(bits, "-self_loop", self_loop);
+        for (int g = 0; g < (int)graphs.size(); ++g)
+            add_test_graph(ctx, g, graphs[g]);
+        return ctx;
+    };
+
+    TreeLibContext* alone = make(8, "0");
+    auto expected_a = run(alone, batches);
+    FreeCtx(alone);
+    alone = make(200, "1");
+    auto expected_b = run(alone, batches);
+    FreeCtx(alone);
+
+    TreeLibContext* a = make(8, "0");
+    TreeLibContext* b = make(200, "1");
+    CHECK(BinaryFeatWidthCtx(a) == 1);
+    CHECK(BinaryFeatWidthCtx(b) == 7);
+    CHECK(run(a, batches) == expected_a);
+    CHECK(run(b, batches) == expected_b);
+    CHECK(run(a, batches) == expected_a);
+    FreeCtx(a);
+    FreeCtx(b);
+    return test_result("context_config_test");
+}
@@ -0,0 +1,128 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// CounterRng against the Philox4x32-10 known-answer vectors of the Random123
+// distribution, and TreeSampler walks keyed by (graph_id, row): the edges
+// sampled for a row must not depend on the order rows are added in or on
+// the number of walks in flight.
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "counter_rng.h"  // NOLINT
+#include "test_util.h"  // NOLINT
+
+static void check_philox(std::vector<uint32_t> ctr, std::vector<uint32_t> key,
+                         std::vector<uint32_t> expected)
+{
+    std::vector<uint32_t> out(4);
+    CounterRng::philox(ctr.data(), key.data(), out.data());
+    CHECK(out == expected);
+}
+
+typedef std::pair<std::vector<int>, std::vector<int> > RowEdges;
+
+// Samples every (graph_id, row) of rows, in that order, keeping up to
+// num_walks walks in flight; every P_* op gets probability 1/2.
+static std::map<std::pair<int, int>, RowEdges> sample(
+    TreeLibContext* ctx, int seed, const std::vector<std::pair<int, int> >& rows,
+    int num_walks)
+{
+    TreeSampler* sampler = SamplerCreateCtx(ctx, seed, 0);
+    std::map<std::pair<int, int>, RowEdges> result;
+    std::vector<std::pair<int, std::pair<int, int> > > in_flight;
+    size_t next = 0;
+    while (next < rows.size() || in_flight.size())
+    {
+        for (; next < rows.size() && (int)in_flight.size() < num_walks; ++next)
+        {
+            int g = rows[next].first, row = rows[next].second;
+            std::vector<int> prev;
+            for (int c = g % 3; c < row; c += 4)
+                prev.push_back(c);
+            int walk = SamplerAddRow(sampler, g, row, -1, -1, 0, row,
+                                     prev.size(), prev.data());
+            in_flight.push_back(std::make_pair(walk, rows[next]));
+        }
+        int n = SamplerStep(sampler);
+        if (n)
+        {
+            std::vector<float> probs(n, 0.5);
+            SamplerSetProbs(sampler, probs.data());
+        }
+        std::vector<std::pair<int, std::pair<int, int> > > still;
+        for (auto& w : in_flight)
+        {
+            int info[4];
+            SamplerGetWalk(sampler, w.first, info);
+            if (!info[1])
+            {
+                still.push_back(w);
+                continue;
+            }
+            RowEdges& edges = result[w.second];
+            edges.first.resize(info[3]);
+            edges.second.resize(info[3]);
+            SamplerGetEdges(sampler, w.first, edges.first.data(),
+                            edges.second.data());
+            SamplerRelease(sampler, w.first);
+        }
+        in_flight.swap(still);
+    }
+    SamplerFree(sampler);
+    return result;
+}
+
+int main()
+{
+    check_philox({0, 0, 0, 0}, {0, 0},
+                 {0x6627e8d5, 0xe169c58d, 0xbc57ac4c, 0x9b00dbd8});
+    check_philox({0xffffffff, 0xffffffff, 0xffffffff, 0xffffffff},
+                 {0xffffffff, 0xffffffff},
+                 {0x408f276d, 0x41c83b0e, 0xa20bc7c6, 0x6d5451fd});
+    check_philox({0x243f6a88, 0x85a308d3, 0x13198a2e, 0x03707344},
+                 {0xa4093822, 0x299f31d0},
+                 {0xd16cfe09, 0x94fdcceb, 0x5001e420, 0x24126ea1});
+
+    // A stream hands out the blocks of its counter in order.
+    CounterRng rng(0, 0, 0);
+    std::vector<uint32_t> first(4);
+    for (auto& x : first)
+        x = rng();
+    CHECK(first == std::vector<uint32_t>({0x6627e8d5, 0xe169c58d, 0xbc57ac4c,
+                                          0x9b00dbd8}));
+
+    TreeLibContext* ctx = test_context(0);
+    std::vector<std::pair<int, int> > rows;
+    for (int g = 0; g < 4; ++g)
+        for (int row = 1; row < 40; ++row)
+            rows.push_back(std::make_pair(g, row));
+    auto expected = sample(ctx, 7, rows, 1);
+    CHECK(expected.size() == rows.size());
+
+    std::mt19937 shuffle_rng(1);
+    for (int num_walks : {1, 5, 64})
+    {
+        std::shuffle(rows.begin(), rows.end(), shuffle_rng);
+        CHECK(sample(ctx, 7, rows, num_walks) == expected);
+    }
+    // Keyed by the seed too.
+    CHECK(sample(ctx, 8, rows, 64) != expected);
+    FreeCtx(ctx);
+    return test_result("counter_rng_test");
+}
@@ -0,0 +1,131 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// A time series registered as an AddGraphDelta chain must build the same
+// batches as every pair added in full with AddGraph, and a long chain must
+// only keep the blocks its rows still point to.
+
+#include <map>
+#include <random>
+#include <set>
+#include <vector>
+
+#include "test_util.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+typedef std::set<std::pair<int, int> > Snapshot;
+
+int main()
+{
+    std::mt19937 rng(3);
+    const int n = 120, num_steps = 60;
+    // A few hub rows change at every step, so their edits get compacted.
+    std::vector<Snapshot> series(1);
+    for (int t = 0; t < num_steps; ++t)
+    {
+        Snapshot next = series.back();
+        for (int k = 0; k < 40; ++k)
+        {
+            int x = 1 + rng() % (n - 1);
+            if (k < 10)
+                x = n - 1 - k % 3;
+            auto e = std::make_pair(x, (int)(rng() % x));
+            if (next.count(e))
+                next.erase(e);
+            else
+                next.insert(e);
+        }
+        series.push_back(next);
+    }
+
+    for (int bits : {0, 8})
+    {
+        TreeLibContext* full = test_context(bits);
+        TreeLibContext* chain = test_context(bits);
+        for (int t = 0; t < num_steps; ++t)
+        {
+            TestGraph g;
+            g.num_nodes = n;
+            g.prev_row_ptr.assign(n + 1, 0);
+            for (auto& e : series[t])
+                g.prev_row_ptr[e.first + 1]++;
+            for (int i = 0; i < n; ++i)
+                g.prev_row_ptr[i + 1] += g.prev_row_ptr[i];
+            for (auto& e : series[t])
+            {
+                g.prev_cols.push_back(e.second);
+                g.prev_signs.push_back(1);
+            }
+            std::vector<int> added, removed;
+            for (auto& e : series[t + 1])
+                if (!series[t].count(e))
+                {
+                    added.push_back(e.first);
+                    added.push_back(e.second);
+                }
+            for (auto& e : series[t])
+                if (!series[t + 1].count(e))
+                {
+                    removed.push_back(e.first);
+                    removed.push_back(e.second);
+                }
+            for (size_t k = 0; k < added.size(); k += 2)
+            {
+                g.edge_pairs.push_back(added[k]);
+                g.edge_pairs.push_back(added[k + 1]);
+                g.edge_signs.push_back(1);
+            }
+            for (size_t k = 0; k < removed.size(); k += 2)
+            {
+                g.edge_pairs.push_back(removed[k]);
+                g.edge_pairs.push_back(removed[k + 1]);
+                g.edge_signs.push_back(-1);
+            }
+            add_test_graph(full, t, g);
+            if (t == 0)
+                add_test_graph(chain, t, g);
+            else
+                AddGraphDeltaCtx(chain, t, t - 1, added.size() / 2,
+                                 added.data(), removed.size() / 2,
+                                 removed.data());
+        }
+        for (int t = 0; t < num_steps; ++t)
+        {
+            TestBatch b;
+            b.ids = {t};
+            b.starts = {0};
+            b.col_starts = {-1};
+            b.col_ends = {-1};
+            b.num_nodes = -1;
+            prepare(full, b);
+            BatchDump expected = dump_batch(full);
+            prepare(chain, b);
+            CHECK(dump_batch(chain) == expected);
+        }
+        // Rows outlive at most a few of the blocks before them.
+        size_t max_blocks = 0;
+        for (auto* g : chain->graph_list)
+        {
+            std::set<const void*> blocks;
+            for (auto& page : g->prev_pages)
+                for (auto& block : page->blocks)
+                    blocks.insert(block.get());
+            max_blocks = std::max(max_blocks, blocks.size());
+        }
+        CHECK(max_blocks < num_steps / 2);
+        FreeCtx(full);
+        FreeCtx(chain);
+    }
+    return test_result("graph_delta_test");
+}
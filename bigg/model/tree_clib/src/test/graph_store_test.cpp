@@ -0,0 +1,203 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Graphs added from a graph store must build what AddGraph builds from the
+// same arrays, including pairs that share a snapshot and after the store
+// itself is freed. Missing, truncated or inconsistent files are rejected.
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "graph_store.h"  // NOLINT
+#include "test_util.h"  // NOLINT
+
+// The layout GraphStoreWriter in tree_lib.py writes.
+struct StoreWriter
+{
+    std::vector<const TestGraph*> snapshots;
+    std::vector<std::pair<int, const TestGraph*> > pairs;
+
+    std::vector<char> payload;
+    int64_t offset;
+
+    int64_t place(const std::vector<int32_t>& arr)
+    {
+        int64_t start = offset;
+        payload.resize(start + arr.size() * sizeof(int32_t));
+        if (arr.size())
+            memcpy(payload.data() + start, arr.data(), arr.size() * sizeof(int32_t));
+        offset = (payload.size() + 7) / 8 * 8;
+        payload.resize(offset);
+        return start;
+    }
+
+    void write(const char* path)
+    {
+        offset = sizeof(GraphStoreHeader) + sizeof(GraphStoreSnapshot) * snapshots.size() +
+                 sizeof(GraphStorePair) * pairs.size();
+        payload.assign(offset, 0);
+        std::vector<GraphStoreSnapshot> snaps(snapshots.size());
+        for (size_t i = 0; i < snapshots.size(); ++i)
+        {
+            auto* g = snapshots[i];
+            std::vector<int32_t> rows;
+            for (size_t k = 0; k < g->prev_cols.size(); ++k)
+            {
+                rows.push_back(g->prev_cols[k]);
+                rows.push_back(g->prev_signs[k]);
+            }
+            snaps[i].num_nodes = g->num_nodes;
+            snaps[i].reserved = 0;
+            snaps[i].row_ptr_offset = place(g->prev_row_ptr);
+            snaps[i].rows_offset = place(rows);
+        }
+        std::vector<GraphStorePair> store_pairs(pairs.size());
+        for (size_t i = 0; i < pairs.size(); ++i)
+        {
+            auto* g = pairs[i].second;
+            std::vector<int32_t> edges;
+            for (size_t k = 0; k < g->edge_signs.size(); ++k)
+            {
+                edges.push_back(g->edge_pairs[2 * k]);
+                edges.push_back(g->edge_pairs[2 * k + 1]);
+                edges.push_back(g->edge_signs[k]);
+            }
+            store_pairs[i].snapshot = pairs[i].first;
+            store_pairs[i].num_edges = g->edge_signs.size();
+            store_pairs[i].n_left = -1;
+            store_pairs[i].n_right = -1;
+            store_pairs[i].edges_offset = place(edges);
+        }
+        GraphStoreHeader header;
+        memcpy(header.magic, "BIGGSER1", 8);
+        header.version = 1;
+        header.num_snapshots = snapshots.size();
+        header.num_pairs = pairs.size();
+        header.reserved = 0;
+        char* p = payload.data();
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        memcpy(p, snaps.data(), sizeof(GraphStoreSnapshot) * snaps.size());
+        p += sizeof(GraphStoreSnapshot) * snaps.size();
+        memcpy(p, store_pairs.data(), sizeof(GraphStorePair) * store_pairs.size());
+        FILE* f = fopen(path, "wb");
+        fwrite(payload.data(), 1, payload.size(), f);
+        fclose(f);
+    }
+};
+
+int main(int argc, char** argv)
+{
+    std::mt19937 rng(1);
+    std::vector<TestGraph> graphs;
+    std::vector<int> sizes;
+    for (int s = 0; s < 4; ++s)
+    {
+        int n = 20 + rng() % 150;
+        graphs.push_back(random_graph(n, rng));
+        // A second target on the same snapshot: every other edge.
+        TestGraph half = graphs.back();
+        half.edge_pairs.clear();
+        half.edge_signs.clear();
+        auto& full = graphs.back();
+        for (size_t k = 0; k < full.edge_signs.size(); k += 2)
+        {
+            half.edge_pairs.push_back(full.edge_pairs[2 * k]);
+            half.edge_pairs.push_back(full.edge_pairs[2 * k + 1]);
+            half.edge_signs.push_back(full.edge_signs[k]);
+        }
+        graphs.push_back(half);
+        sizes.push_back(n);
+        sizes.push_back(n);
+    }
+    StoreWriter writer;
+    for (size_t g = 0; g < graphs.size(); ++g)
+    {
+        if (g % 2 == 0)
+            writer.snapshots.push_back(&graphs[g]);
+        writer.pairs.push_back(std::make_pair((int)g / 2, &graphs[g]));
+    }
+    std::string path = std::string(argv[0]) + ".store";
+    writer.write(path.c_str());
+
+    // Each corruption of the file must make StoreOpen fail.
+    CHECK(StoreOpen((path + ".missing").c_str()) == nullptr);
+    const std::vector<char>& bytes = writer.payload;
+    auto header = [](std::vector<char>& b) {
+        return reinterpret_cast<GraphStoreHeader*>(b.data());
+    };
+    auto snapshot = [&](std::vector<char>& b) {
+        return reinterpret_cast<GraphStoreSnapshot*>(header(b) + 1);
+    };
+    auto pair = [&](std::vector<char>& b) {
+        return reinterpret_cast<GraphStorePair*>(snapshot(b) + header(b)->num_snapshots);
+    };
+    std::vector<std::function<void(std::vector<char>&)> > corruptions = {
+        [&](std::vector<char>& b) { header(b)->magic[0] = 'X'; },
+        [&](std::vector<char>& b) { b.resize(sizeof(GraphStoreHeader) - 1); },
+        [&](std::vector<char>& b) { b.resize(pair(b)->edges_offset); },
+        [&](std::vector<char>& b) { header(b)->num_pairs += 1000; },
+        [&](std::vector<char>& b) { snapshot(b)->rows_offset = INT64_MAX - 7; },
+        [&](std::vector<char>& b) { pair(b)->snapshot = header(b)->num_snapshots; },
+        [&](std::vector<char>& b) {
+            reinterpret_cast<int32_t*>(b.data() + pair(b)->edges_offset)[0] = graphs[0].num_nodes;
+        },
+    };
+    std::string bad_path = path + ".bad";
+    for (auto& corrupt : corruptions)
+    {
+        std::vector<char> bad = bytes;
+        corrupt(bad);
+        FILE* f = fopen(bad_path.c_str(), "wb");
+        fwrite(bad.data(), 1, bad.size(), f);
+        fclose(f);
+        CHECK(StoreOpen(bad_path.c_str()) == nullptr);
+    }
+    std::remove(bad_path.c_str());
+
+    auto batches = random_batches(12, sizes, rng);
+    for (int bits : {0, 8})
+    {
+        TreeLibContext* ctx = test_context(bits);
+        TreeLibContext* store_ctx = test_context(bits);
+        GraphStore* store = StoreOpen(path.c_str());
+        CHECK(StoreNumPairs(store) == (int)graphs.size());
+        std::vector<int> info(2 * graphs.size());
+        StoreGetPairs(store, info.data());
+        for (int g = 0; g < (int)graphs.size(); ++g)
+        {
+            CHECK(info[2 * g] == graphs[g].num_nodes);
+            CHECK(info[2 * g + 1] == (int)graphs[g].edge_signs.size());
+            add_test_graph(ctx, g, graphs[g]);
+            AddGraphFromStoreCtx(store_ctx, g, store, g);
+        }
+        // The graphs keep the mapping alive.
+        StoreFree(store);
+        for (auto& b : batches)
+        {
+            prepare(ctx, b);
+            prepare(store_ctx, b);
+            CHECK(dump_batch(store_ctx) == dump_batch(ctx));
+        }
+        FreeCtx(store_ctx);
+        FreeCtx(ctx);
+    }
+    std::remove(path.c_str());
+    return test_result("graph_store_test");
+}
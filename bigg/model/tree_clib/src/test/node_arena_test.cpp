@@ -0,0 +1,57 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// The default context keeps its NodeArena across Init calls; after Init
+// picks another -bits_compress, its batches must match a fresh context's.
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "test_util.h"  // NOLINT
+#include "tree_util.h"  // NOLINT
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::vector<TestGraph> graphs;
+    std::vector<int> sizes;
+    for (int g = 0; g < 4; ++g)
+    {
+        sizes.push_back(100 + rng() % 300);
+        graphs.push_back(random_graph(sizes.back(), rng));
+    }
+    auto batches = random_batches(4, sizes, rng);
+    for (int g = 0; g < (int)graphs.size(); ++g)
+        add_test_graph(default_context(), g, graphs[g]);
+    for (int bits : {8, 256, 0, 40, 256})
+    {
+        TreeLibContext* fresh = test_context(bits);
+        for (int g = 0; g < (int)graphs.size(); ++g)
+            add_test_graph(fresh, g, graphs[g]);
+        std::string b = std::to_string(bits);
+        const char* args[] = {"test", "-bits_compress", b.c_str(),
+                              "-embed_dim", "8", "-gpu", "-1"};
+        Init(7, args);
+        for (auto& batch : batches)
+        {
+            prepare(fresh, batch);
+            BatchDump expected = dump_batch(fresh);
+            prepare(default_context(), batch);
+            CHECK(dump_batch(default_context()) == expected);
+        }
+        FreeCtx(fresh);
+    }
+    return test_result("node_arena_test");
+}
@@ -0,0 +1,73 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// -parallel_build builds one shard per graph and merges them with
+// JobCollect::merge; every batch must export exactly what the serial build
+// does, also when a batch lists a graph more than once. Run with several
+// threads even on a single core, so that such batches would race.
+
+#include <random>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "test_util.h"  // NOLINT
+
+static std::vector<BatchDump> run(int bits_compress, const char* parallel,
+                                  std::vector<TestGraph>& graphs,
+                                  std::vector<TestBatch>& batches)
+{
+    TreeLibContext* ctx = test_context(bits_compress, "-parallel_build",
+                                       parallel);
+    for (int g = 0; g < (int)graphs.size(); ++g)
+        add_test_graph(ctx, g, graphs[g]);
+    std::vector<BatchDump> dumps;
+    for (auto& b : batches)
+    {
+        prepare(ctx, b);
+        dumps.push_back(dump_batch(ctx));
+    }
+    FreeCtx(ctx);
+    return dumps;
+}
+
+int main()
+{
+    std::mt19937 rng(1);
+    std::vector<TestGraph> graphs;
+    std::vector<int> sizes;
+    for (int g = 0; g < 8; ++g)
+    {
+        sizes.push_back(20 + rng() % 150);
+        graphs.push_back(random_graph(sizes.back(), rng));
+    }
+    auto batches = random_batches(16, sizes, rng);
+    // Repeated ids: the same whole graph, and the same graph at two starts.
+    TestBatch twice = {{3, 3}, {0, 0}, {-1, -1}, {-1, -1}, -1};
+    TestBatch windows = {{5, 1, 5}, {0, 4, 7}, {-1, -1, -1}, {-1, -1, -1}, 12};
+    batches.push_back(twice);
+    batches.push_back(windows);
+#ifdef _OPENMP
+    omp_set_num_threads(8);
+#endif
+    for (int bits : {0, 8, 40})
+    {
+        auto serial = run(bits, "0", graphs, batches);
+        auto parallel = run(bits, "1", graphs, batches);
+        for (size_t i = 0; i < batches.size(); ++i)
+            CHECK(serial[i] == parallel[i]);
+    }
+    return test_result("parallel_build_test");
+}
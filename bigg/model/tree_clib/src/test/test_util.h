@@ -0,0 +1,178 @@
+// Copyright 2022 The Google Research Authors.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//     http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tree_clib.h"  // NOLINT
+
+// Shared by the programs under src/test, which make test builds and runs;
+// each exits non-zero if a CHECK failed.
+static int num_failed_checks = 0;
+
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        if (!(cond))                                                      \
+        {                                                                 \
+            fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__,        \
+                    __LINE__, #cond);                                     \
+            num_failed_checks++;                                          \
+        }                                                                 \
+    } while (0)
+
+static inline int test_result(const char* name)
+{
+    printf("%s: %s\n", name, num_failed_checks ? "FAILED" : "OK");
+    return num_failed_checks ? 1 : 0;
+}
+
+static inline TreeLibContext* test_context(int bits_compress,
+                                           const char* extra_flag = nullptr,
+                                           const char* extra_value = nullptr)
+{
+    std::string bits = std::to_string(bits_compress);
+    std::vector<const char*> args = {"test", "-bits_compress", bits.c_str(),
+                                     "-embed_dim", "8", "-gpu", "-1"};
+    if (extra_flag)
+    {
+        args.push_back(extra_flag);
+        args.push_back(extra_value);
+    }
+    return InitCtx(args.size(), args.data());
+}
+
+// A random snapshot pair: a lower-triangle CSR previous snapshot and signed
+// target edges, in the layout AddGraph takes.
+struct TestGraph
+{
+    int num_nodes;
+    std::vector<int> prev_row_ptr, prev_cols, prev_signs;
+    std::vector<int> edge_pairs, edge_signs;
+};
+
+static inline TestGraph random_graph(int num_nodes, std::mt19937& rng)
+{
+    TestGraph g;
+    g.num_nodes = num_nodes;
+    g.prev_row_ptr.push_back(0);
+    for (int i = 0; i < num_nodes; ++i)
+    {
+        // A few hub rows give deep, wide trees.
+        int density = (i % 23 == 7) ? 2 : (i / 4 + 3);
+        for (int c = 0; c < i; ++c)
+        {
+            bool prev = rng() % (i / 3 + 3) == 0;
+            if (prev)
+            {
+                g.prev_cols.push_back(c);
+                g.prev_signs.push_back(1);
+            }
+            if (rng() % density == 0)
+            {
+                g.edge_pairs.push_back(i);
+                g.edge_pairs.push_back(c);
+                g.edge_signs.push_back(prev ? -1 : 1);
+            }
+        }
+        g.prev_row_ptr.push_back(g.prev_cols.size());
+    }
+    return g;
+}
+
+static inline void add_test_graph(TreeLibContext* ctx, int graph_id,
+                                  TestGraph& g)
+{
+    AddGraphCtx(ctx, graph_id, g.num_nodes, g.edge_signs.size(),
+                g.prev_row_ptr.data(), g.prev_cols.data(), g.prev_signs.data(),
+                g.edge_pairs.data(), g.edge_signs.data(), -1, -1);
+}
+
+// What training reads of a prepared batch: the index export and, with
+// bits_compress, the packed binary features of every depth.
+struct BatchDump
+{
+    std::vector<int> layout, offsets, buf;
+    std::vector<std::vector<int> > bins;
+
+    bool operator==(const BatchDump& o) const
+    {
+        return layout == o.layout && offsets == o.offsets && buf == o.buf &&
+               bins == o.bins;
+    }
+};
+
+static inline BatchDump dump_batch(TreeLibContext* ctx)
+{
+    BatchDump d;
+    d.layout.resize(4);
+    GetIndexLayoutCtx(ctx, d.layout.data());
+    d.offsets.resize(d.layout[2] + 1);
+    d.buf.resize(d.layout[3] + 1);
+    ExportIndicesCtx(ctx, d.offsets.data(), d.buf.data());
+    int w = BinaryFeatWidthCtx(ctx);
+    for (int depth = 0; depth < MaxBinFeatDepthCtx(ctx); ++depth)
+    {
+        int n = NumBinNodesCtx(ctx, depth) + 2;
+        std::vector<int> v(n + 2 * n * w);
+        GetBinaryPackedCtx(ctx, depth, v.data(), v.data() + n,
+                           v.data() + n + n * w);
+        d.bins.push_back(v);
+    }
+    return d;
+}
+
+// A minibatch request as PrepareTrain takes it.
+struct TestBatch
+{
+    std::vector<int> ids, starts, col_starts, col_ends;
+    int num_nodes;
+};
+
+// Whole graphs and row windows of num_nodes rows, mixed.
+static inline std::vector<TestBatch> random_batches(
+    int num_batches, const std::vector<int>& sizes, std::mt19937& rng)
+{
+    std::vector<TestBatch> batches;
+    for (int b = 0; b < num_batches; ++b)
+    {
+        TestBatch batch;
+        int k = 1 + rng() % 4;
+        batch.num_nodes = (b % 2) ? 12 : -1;
+        for (int i = 0; i < k; ++i)
+        {
+            int g = rng() % sizes.size();
+            batch.ids.push_back(g);
+            int max_start = std::max(1, sizes[g] - batch.num_nodes);
+            batch.starts.push_back(batch.num_nodes < 0 ? 0 : rng() % max_start);
+            batch.col_starts.push_back(-1);
+            batch.col_ends.push_back(-1);
+        }
+        batches.push_back(batch);
+    }
+    return batches;
+}
+
+static inline void prepare(TreeLibContext* ctx, TestBatch& b)
+{
+    PrepareTrainCtx(ctx, b.ids.size(), b.ids.data(), b.starts.data(),
+                    b.col_starts.data(), b.col_ends.data(), b.num_nodes, 1);
+}
+
+#endif
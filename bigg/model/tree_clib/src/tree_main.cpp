@@ -1,6 +1,7 @@
 #include <signal.h>
 #include <random>
 #include <cassert>
+#include <chrono>
 #include <cstring>
 #include <algorithm>
 #include <cstdlib>
@@ -10,314 +11,343 @@
 #include "config.h"  // NOLINT
 #include "tree_clib.h"  // NOLINT
 #include "tree_util.h"  // NOLINT
+#include "batch_memo.h"  // NOLINT
+#include "batch_pipeline.h"  // NOLINT
+#include "batch_schedule.h"  // NOLINT
+#include "tree_sampler.h"  // NOLINT
+#include "cpu_ops.h"  // NOLINT
+#include "graph_store.h"  // NOLINT
 #include "cuda_ops.h"  // NOLINT
 
 int Init(const int argc, const char **argv)
 {
-    cfg::LoadParams(argc, argv);
+    default_context()->cfg.LoadParams(argc, argv);
     return 0;
 }
 
-int TotalTreeNodes()
+TreeLibContext* InitCtx(const int argc, const char **argv)
+{
+    auto* ctx = new TreeLibContext();
+    ctx->cfg.LoadParams(argc, argv);
+    return ctx;
+}
+
+int FreeCtx(TreeLibContext* ctx)
 {
+    assert(ctx != default_context());
+    delete ctx;
     return 0;
 }
 
-int MaxBinFeatDepth()
+int TotalTreeNodesCtx(TreeLibContext* ctx)
 {
-    return (int)job_collect.n_bin_job_per_level.size();
+    int total = ctx->node_arena.num_nodes;
+    for (int i = 0; i < ctx->num_active_shards; ++i)
+        total += ctx->shard_list[i]->node_arena.num_nodes;
+    return total;
 }
 
-int NumBinNodes(int depth)
+int MaxBinFeatDepthCtx(TreeLibContext* ctx)
 {
-    if (depth >= (int)job_collect.n_bin_job_per_level.size())
+    return (int)ctx->job_collect.n_bin_job_per_level.size();
+}
+
+int NumBinNodesCtx(TreeLibContext* ctx, int depth)
+{
+    if (depth >= (int)ctx->job_collect.n_bin_job_per_level.size())
         return 0;
-    return job_collect.n_bin_job_per_level[depth];
+    return ctx->job_collect.n_bin_job_per_level[depth];
 }
 
-int SetBinaryFeat(int d, void* _pos_feat_ptr, void* _neg_feat_ptr, int dev)
+// Number of uint32 words per packed binary feature row.
+static uint32_t binary_width(TreeLibContext* ctx)
 {
-    int num_jobs = job_collect.n_bin_job_per_level[d];
+    uint32_t n_ints = ctx->cfg.bits_compress / ibits;
+    if (ctx->cfg.bits_compress % ibits)
+        n_ints++;
+    return n_ints;
+}
+
+// Rows 0 and 1 are the two 1-bit "empty" rows (bit 0 off / on); row i + 2
+// holds the bits of binary_feat_nodes[d][i].
+static void pack_binary_feat(TreeLibContext* ctx, int d, int* lens,
+                             uint32_t* bits_pos, uint32_t* bits_neg)
+{
+    int num_jobs = ctx->job_collect.n_bin_job_per_level[d];
+    uint32_t n_ints = binary_width(ctx);
+    if (ctx->memo_entry)
+    {
+        auto& entry = *ctx->memo_entry;
+        std::memcpy(lens, entry.bin_lens[d].data(), sizeof(int) * (num_jobs + 2));
+        std::memcpy(bits_pos, entry.bin_pos[d].data(), sizeof(uint32_t) * (num_jobs + 2) * n_ints);  // NOLINT
+        std::memcpy(bits_neg, entry.bin_neg[d].data(), sizeof(uint32_t) * (num_jobs + 2) * n_ints);  // NOLINT
+        return;
+    }
+    lens[0] = lens[1] = 1;
+    memset(bits_pos, 0, sizeof(uint32_t) * 2 * n_ints);
+    memset(bits_neg, 0, sizeof(uint32_t) * 2 * n_ints);
+    bits_pos[n_ints] = bits_neg[n_ints] = 1;
+    #pragma omp parallel for
+    for (int i = 2; i < num_jobs + 2; ++i)
+    {
+        auto* node = ctx->job_collect.binary_feat_nodes[d][i - 2];
+        lens[i] = node->n_cols;
+        uint32_t* cur_bits_pos = bits_pos + i * n_ints;
+        uint32_t* cur_bits_neg = bits_neg + i * n_ints;
+        assert(n_ints <= ctx->node_arena.n_words);
+        for (uint32_t j = 0; j < n_ints; ++j)
+        {
+            cur_bits_pos[j] = node->bits_rep_pos[j];
+            cur_bits_neg[j] = node->bits_rep_neg[j];
+        }
+    }
+}
+
+int SetBinaryFeatCtx(TreeLibContext* ctx, int d, void* _pos_feat_ptr, void* _neg_feat_ptr, int dev)
+{
+    int num_jobs = ctx->job_collect.n_bin_job_per_level[d];
     float* pos_feat_ptr = static_cast<float*>(_pos_feat_ptr);
     float* neg_feat_ptr = static_cast<float*>(_neg_feat_ptr);
+    uint32_t n_ints = binary_width(ctx);
+    int* lens = new int[num_jobs + 2];
+    uint32_t* bits_pos = new uint32_t[(num_jobs + 2) * n_ints];
+    uint32_t* bits_neg = new uint32_t[(num_jobs + 2) * n_ints];
+    pack_binary_feat(ctx, d, lens, bits_pos, bits_neg);
     if (dev == 0)  // cpu
     {
-//        #pragma omp parallel for
-//        for (int i = 0; i < num_jobs + 2; ++i)
-//        {
-//            float* cur_ptr = feat_ptr + i * cfg::dim_embed;
-//            if (i < 2) {
-//                cur_ptr[0] = i ? 1 : -1;
-//            } else {
-//                auto* node = job_collect.binary_feat_nodes[d][i - 2];
-//                for (int j = 0; j < node->n_cols; ++j)
-//                    cur_ptr[j] = node->bits_rep.get(j) ? 1 : -1;
-//            }
-//        }
+        STAT_ADD(ctx->stats, STAT_BYTES_EXPORTED,
+                 2 * (int64_t)(num_jobs + 2) * ctx->cfg.dim_embed * sizeof(float));
+        build_binary_mat_cpu(num_jobs + 2, n_ints, ctx->cfg.dim_embed, lens, bits_pos, pos_feat_ptr);  // NOLINT
+        build_binary_mat_cpu(num_jobs + 2, n_ints, ctx->cfg.dim_embed, lens, bits_neg, neg_feat_ptr);  // NOLINT
     } else {
-        int* lens = new int[num_jobs + 2];
-        lens[0] = lens[1] = 1;
-        // Number of ints to represent cfg::bits_compress worth of bits.
-        uint32_t n_ints = cfg::bits_compress / ibits;
-        if (cfg::bits_compress % ibits)
-            n_ints++;
-        uint32_t* bits_pos = new uint32_t[(num_jobs + 2) * n_ints];
-        uint32_t* bits_neg = new uint32_t[(num_jobs + 2) * n_ints];
-
-        bits_pos[0] = bits_neg[0] = 0;
-        bits_pos[n_ints] = bits_neg[n_ints] = 1;
-        #pragma omp parallel for
-        for (int i = 2; i < num_jobs + 2; ++i)
-        {
-            auto* node = job_collect.binary_feat_nodes[d][i - 2];
-            lens[i] = node->n_cols;
-            uint32_t* cur_bits_pos = bits_pos + i * n_ints;
-            uint32_t* cur_bits_neg = bits_neg + i * n_ints;
-            assert(node->bits_rep_pos.n_macros <= n_ints);
-            assert(node->bits_rep_neg.n_macros <= n_ints);
-            for (uint32_t j = 0; j < node->bits_rep_pos.n_macros; ++j)
-                cur_bits_pos[j] = node->bits_rep_pos.macro_bits[j];
-            for (uint32_t j = 0; j < node->bits_rep_pos.n_macros; ++j)
-                cur_bits_neg[j] = node->bits_rep_neg.macro_bits[j];
-        }
 #ifdef USE_GPU
-        build_binary_mat(num_jobs + 2, n_ints, cfg::dim_embed, lens, bits_pos, pos_feat_ptr);  // NOLINT
-        build_binary_mat(num_jobs + 2, n_ints, cfg::dim_embed, lens, bits_neg, neg_feat_ptr);
+        build_binary_mat(num_jobs + 2, n_ints, ctx->cfg.dim_embed, lens, bits_pos, pos_feat_ptr);  // NOLINT
+        build_binary_mat(num_jobs + 2, n_ints, ctx->cfg.dim_embed, lens, bits_neg, neg_feat_ptr);
 #endif
-        delete[] bits_pos;
-        delete[] bits_neg;
-        delete[] lens;
     }
+    delete[] bits_pos;
+    delete[] bits_neg;
+    delete[] lens;
     return 0;
 }
 
-int MaxTreeDepth()
+int BinaryFeatWidthCtx(TreeLibContext* ctx)
+{
+    return (int)binary_width(ctx);
+}
+
+int GetBinaryPackedCtx(TreeLibContext* ctx, int d, void* _lens, void* _bits_pos, void* _bits_neg)
+{
+    STAT_SCOPE(ctx->stats, STAT_EXPORT_NS);
+    STAT_ADD(ctx->stats, STAT_BYTES_EXPORTED,
+             (int64_t)(ctx->job_collect.n_bin_job_per_level[d] + 2) *
+             (sizeof(int) + 2 * binary_width(ctx) * sizeof(uint32_t)));
+    pack_binary_feat(ctx, d, static_cast<int*>(_lens),
+                     static_cast<uint32_t*>(_bits_pos),
+                     static_cast<uint32_t*>(_bits_neg));
+    return 0;
+}
+
+int BinaryPackedMatMul(int n_rows, int n_ints, int n_feats, int out_dim,
+                       void* _lens, void* _bits_pos, void* _bits_neg,
+                       void* _weight, float pad, void* _out)
+{
+    binary_packed_matmul(n_rows, n_ints, n_feats, out_dim,
+                         static_cast<int*>(_lens),
+                         static_cast<uint32_t*>(_bits_pos),
+                         static_cast<uint32_t*>(_bits_neg),
+                         static_cast<float*>(_weight), pad,
+                         static_cast<float*>(_out));
+    return 0;
+}
+
+int MaxTreeDepthCtx(TreeLibContext* ctx)
 {
-    int depth = (int)job_collect.n_cell_job_per_level.size();
+    int depth = (int)ctx->job_collect.n_cell_job_per_level.size();
     depth -= 1;
     return depth;
 }
 
-int NumBottomDep(int depth, int lr)
+int NumBottomDepCtx(TreeLibContext* ctx, int depth, int lr)
 {
-    return (int)job_collect.bot_froms[lr][depth].size();
+    return (int)ctx->job_collect.bot_froms[lr][depth].size();
 }
 
-int NumPrevDep(int depth, int lr)
+int NumPrevDepCtx(TreeLibContext* ctx, int depth, int lr)
 {
-    return (int)job_collect.prev_froms[lr][depth].size();
+    return (int)ctx->job_collect.prev_froms[lr][depth].size();
 }
 
-int NumRowBottomDep(int lr)
+int NumRowBottomDepCtx(TreeLibContext* ctx, int lr)
 {
-    return (int)job_collect.row_bot_froms[lr].size();
+    return (int)ctx->job_collect.row_bot_froms[lr].size();
 }
 
-int NumRowPastDep(int lv, int lr)
+int NumRowPastDepCtx(TreeLibContext* ctx, int lv, int lr)
 {
-    if (lv >= (int)job_collect.row_prev_froms[lr].size())
+    if (lv >= (int)ctx->job_collect.row_prev_froms[lr].size())
         return 0;
-    return (int)job_collect.row_prev_froms[lr][lv].size();
+    return (int)ctx->job_collect.row_prev_froms[lr][lv].size();
 }
 
-int NumRowTopDep(int lv, int lr)
+int NumRowTopDepCtx(TreeLibContext* ctx, int lv, int lr)
 {
-    if (lv >= (int)job_collect.row_top_froms[lr].size())
+    if (lv >= (int)ctx->job_collect.row_top_froms[lr].size())
         return 0;
-    return (int)job_collect.row_top_froms[lr][lv].size();
+    return (int)ctx->job_collect.row_top_froms[lr][lv].size();
 }
 
-int RowSumSteps()
+int RowSumStepsCtx(TreeLibContext* ctx)
 {
-    return job_collect.max_rowsum_steps;
+    return ctx->job_collect.max_rowsum_steps;
 }
 
-int RowMergeSteps()
+int RowMergeStepsCtx(TreeLibContext* ctx)
 {
-    return job_collect.max_row_merge_steps;
+    return ctx->job_collect.max_row_merge_steps;
 }
 
-int NumRowSumOut(int lr)
+int NumRowSumOutCtx(TreeLibContext* ctx, int lr)
 {
-    return (int)job_collect.step_froms[lr].size();
+    return (int)ctx->job_collect.step_froms[lr].size();
 }
 
-int NumRowSumNext(int lr)
+int NumRowSumNextCtx(TreeLibContext* ctx, int lr)
 {
-    return (int)job_collect.step_nexts[lr].size();
+    return (int)ctx->job_collect.step_nexts[lr].size();
 }
 
-int SetRowSumInit(void* _init_idx)
+int SetRowSumInitCtx(TreeLibContext* ctx, void* _init_idx)
 {
     int* init_idx = static_cast<int*>(_init_idx);
-    std::memcpy(init_idx, job_collect.step_inputs[0].data(),
-                job_collect.step_inputs[0].size() * sizeof(int));
+    std::memcpy(init_idx, ctx->job_collect.step_inputs[0].data(),
+                ctx->job_collect.step_inputs[0].size() * sizeof(int));
     return 0;
 }
 
 
-int HasChild(void* _has_child)
+int HasChildCtx(TreeLibContext* ctx, void* _has_child)
 {
     int* has_child = static_cast<int*>(_has_child);
-    std::memcpy(has_child, job_collect.has_ch.data(),
-                job_collect.has_ch.size() * sizeof(int));
+    std::memcpy(has_child, ctx->job_collect.has_ch.data(),
+                ctx->job_collect.has_ch.size() * sizeof(int));
     return 0;
 }
 
-int NumCurNodes(int depth)
+int NumCurNodesCtx(TreeLibContext* ctx, int depth)
 {
-    if (depth >= (int)job_collect.is_internal.size())
+    if (depth >= (int)ctx->job_collect.is_internal.size())
         return 0;
-    return (int)job_collect.is_internal[depth].size();
+    return (int)ctx->job_collect.is_internal[depth].size();
 }
 
-int GetInternalMask(int depth, void* _internal_mask)
+int GetInternalMaskCtx(TreeLibContext* ctx, int depth, void* _internal_mask)
 {
     int* internal_mask = static_cast<int*>(_internal_mask);
-    std::memcpy(internal_mask, job_collect.is_internal[depth].data(),
-                job_collect.is_internal[depth].size() * sizeof(int));
+    std::memcpy(internal_mask, ctx->job_collect.is_internal[depth].data(),
+                ctx->job_collect.is_internal[depth].size() * sizeof(int));
     return 0;
 }
 
-int NumInternalNodes(int depth)
+int NumInternalNodesCtx(TreeLibContext* ctx, int depth)
 {
-    if (depth >= (int)job_collect.has_left.size())
+    if (depth >= (int)ctx->job_collect.has_left.size())
         return 0;
-    return (int)job_collect.has_left[depth].size();
+    return (int)ctx->job_collect.has_left[depth].size();
 }
 
-int NumLeaves(int lr, int ar, int depth)
+// Per-depth leaf labels (weights) or leaf masks for side lr < 0 (left) or
+// lr > 0 (right) and ar < 0 (delete) or ar > 0 (add).
+const std::vector<std::vector<int> >& side_leaf_lists(JobCollect& jobs, int lr,
+                                                      int ar, bool mask)
 {
-    std::vector<std::vector<int>> weights;
-    if (lr == 0) {
-        int sz = (ar > 0) ? job_collect.root_add_weights.size() : job_collect.root_del_weights.size();
-        return sz;
-    }
-    if (lr < 0)
+    if (mask)
     {
-        weights = (ar > 0) ? job_collect.left_add_weights : job_collect.left_del_weights;
+        if (lr < 0)
+            return ar < 0 ? jobs.has_left_del_leaf : jobs.has_left_add_leaf;
+        return ar < 0 ? jobs.has_right_del_leaf : jobs.has_right_add_leaf;
     }
-    else {
-        weights = (ar > 0) ? job_collect.right_add_weights : job_collect.right_del_weights;
+    if (lr < 0)
+        return ar > 0 ? jobs.left_add_weights : jobs.left_del_weights;
+    return ar > 0 ? jobs.right_add_weights : jobs.right_del_weights;
+}
+
+int NumLeavesCtx(TreeLibContext* ctx, int lr, int ar, int depth)
+{
+    if (lr == 0) {
+        int sz = (ar > 0) ? ctx->job_collect.root_add_weights.size() : ctx->job_collect.root_del_weights.size();
+        return sz;
     }
+    auto& weights = side_leaf_lists(ctx->job_collect, lr, ar, false);
     if (depth >= (int)weights.size())
         return 0;
     return weights[depth].size();
 }
 
-int NumLeftBot(int depth)
+int NumLeftBotCtx(TreeLibContext* ctx, int depth)
 {
-    return (int)job_collect.bot_left_froms[depth].size();
+    return (int)ctx->job_collect.bot_left_froms[depth].size();
 }
 
-int GetLeafMask(int lr, int ar, int depth, void* _leaf_mask)
+int GetLeafMaskCtx(TreeLibContext* ctx, int lr, int ar, int depth, void* _leaf_mask)
 {
     int* leaf_mask = static_cast<int*>(_leaf_mask);
-    const int* ptr;
-    std::vector<int> weights;
-    size_t n;
+    const std::vector<int>* weights;
     if (lr == 0) {
         if (ar < 0) {
-            weights = job_collect.is_root_del_leaf;
+            weights = &ctx->job_collect.is_root_del_leaf;
         } else {
             assert(ar == 1);
-            weights = job_collect.is_root_add_leaf;
+            weights = &ctx->job_collect.is_root_add_leaf;
         }
     }
     else {
-        if (lr < 0){
-            if (ar < 0) {
-                weights = job_collect.has_left_del_leaf[depth];
-            }
-            else {
-                weights = job_collect.has_left_add_leaf[depth];
-            }
-        }
-        else {
-            if (ar < 0) {
-                weights = job_collect.has_right_del_leaf[depth];
-            }
-            else {
-                weights = job_collect.has_right_add_leaf[depth];
-            }
-        }
+        weights = &side_leaf_lists(ctx->job_collect, lr, ar, true)[depth];
     }
-//    if (lr == 0) {
-//        ptr = job_collect.is_root_leaf.data();
-//        n = job_collect.is_root_leaf.size();
-//    }
-//    else {
-//        ptr = lr < 0 ? job_collect.has_left_leaf[depth].data()
-//            : job_collect.has_right_leaf[depth].data();
-//        n = lr < 0 ? job_collect.has_left_leaf[depth].size(): job_collect.has_right_leaf[depth].size();
-//    }
-    n = weights.size();
-    ptr = weights.data();
-    std::memcpy(leaf_mask, ptr, n * sizeof(int));
+    std::memcpy(leaf_mask, weights->data(), weights->size() * sizeof(int));
     return 0;
 }
 
-int GetLeafLabels(int lr, int ar, int depth, void* _labels)
+int GetLeafLabelsCtx(TreeLibContext* ctx, int lr, int ar, int depth, void* _labels)
 {
     int* labels = static_cast<int*>(_labels);
-    size_t n;
-    const int* ptr;
-    std::vector<int> weights;
+    const std::vector<int>* weights;
     if (lr == 0) {
         if (ar < 0) {
-            weights = job_collect.root_del_weights;
+            weights = &ctx->job_collect.root_del_weights;
         } else {
             assert(ar == 1);
-            weights = job_collect.root_add_weights;
+            weights = &ctx->job_collect.root_add_weights;
         }
     }
     else {
-        if (lr < 0){
-            if (ar < 0) {
-                weights = job_collect.left_del_weights[depth];
-            }
-            else {
-                weights = job_collect.left_add_weights[depth];
-            }
-        }
-        else {
-            if (ar < 0) {
-                weights = job_collect.right_del_weights[depth];
-            }
-            else {
-                weights = job_collect.right_add_weights[depth];
-            }
-        }
-//        ptr = lr < 0 ? job_collect.left_leaf_weights[depth].data() : job_collect.right_leaf_weights[depth].data();
-//        n = lr < 0 ? job_collect.left_leaf_weights[depth].size() : job_collect.right_leaf_weights[depth].size();
+        weights = &side_leaf_lists(ctx->job_collect, lr, ar, false)[depth];
     }
-    n = weights.size();
-    ptr = weights.data();
-    std::memcpy(labels, ptr, n * sizeof(int));
+    std::memcpy(labels, weights->data(), weights->size() * sizeof(int));
     return 0;
 }
 
-int GetChMask(int lr, int depth, void* _ch_mask)
+int GetChMaskCtx(TreeLibContext* ctx, int lr, int depth, void* _ch_mask)
 {
     int* ch_mask = static_cast<int*>(_ch_mask);
-    const int* ptr = lr < 0 ? job_collect.has_left[depth].data()
-        : job_collect.has_right[depth].data();
-    size_t n = job_collect.has_left[depth].size();
+    const int* ptr = lr < 0 ? ctx->job_collect.has_left[depth].data()
+        : ctx->job_collect.has_right[depth].data();
+    size_t n = ctx->job_collect.has_left[depth].size();
     std::memcpy(ch_mask, ptr, n * sizeof(int));
     return 0;
 }
 
-int GetNumCh(int lr, int depth, void* _num_ch)
+int GetNumChCtx(TreeLibContext* ctx, int lr, int depth, void* _num_ch)
 {
     int* num_ch = static_cast<int*>(_num_ch);
-    const int* ptr = lr < 0 ? job_collect.num_left[depth].data()
-        : job_collect.num_right[depth].data();
-    size_t n = job_collect.num_left[depth].size();
+    const int* ptr = lr < 0 ? ctx->job_collect.num_left[depth].data()
+        : ctx->job_collect.num_right[depth].data();
+    size_t n = ctx->job_collect.num_left[depth].size();
     std::memcpy(num_ch, ptr, n * sizeof(int));
     return 0;
 }
 
-int LeftRightSelect(int depth, void* _left_from, void* _left_to,
+int LeftRightSelectCtx(TreeLibContext* ctx, int depth, void* _left_from, void* _left_to,
                     void* _right_from, void* _right_to)
 {
     int* left_from = static_cast<int*>(_left_from);
@@ -326,8 +356,8 @@ int LeftRightSelect(int depth, void* _left_from, void* _left_to,
     int* right_to = static_cast<int*>(_right_to);
 
     int n_left = 0, n_right = 0, pos = 0;
-    auto& has_left = job_collect.has_left[depth];
-    auto& has_right = job_collect.has_right[depth];
+    auto& has_left = ctx->job_collect.has_left[depth];
+    auto& has_right = ctx->job_collect.has_right[depth];
     for (int i = 0; i < (int)has_left.size(); ++i)
     {
         if (has_left[i]) {
@@ -346,81 +376,81 @@ int LeftRightSelect(int depth, void* _left_from, void* _left_to,
     return 0;
 }
 
-int SetLeftState(int depth, void* _bot_from, void* _bot_to,
+int SetLeftStateCtx(TreeLibContext* ctx, int depth, void* _bot_from, void* _bot_to,
                  void* _prev_from, void* _prev_to)
 {
     int* bot_from = static_cast<int*>(_bot_from);
     int* bot_to = static_cast<int*>(_bot_to);
     int* prev_from = static_cast<int*>(_prev_from);
     int* prev_to = static_cast<int*>(_prev_to);
-    if (depth < (int)job_collect.bot_left_froms.size() &&
-        job_collect.bot_left_froms[depth].size())
+    if (depth < (int)ctx->job_collect.bot_left_froms.size() &&
+        ctx->job_collect.bot_left_froms[depth].size())
     {
-        std::memcpy(bot_from, job_collect.bot_left_froms[depth].data(),
-                    job_collect.bot_left_froms[depth].size() * sizeof(int));
-        std::memcpy(bot_to, job_collect.bot_left_tos[depth].data(),
-                    job_collect.bot_left_tos[depth].size() * sizeof(int));
+        std::memcpy(bot_from, ctx->job_collect.bot_left_froms[depth].data(),
+                    ctx->job_collect.bot_left_froms[depth].size() * sizeof(int));
+        std::memcpy(bot_to, ctx->job_collect.bot_left_tos[depth].data(),
+                    ctx->job_collect.bot_left_tos[depth].size() * sizeof(int));
     }
-    if (depth < (int)job_collect.next_left_froms.size() &&
-        job_collect.next_left_froms[depth].size())
+    if (depth < (int)ctx->job_collect.next_left_froms.size() &&
+        ctx->job_collect.next_left_froms[depth].size())
     {
-        std::memcpy(prev_from, job_collect.next_left_froms[depth].data(),
-                    job_collect.next_left_froms[depth].size() * sizeof(int));
-        std::memcpy(prev_to, job_collect.next_left_tos[depth].data(),
-                    job_collect.next_left_tos[depth].size() * sizeof(int));
+        std::memcpy(prev_from, ctx->job_collect.next_left_froms[depth].data(),
+                    ctx->job_collect.next_left_froms[depth].size() * sizeof(int));
+        std::memcpy(prev_to, ctx->job_collect.next_left_tos[depth].data(),
+                    ctx->job_collect.next_left_tos[depth].size() * sizeof(int));
     }
     return 0;
 }
 
-int SetRowSumLast(void* _last_idx)
+int SetRowSumLastCtx(TreeLibContext* ctx, void* _last_idx)
 {
     int* last_idx = static_cast<int*>(_last_idx);
-    int last_step = job_collect.max_rowsum_steps;
-    std::memcpy(last_idx, job_collect.step_indices[last_step].data(),
-                job_collect.step_indices[last_step].size() * sizeof(int));
+    int last_step = ctx->job_collect.max_rowsum_steps;
+    std::memcpy(last_idx, ctx->job_collect.step_indices[last_step].data(),
+                ctx->job_collect.step_indices[last_step].size() * sizeof(int));
     return 0;
 }
 
-int SetRowSumIds(int lr, void* _step_from, void* _step_to,
+int SetRowSumIdsCtx(TreeLibContext* ctx, int lr, void* _step_from, void* _step_to,
                  void* _next_input, void* _next_states)
 {
     int* step_from = static_cast<int*>(_step_from);
-    std::memcpy(step_from, job_collect.step_froms[lr].data(),
-                job_collect.step_froms[lr].size() * sizeof(int));
+    std::memcpy(step_from, ctx->job_collect.step_froms[lr].data(),
+                ctx->job_collect.step_froms[lr].size() * sizeof(int));
 
     int* step_to = static_cast<int*>(_step_to);
-    std::memcpy(step_to, job_collect.step_tos[lr].data(),
-                job_collect.step_tos[lr].size() * sizeof(int));
+    std::memcpy(step_to, ctx->job_collect.step_tos[lr].data(),
+                ctx->job_collect.step_tos[lr].size() * sizeof(int));
 
     int* next_input = static_cast<int*>(_next_input);
-    std::memcpy(next_input, job_collect.step_inputs[lr + 1].data(),
-                job_collect.step_inputs[lr + 1].size() * sizeof(int));
+    std::memcpy(next_input, ctx->job_collect.step_inputs[lr + 1].data(),
+                ctx->job_collect.step_inputs[lr + 1].size() * sizeof(int));
 
     int* next_states = static_cast<int*>(_next_states);
-    std::memcpy(next_states, job_collect.step_nexts[lr].data(),
-                job_collect.step_nexts[lr].size() * sizeof(int));
+    std::memcpy(next_states, ctx->job_collect.step_nexts[lr].data(),
+                ctx->job_collect.step_nexts[lr].size() * sizeof(int));
     return 0;
 }
 
-int SetTreeEmbedIds(int depth, int lr, void* _bot_from, void* _bot_to,
+int SetTreeEmbedIdsCtx(TreeLibContext* ctx, int depth, int lr, void* _bot_from, void* _bot_to,
                     void* _prev_from, void* _prev_to)
 {
     int* bot_from = static_cast<int*>(_bot_from);
     int* bot_to = static_cast<int*>(_bot_to);
     int* prev_from = static_cast<int*>(_prev_from);
     int* prev_to = static_cast<int*>(_prev_to);
-    std::memcpy(bot_from, job_collect.bot_froms[lr][depth].data(),
-                job_collect.bot_froms[lr][depth].size() * sizeof(int));
-    std::memcpy(bot_to, job_collect.bot_tos[lr][depth].data(),
-                job_collect.bot_tos[lr][depth].size() * sizeof(int));
-    std::memcpy(prev_from, job_collect.prev_froms[lr][depth].data(),
-                job_collect.prev_froms[lr][depth].size() * sizeof(int));
-    std::memcpy(prev_to, job_collect.prev_tos[lr][depth].data(),
-                job_collect.prev_tos[lr][depth].size() * sizeof(int));
+    std::memcpy(bot_from, ctx->job_collect.bot_froms[lr][depth].data(),
+                ctx->job_collect.bot_froms[lr][depth].size() * sizeof(int));
+    std::memcpy(bot_to, ctx->job_collect.bot_tos[lr][depth].data(),
+                ctx->job_collect.bot_tos[lr][depth].size() * sizeof(int));
+    std::memcpy(prev_from, ctx->job_collect.prev_froms[lr][depth].data(),
+                ctx->job_collect.prev_froms[lr][depth].size() * sizeof(int));
+    std::memcpy(prev_to, ctx->job_collect.prev_tos[lr][depth].data(),
+                ctx->job_collect.prev_tos[lr][depth].size() * sizeof(int));
     return 0;
 }
 
-int SetRowEmbedIds(int lr, int level, void* _bot_from, void* _bot_to,
+int SetRowEmbedIdsCtx(TreeLibContext* ctx, int lr, int level, void* _bot_from, void* _bot_to,
                    void* _prev_from, void* _prev_to,
                    void* _past_from, void* _past_to)
 {
@@ -428,139 +458,940 @@ int SetRowEmbedIds(int lr, int level, void* _bot_from, void* _bot_to,
     {
         int* bot_from = static_cast<int*>(_bot_from);
         int* bot_to = static_cast<int*>(_bot_to);
-        std::memcpy(bot_from, job_collect.row_bot_froms[lr].data(),
-                    job_collect.row_bot_froms[lr].size() * sizeof(int));
-        std::memcpy(bot_to, job_collect.row_bot_tos[lr].data(),
-                    job_collect.row_bot_tos[lr].size() * sizeof(int));
+        std::memcpy(bot_from, ctx->job_collect.row_bot_froms[lr].data(),
+                    ctx->job_collect.row_bot_froms[lr].size() * sizeof(int));
+        std::memcpy(bot_to, ctx->job_collect.row_bot_tos[lr].data(),
+                    ctx->job_collect.row_bot_tos[lr].size() * sizeof(int));
     }
 
     int* prev_from = static_cast<int*>(_prev_from);
     int* prev_to = static_cast<int*>(_prev_to);
-    std::memcpy(prev_from, job_collect.row_top_froms[lr][level].data(),
-                job_collect.row_top_froms[lr][level].size() * sizeof(int));
-    std::memcpy(prev_to, job_collect.row_top_tos[lr][level].data(),
-                job_collect.row_top_tos[lr][level].size() * sizeof(int));
-    if (job_collect.row_prev_froms[lr][level].size())
+    std::memcpy(prev_from, ctx->job_collect.row_top_froms[lr][level].data(),
+                ctx->job_collect.row_top_froms[lr][level].size() * sizeof(int));
+    std::memcpy(prev_to, ctx->job_collect.row_top_tos[lr][level].data(),
+                ctx->job_collect.row_top_tos[lr][level].size() * sizeof(int));
+    if (ctx->job_collect.row_prev_froms[lr][level].size())
     {
         int* past_from = static_cast<int*>(_past_from);
         int* past_to = static_cast<int*>(_past_to);
-        std::memcpy(past_from, job_collect.row_prev_froms[lr][level].data(),
-                    job_collect.row_prev_froms[lr][level].size() * sizeof(int));
-        std::memcpy(past_to, job_collect.row_prev_tos[lr][level].data(),
-                    job_collect.row_prev_tos[lr][level].size() * sizeof(int));
+        std::memcpy(past_from, ctx->job_collect.row_prev_froms[lr][level].data(),
+                    ctx->job_collect.row_prev_froms[lr][level].size() * sizeof(int));
+        std::memcpy(past_to, ctx->job_collect.row_prev_tos[lr][level].data(),
+                    ctx->job_collect.row_prev_tos[lr][level].size() * sizeof(int));
     }
     return 0;
 }
 
-int PrepareTrain(int num_graphs, void* _list_ids, void* _list_start_node,
-                 void* _list_col_start, void* _list_col_end,
-                 int num_nodes, int new_batch)
+#ifdef TREE_STATS
+static int64_t arena_bytes(const NodeArena& arena)
 {
-    int* list_ids = static_cast<int*>(_list_ids);
-    int* list_start_node = static_cast<int*>(_list_start_node);
-    int* list_col_start = static_cast<int*>(_list_col_start);
-    int* list_col_end = static_cast<int*>(_list_col_end);
-    job_collect.reset();
-    node_holder.reset();
-    row_holder.reset();
+    return (int64_t)NodeArena::chunk_size *
+           (arena.chunks.size() * sizeof(AdjNode) +
+            arena.bit_chunks.size() * 2 * arena.n_words * sizeof(uint32_t));
+}
 
-    if (new_batch)
+// Counters of the batch prepare_batch just built, and the add_job time its
+// job collectors gathered.
+static void add_batch_stats(TreeLibContext* ctx, int num_graphs,
+                            int* list_start_node, int* list_node_end)
+{
+    auto& stats = ctx->stats;
+    auto& jc = ctx->job_collect;
+    stats.values[STAT_NUM_BATCHES]++;
+    for (int i = 0; i < num_graphs; ++i)
+        stats.values[STAT_ROWS_REALIZED] += list_node_end[i] - list_start_node[i];
+    int64_t num_nodes = TotalTreeNodesCtx(ctx);
+    stats.values[STAT_NODES_ALLOCATED] += num_nodes;
+    STAT_MAX(stats, STAT_ARENA_HIGH_WATER, num_nodes);
+    stats.values[STAT_JOBS] += jc.global_job_nodes.size();
+    for (auto* l : {&jc.n_cell_job_per_level, &jc.n_bin_job_per_level})
+        for (size_t d = 0; d < l->size(); ++d)
+            stats.jobs_per_depth[std::min((int)d, max_stat_depth - 1)] += (*l)[d];
+
+    int64_t bytes = arena_bytes(ctx->node_arena);
+    stats.values[STAT_ADD_JOB_NS] += jc.stats.values[STAT_ADD_JOB_NS];
+    jc.stats.reset();
+    for (int i = 0; i < num_graphs && i < ctx->num_active_shards; ++i)
     {
-        if (cfg::bfs_permute)
+        auto* shard = ctx->shard_list[i];
+        bytes += arena_bytes(shard->node_arena);
+        stats.values[STAT_ADD_JOB_NS] += shard->job_collect.stats.values[STAT_ADD_JOB_NS];
+        shard->job_collect.stats.reset();
+    }
+    STAT_MAX(stats, STAT_ARENA_BYTES, bytes);
+}
+#endif
+
+void cache_indices(TreeLibContext* ctx);
+
+// The batch just built, as SetBatchMemo stores it.
+static std::shared_ptr<const BatchMemoEntry> make_memo_entry(TreeLibContext* ctx)
+{
+    auto entry = std::make_shared<BatchMemoEntry>();
+    if (!ctx->indices_cached)
+        cache_indices(ctx);
+    entry->num_depths = ctx->num_index_depths;
+    entry->num_levels = ctx->num_index_levels;
+    entry->offsets = ctx->index_offsets;
+    entry->buf = ctx->index_buf;
+    auto& n_bin = ctx->job_collect.n_bin_job_per_level;
+    entry->n_bin_job_per_level = n_bin;
+    if (ctx->cfg.bits_compress)
+    {
+        uint32_t n_ints = binary_width(ctx);
+        for (size_t d = 0; d < n_bin.size(); ++d)
         {
-            for (auto* g : active_graphs)
-                delete g;
+            entry->bin_lens.push_back(std::vector<int>(n_bin[d] + 2));
+            entry->bin_pos.push_back(std::vector<uint32_t>((n_bin[d] + 2) * n_ints));
+            entry->bin_neg.push_back(std::vector<uint32_t>((n_bin[d] + 2) * n_ints));
+            pack_binary_feat(ctx, d, entry->bin_lens[d].data(),
+                             entry->bin_pos[d].data(), entry->bin_neg[d].data());
         }
-        active_graphs.clear();
     }
-    int gid, node_start, node_end;
+    return entry;
+}
+
+// Realizes rows [list_start_node[i], list_node_end[i]) of every graph of the
+// batch. With a batch memo, a batch stored before is served from it
+// instead, leaving only the index export and binary features.
+static void prepare_batch(TreeLibContext* ctx, int num_graphs, int* list_ids,
+                          int* list_start_node, int* list_node_end,
+                          int* list_col_start, int* list_col_end, int new_batch)
+{
+    STAT_SCOPE(ctx->stats, STAT_PREPARE_NS);
+    ctx->job_collect.reset();
+    ctx->node_arena.reset();
+    ctx->row_holder.reset();
+    ctx->num_active_shards = 0;
+    ctx->indices_cached = false;
+    ctx->memo_entry.reset();
+
+    if (new_batch)
+        ctx->clear_active_graphs();
+    std::vector<GraphStruct*> batch_graphs;
     for (int i = 0; i < num_graphs; ++i)
     {
-        gid = list_ids[i];
-        assert(gid >= 0 && gid < (int)graph_list.size());
+        int gid = list_ids[i];
+        assert(gid >= 0 && gid < (int)ctx->graph_list.size());
         GraphStruct* g;
         if (new_batch)
         {
-            g = graph_list[gid]->permute();
-            active_graphs.push_back(g);
+            g = ctx->graph_list[gid]->permute();
+            ctx->active_graphs.push_back(g);
         } else {
-            g = active_graphs[i];
+            g = ctx->active_graphs[i];
+        }
+        assert(list_start_node[i] >= 0);
+        assert(list_node_end[i] <= g->num_nodes);
+        batch_graphs.push_back(g);
+    }
+    ctx->active_ranges.resize(ctx->active_graphs.size());
+    for (int i = 0; i < num_graphs; ++i)
+        ctx->active_ranges[i] = std::make_pair(list_start_node[i], list_node_end[i]);
+    std::vector<int> memo_key;
+    if (ctx->batch_memo)
+    {
+        for (int i = 0; i < num_graphs; ++i)
+            for (int v : {list_ids[i], list_start_node[i], list_node_end[i],
+                          list_col_start[i], list_col_end[i]})
+                memo_key.push_back(v);
+        ctx->memo_entry = ctx->batch_memo->find(memo_key);
+        if (ctx->memo_entry)
+        {
+            auto& entry = *ctx->memo_entry;
+            ctx->num_index_depths = entry.num_depths;
+            ctx->num_index_levels = entry.num_levels;
+            ctx->index_offsets = entry.offsets;
+            ctx->index_buf = entry.buf;
+            ctx->indices_cached = true;
+            ctx->job_collect.n_bin_job_per_level = entry.n_bin_job_per_level;
+            STAT_ADD(ctx->stats, STAT_NUM_BATCHES, 1);
+            STAT_ADD(ctx->stats, STAT_MEMO_HITS, 1);
+            return;
+        }
+    }
+#ifdef TREE_STATS
+    auto realize_start = std::chrono::steady_clock::now();
+#endif
+    // realize_nodes keeps the rows it builds on the GraphStruct, so a graph
+    // listed twice would be realized by two threads at once; such batches
+    // are built serially.
+    bool parallel = ctx->cfg.parallel_build && num_graphs > 1;
+    if (parallel)
+    {
+        std::vector<GraphStruct*> distinct(batch_graphs);
+        std::sort(distinct.begin(), distinct.end());
+        parallel = std::adjacent_find(distinct.begin(), distinct.end()) == distinct.end();
+    }
+    if (parallel)
+    {
+        // One shard per graph; merging in graph order reproduces the indices
+        // of the serial build.
+        while ((int)ctx->shard_list.size() < num_graphs)
+            ctx->shard_list.push_back(new TreeShard(ctx->cfg));
+        std::vector<TreeShard*> shards(ctx->shard_list.begin(),
+                                       ctx->shard_list.begin() + num_graphs);
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < num_graphs; ++i)
+        {
+            auto* shard = ctx->shard_list[i];
+            shard->reset();
+            batch_graphs[i]->realize_nodes(list_start_node[i], list_node_end[i],
+                                           list_col_start[i], list_col_end[i],
+                                           shard->job_collect,
+                                           shard->row_holder,
+                                           shard->node_arena);
         }
-        node_start = list_start_node[i];
-        assert(node_start >= 0);
-        node_end = (num_nodes < 0) ? g->num_nodes : node_start + num_nodes;
-        assert(node_start >= 0 && node_end <= g->num_nodes);
-        g->realize_nodes(node_start, node_end,
-                         list_col_start[i], list_col_end[i]);
+        ctx->job_collect.merge(shards);
+        ctx->num_active_shards = num_graphs;
+    } else {
+        for (int i = 0; i < num_graphs; ++i)
+            batch_graphs[i]->realize_nodes(list_start_node[i], list_node_end[i],
+                                           list_col_start[i], list_col_end[i],
+                                           ctx->job_collect, ctx->row_holder,
+                                           ctx->node_arena);
+    }
+#ifdef TREE_STATS
+    ctx->stats.values[STAT_REALIZE_NS] +=
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - realize_start).count();
+#endif
+    {
+        STAT_SCOPE(ctx->stats, STAT_ROW_INDICES_NS);
+        ctx->job_collect.build_row_indices_(ctx->active_graphs);
+    }
+//    ctx->job_collect.build_row_summary(ctx->active_graphs);
+#ifdef TREE_STATS
+    add_batch_stats(ctx, num_graphs, list_start_node, list_node_end);
+#endif
+    if (ctx->batch_memo)
+        ctx->batch_memo->insert(memo_key, make_memo_entry(ctx));
+}
+
+int PrepareTrainCtx(TreeLibContext* ctx, int num_graphs, void* _list_ids, void* _list_start_node,
+                 void* _list_col_start, void* _list_col_end,
+                 int num_nodes, int new_batch)
+{
+    int* list_ids = static_cast<int*>(_list_ids);
+    int* list_start_node = static_cast<int*>(_list_start_node);
+    int* list_col_start = static_cast<int*>(_list_col_start);
+    int* list_col_end = static_cast<int*>(_list_col_end);
+    std::vector<int> list_node_end(num_graphs);
+    for (int i = 0; i < num_graphs; ++i)
+    {
+        assert(list_ids[i] >= 0 && list_ids[i] < (int)ctx->graph_list.size());
+        auto* g = new_batch ? ctx->graph_list[list_ids[i]] : ctx->active_graphs[i];
+        list_node_end[i] = (num_nodes < 0) ? g->num_nodes
+                                           : list_start_node[i] + num_nodes;
     }
-    job_collect.build_row_indices_();
-//    job_collect.build_row_summary();
+    prepare_batch(ctx, num_graphs, list_ids, list_start_node, list_node_end.data(),
+                  list_col_start, list_col_end, new_batch);
     return 0;
 }
 
-int SetRowIndices(void* _bot_from, void* _bot_to, void* _prev_from, void* _prev_to)
+int SetRowIndicesCtx(TreeLibContext* ctx, void* _bot_from, void* _bot_to, void* _prev_from, void* _prev_to)
 {
     int* bot_from = static_cast<int*>(_bot_from);
     int* bot_to = static_cast<int*>(_bot_to);
-    size_t n_bot = job_collect.row_bot_from.size();
+    size_t n_bot = ctx->job_collect.row_bot_from.size();
     if (n_bot > 0)
     {
-        std::memcpy(bot_from, job_collect.row_bot_from.data(),
-                    job_collect.row_bot_from.size() * sizeof(int));
-        std::memcpy(bot_to, job_collect.row_bot_to.data(),
-                    job_collect.row_bot_to.size() * sizeof(int));
+        std::memcpy(bot_from, ctx->job_collect.row_bot_from.data(),
+                    ctx->job_collect.row_bot_from.size() * sizeof(int));
+        std::memcpy(bot_to, ctx->job_collect.row_bot_to.data(),
+                    ctx->job_collect.row_bot_to.size() * sizeof(int));
     }
     int* prev_from = static_cast<int*>(_prev_from);
     int* prev_to = static_cast<int*>(_prev_to);
-    std::memcpy(prev_from, job_collect.row_prev_from.data(),
-                job_collect.row_prev_from.size() * sizeof(int));
-    std::memcpy(prev_to, job_collect.row_prev_to.data(),
-                job_collect.row_prev_to.size() * sizeof(int));
+    std::memcpy(prev_from, ctx->job_collect.row_prev_from.data(),
+                ctx->job_collect.row_prev_from.size() * sizeof(int));
+    std::memcpy(prev_to, ctx->job_collect.row_prev_to.data(),
+                ctx->job_collect.row_prev_to.size() * sizeof(int));
     return 0;
 }
 
-int NumRowBot()
+int NumRowBotCtx(TreeLibContext* ctx)
 {
-    return (int)job_collect.row_bot_from.size();
+    return (int)ctx->job_collect.row_bot_from.size();
 }
 
-int NumRowPrev()
+int NumRowPrevCtx(TreeLibContext* ctx)
 {
-    return (int)job_collect.row_prev_from.size();
+    return (int)ctx->job_collect.row_prev_from.size();
 }
 
-int AddGraph(int graph_id, int num_nodes, int num_edges, void* prev_labels, void* edge_pairs, void* edge_signs, int n_left, int n_right)
+// Segments in the order documented in tree_clib.h; nullptr for an empty one.
+void collect_index_segments(JobCollect& jc,
+                            std::vector<const std::vector<int>*>& segs,
+                            int& num_depths, int& num_levels)
 {
-    auto* g = new GraphStruct(graph_id, num_nodes, num_edges, prev_labels,
+    num_depths = (int)jc.n_cell_job_per_level.size();
+    num_levels = std::max(jc.has_left.size(), jc.is_internal.size());
+    for (auto* l : {&jc.left_add_weights, &jc.left_del_weights,
+                    &jc.right_add_weights, &jc.right_del_weights,
+                    &jc.bot_left_froms, &jc.next_left_froms})
+        num_levels = std::max(num_levels, (int)l->size());
+    auto level = [](std::vector<std::vector<int> >& l, int lv) {
+        return lv < (int)l.size() ? &l[lv] : nullptr;
+    };
+
+    segs.clear();
+    for (int d = 0; d < num_depths; ++d)
+        for (int lr = 0; lr < 2; ++lr)
+            for (auto* l : {jc.bot_froms, jc.bot_tos, jc.prev_froms, jc.prev_tos})
+                segs.push_back(level(l[lr], d));
+    for (auto* l : {&jc.row_bot_from, &jc.row_bot_to,
+                    &jc.row_prev_from, &jc.row_prev_to,
+                    &jc.has_ch, &jc.is_root_del_leaf, &jc.is_root_add_leaf,
+                    &jc.root_del_weights, &jc.root_add_weights})
+        segs.push_back(l);
+    for (int lv = 0; lv < num_levels; ++lv)
+        for (auto* l : {&jc.is_internal, &jc.has_left, &jc.num_left,
+                        &jc.has_right, &jc.num_right,
+                        &jc.has_left_del_leaf, &jc.has_left_add_leaf,
+                        &jc.has_right_del_leaf, &jc.has_right_add_leaf,
+                        &jc.left_del_weights, &jc.left_add_weights,
+                        &jc.right_del_weights, &jc.right_add_weights,
+                        &jc.bot_left_froms, &jc.bot_left_tos,
+                        &jc.next_left_froms, &jc.next_left_tos})
+            segs.push_back(level(*l, lv));
+}
+
+void cache_indices(TreeLibContext* ctx)
+{
+    STAT_SCOPE(ctx->stats, STAT_EXPORT_NS);
+    std::vector<const std::vector<int>*> segs;
+    collect_index_segments(ctx->job_collect, segs, ctx->num_index_depths,
+                           ctx->num_index_levels);
+    auto& offsets = ctx->index_offsets;
+    offsets.resize(segs.size() + 1);
+    offsets[0] = 0;
+    for (size_t k = 0; k < segs.size(); ++k)
+        offsets[k + 1] = offsets[k] + (segs[k] ? (int)segs[k]->size() : 0);
+    ctx->index_buf.resize(offsets.back());
+    int* buf = ctx->index_buf.data();
+    #pragma omp parallel for schedule(dynamic)
+    for (int k = 0; k < (int)segs.size(); ++k)
+        if (segs[k] && segs[k]->size())
+            std::memcpy(buf + offsets[k], segs[k]->data(),
+                        segs[k]->size() * sizeof(int));
+    ctx->indices_cached = true;
+}
+
+int GetIndexLayoutCtx(TreeLibContext* ctx, void* _layout)
+{
+    int* layout = static_cast<int*>(_layout);
+    if (!ctx->indices_cached)
+        cache_indices(ctx);
+    layout[0] = ctx->num_index_depths;
+    layout[1] = ctx->num_index_levels;
+    layout[2] = (int)ctx->index_offsets.size() - 1;
+    layout[3] = (int)ctx->index_buf.size();
+    return 0;
+}
+
+int ExportIndicesCtx(TreeLibContext* ctx, void* _offsets, void* _buf)
+{
+    if (!ctx->indices_cached)
+        cache_indices(ctx);
+    STAT_SCOPE(ctx->stats, STAT_EXPORT_NS);
+    STAT_ADD(ctx->stats, STAT_BYTES_EXPORTED,
+             (int64_t)(ctx->index_offsets.size() + ctx->index_buf.size()) * sizeof(int));
+    std::memcpy(_offsets, ctx->index_offsets.data(),
+                ctx->index_offsets.size() * sizeof(int));
+    std::memcpy(_buf, ctx->index_buf.data(),
+                ctx->index_buf.size() * sizeof(int));
+    return 0;
+}
+
+int AddGraphCtx(TreeLibContext* ctx, int graph_id, int num_nodes, int num_edges,
+             void* prev_row_ptr, void* prev_cols, void* prev_signs,
+             void* edge_pairs, void* edge_signs, int n_left, int n_right)
+{
+    STAT_SCOPE(ctx->stats, STAT_ADD_GRAPH_NS);
+    STAT_ADD(ctx->stats, STAT_EDGES_ADDED, num_edges);
+    auto* g = new GraphStruct(graph_id, num_nodes, num_edges,
+                              prev_row_ptr, prev_cols, prev_signs,
                               edge_pairs, edge_signs, n_left, n_right);
-    assert(graph_id == (int)graph_list.size());
-    graph_list.push_back(g);
+    assert(graph_id == (int)ctx->graph_list.size());
+    ctx->graph_list.push_back(g);
     return 0;
 }
 
-int GetNextStates(void* _state_idx)
+int AddGraphDeltaCtx(TreeLibContext* ctx, int graph_id, int prev_graph_id,
+                  int num_added, void* added_pairs,
+                  int num_removed, void* removed_pairs)
+{
+    STAT_SCOPE(ctx->stats, STAT_ADD_GRAPH_NS);
+    STAT_ADD(ctx->stats, STAT_EDGES_ADDED, num_added + num_removed);
+    assert(prev_graph_id >= 0 && prev_graph_id < (int)ctx->graph_list.size());
+    auto* g = new GraphStruct(graph_id, ctx->graph_list[prev_graph_id],
+                              num_added, added_pairs,
+                              num_removed, removed_pairs);
+    assert(graph_id == (int)ctx->graph_list.size());
+    ctx->graph_list.push_back(g);
+    return 0;
+}
+
+int AddGraphFromStoreCtx(TreeLibContext* ctx, int graph_id, GraphStore* store,
+                         int pair_id)
+{
+    STAT_SCOPE(ctx->stats, STAT_ADD_GRAPH_NS);
+    STAT_ADD(ctx->stats, STAT_EDGES_ADDED, store->pair(pair_id).num_edges);
+    auto* g = new GraphStruct(graph_id, *store, pair_id);
+    assert(graph_id == (int)ctx->graph_list.size());
+    ctx->graph_list.push_back(g);
+    return 0;
+}
+
+int GetStatsCtx(TreeLibContext* ctx, void* _buf)
+{
+#ifdef TREE_STATS
+    int64_t* buf = static_cast<int64_t*>(_buf);
+    std::memcpy(buf, ctx->stats.values, sizeof(ctx->stats.values));
+    std::memcpy(buf + NUM_STATS, ctx->stats.jobs_per_depth,
+                sizeof(ctx->stats.jobs_per_depth));
+    return NUM_STATS + max_stat_depth;
+#else
+    return 0;
+#endif
+}
+
+int ResetStatsCtx(TreeLibContext* ctx)
+{
+    ctx->stats.reset();
+    return 0;
+}
+
+int SetBatchMemoCtx(TreeLibContext* ctx, int64_t max_bytes, const char* spill_path)
+{
+    delete ctx->batch_memo;
+    ctx->batch_memo = nullptr;
+    if (max_bytes > 0 || (spill_path && spill_path[0]))
+        ctx->batch_memo = new BatchMemo(max_bytes, spill_path);
+    return 0;
+}
+
+int GraphJobProfileCtx(TreeLibContext* ctx, int graph_id, int max_depth, void* _jobs)
+{
+    assert(graph_id >= 0 && graph_id < (int)ctx->graph_list.size());
+    int64_t* jobs = static_cast<int64_t*>(_jobs);
+    GraphCost cost(ctx->graph_list[graph_id], ctx->cfg);
+    int num_depths = (int)cost.jobs_per_depth.size();
+    for (int d = 0; d < std::min(num_depths, max_depth); ++d)
+        jobs[d] = cost.jobs_per_depth[d];
+    return num_depths;
+}
+
+int ScheduleBatchesCtx(TreeLibContext* ctx, int num_graphs, void* _list_ids,
+                       int batch_size, double level_cost, void* _order,
+                       void* _batch_sizes, void* _batch_costs)
+{
+    int* list_ids = static_cast<int*>(_list_ids);
+    std::vector<GraphStruct*> graphs;
+    for (int i = 0; i < num_graphs; ++i)
+    {
+        assert(list_ids[i] >= 0 && list_ids[i] < (int)ctx->graph_list.size());
+        graphs.push_back(ctx->graph_list[list_ids[i]]);
+    }
+    std::vector<int> order, batch_sizes;
+    std::vector<double> batch_costs;
+    int num_batches = schedule_batches(graphs, ctx->cfg, batch_size,
+                                       level_cost, order, batch_sizes,
+                                       batch_costs);
+    int* out_order = static_cast<int*>(_order);
+    for (int k = 0; k < num_graphs; ++k)
+        out_order[k] = list_ids[order[k]];
+    std::memcpy(_batch_sizes, batch_sizes.data(), num_batches * sizeof(int));
+    if (_batch_costs)
+        std::memcpy(_batch_costs, batch_costs.data(), num_batches * sizeof(double));
+    return num_batches;
+}
+
+int SliceRowsCtx(TreeLibContext* ctx, int graph_id, int num_slices, void* _starts)
+{
+    assert(graph_id >= 0 && graph_id < (int)ctx->graph_list.size());
+    slice_rows(ctx->graph_list[graph_id], ctx->cfg, num_slices, static_cast<int*>(_starts));
+    return 0;
+}
+
+GraphStore* StoreOpen(const char* path)
+{
+    return GraphStore::open(path);
+}
+
+int StoreFree(GraphStore* store)
+{
+    delete store;
+    return 0;
+}
+
+int StoreNumPairs(GraphStore* store)
+{
+    return store->num_pairs;
+}
+
+int StoreGetPairs(GraphStore* store, void* _info)
+{
+    int* info = static_cast<int*>(_info);
+    for (int i = 0; i < store->num_pairs; ++i)
+    {
+        auto& p = store->pair(i);
+        info[i * 2] = store->snapshot(p.snapshot).num_nodes;
+        info[i * 2 + 1] = p.num_edges;
+    }
+    return 0;
+}
+
+int GetNextStatesCtx(TreeLibContext* ctx, void* _state_idx)
 {
     int* state_idx = static_cast<int*>(_state_idx);
-    std::memcpy(state_idx, job_collect.next_state_froms.data(),
-                job_collect.next_state_froms.size() * sizeof(int));
+    std::memcpy(state_idx, ctx->job_collect.next_state_froms.data(),
+                ctx->job_collect.next_state_froms.size() * sizeof(int));
     return 0;
 }
 
-int GetNumNextStates()
+int GetNumNextStatesCtx(TreeLibContext* ctx)
 {
-    return (int)job_collect.next_state_froms.size();
+    return (int)ctx->job_collect.next_state_froms.size();
 }
 
-int GetCurPos(void* _pos)
+int GetCurPosCtx(TreeLibContext* ctx, void* _pos)
 {
     int* pos = static_cast<int*>(_pos);
     int t = 0;
-    for (auto* g : active_graphs)
+    for (size_t j = 0; j < ctx->active_graphs.size(); ++j)
     {
-        for (int i = g->node_start; i < g->node_end; ++i)
+        auto* g = ctx->active_graphs[j];
+        for (int i = ctx->active_ranges[j].first; i < ctx->active_ranges[j].second; ++i)
         {
             pos[t++] = g->num_nodes - i;
         }
     }
     return 0;
 }
+
+BatchPipeline* PipelineCreate(TreeLibContext* ctx, int num_slots)
+{
+    return new BatchPipeline(ctx ? ctx : default_context(), num_slots);
+}
+
+int PipelineEnqueue(BatchPipeline* pipe, int num_graphs, void* _list_ids,
+                    void* _list_start_node, void* _list_col_start,
+                    void* _list_col_end, int num_nodes)
+{
+    pipe->enqueue(num_graphs, static_cast<int*>(_list_ids),
+                  static_cast<int*>(_list_start_node),
+                  static_cast<int*>(_list_col_start),
+                  static_cast<int*>(_list_col_end), num_nodes);
+    return 0;
+}
+
+TreeLibContext* PipelineAcquire(BatchPipeline* pipe)
+{
+    return pipe->acquire();
+}
+
+int PipelineFree(BatchPipeline* pipe)
+{
+    delete pipe;
+    return 0;
+}
+
+TreeSampler* SamplerCreateCtx(TreeLibContext* ctx, int seed, float greedy_frac)
+{
+    return new TreeSampler(ctx->cfg, seed, greedy_frac);
+}
+
+TreeSampler* SamplerCreate(int seed, float greedy_frac)
+{
+    return SamplerCreateCtx(default_context(), seed, greedy_frac);
+}
+
+int SamplerFree(TreeSampler* sampler)
+{
+    delete sampler;
+    return 0;
+}
+
+int SamplerAddRow(TreeSampler* sampler, int graph_id, int row, int col_start,
+                  int col_end, int lb, int ub, int num_prev, void* _prev_cols)
+{
+    return sampler->add_row(graph_id, row, col_start, col_end, lb, ub, num_prev,
+                            static_cast<int*>(_prev_cols));
+}
+
+int SamplerAddRows(TreeSampler* sampler, int num_rows, void* _graph_ids,
+                   void* _rows, void* _col_starts, void* _col_ends, void* _lbs,
+                   void* _ubs, void* _prev_ptr, void* _prev_cols, void* _walk_ids)
+{
+    int* graph_ids = static_cast<int*>(_graph_ids);
+    int* rows = static_cast<int*>(_rows);
+    int* col_starts = static_cast<int*>(_col_starts);
+    int* col_ends = static_cast<int*>(_col_ends);
+    int* lbs = static_cast<int*>(_lbs);
+    int* ubs = static_cast<int*>(_ubs);
+    int* prev_ptr = static_cast<int*>(_prev_ptr);
+    int* prev_cols = static_cast<int*>(_prev_cols);
+    int* walk_ids = static_cast<int*>(_walk_ids);
+    for (int i = 0; i < num_rows; ++i)
+        walk_ids[i] = sampler->add_row(graph_ids[i], rows[i], col_starts[i],
+                                       col_ends[i], lbs[i], ubs[i],
+                                       prev_ptr[i + 1] - prev_ptr[i],
+                                       prev_cols + prev_ptr[i]);
+    return 0;
+}
+
+int SamplerStep(TreeSampler* sampler)
+{
+    return sampler->step();
+}
+
+int SamplerGetOps(TreeSampler* sampler, void* _ops)
+{
+    int* ops = static_cast<int*>(_ops);
+    std::copy(sampler->ops.begin(), sampler->ops.end(), ops);
+    return 0;
+}
+
+int SamplerNumBits(TreeSampler* sampler)
+{
+    return sampler->bit_lens.size();
+}
+
+int SamplerGetBits(TreeSampler* sampler, void* _lens, void* _bits_pos, void* _bits_neg)
+{
+    std::copy(sampler->bit_lens.begin(), sampler->bit_lens.end(), static_cast<int*>(_lens));
+    std::copy(sampler->bit_pos.begin(), sampler->bit_pos.end(), static_cast<uint32_t*>(_bits_pos));
+    std::copy(sampler->bit_neg.begin(), sampler->bit_neg.end(), static_cast<uint32_t*>(_bits_neg));
+    return 0;
+}
+
+int SamplerSetProbs(TreeSampler* sampler, void* _probs)
+{
+    sampler->set_probs(static_cast<float*>(_probs));
+    return 0;
+}
+
+int SamplerNumSlots(TreeSampler* sampler)
+{
+    return sampler->num_slots;
+}
+
+int SamplerGetWalk(TreeSampler* sampler, int walk_id, void* _info)
+{
+    int* info = static_cast<int*>(_info);
+    auto* w = sampler->walks[walk_id];
+    info[0] = w->input_slot;
+    info[1] = w->done;
+    info[2] = w->summary;
+    info[3] = w->num_edges;
+    return 0;
+}
+
+double SamplerWalkLL(TreeSampler* sampler, int walk_id)
+{
+    return sampler->walks[walk_id]->ll;
+}
+
+int SamplerGetEdges(TreeSampler* sampler, int walk_id, void* _cols, void* _signs)
+{
+    auto* w = sampler->walks[walk_id];
+    std::copy(w->cols.begin(), w->cols.end(), static_cast<int*>(_cols));
+    std::copy(w->signs.begin(), w->signs.end(), static_cast<int*>(_signs));
+    return 0;
+}
+
+int SamplerGetWalks(TreeSampler* sampler, int num_walks, void* _walk_ids, void* _info)
+{
+    int* walk_ids = static_cast<int*>(_walk_ids);
+    int* info = static_cast<int*>(_info);
+    for (int i = 0; i < num_walks; ++i)
+        SamplerGetWalk(sampler, walk_ids[i], info + 4 * i);
+    return 0;
+}
+
+int SamplerCollect(TreeSampler* sampler, int num_walks, void* _walk_ids,
+                   void* _lls, void* _cols, void* _signs)
+{
+    int* walk_ids = static_cast<int*>(_walk_ids);
+    double* lls = static_cast<double*>(_lls);
+    int* cols = static_cast<int*>(_cols);
+    int* signs = static_cast<int*>(_signs);
+    for (int i = 0; i < num_walks; ++i)
+    {
+        auto* w = sampler->walks[walk_ids[i]];
+        lls[i] = w->ll;
+        cols = std::copy(w->cols.begin(), w->cols.end(), cols);
+        signs = std::copy(w->signs.begin(), w->signs.end(), signs);
+        sampler->release(walk_ids[i]);
+    }
+    return 0;
+}
+
+int SamplerRelease(TreeSampler* sampler, int walk_id)
+{
+    sampler->release(walk_id);
+    return 0;
+}
+
+// Context-free API on the default context.
+
+int PrepareTrain(int num_graphs, void* list_ids, void* list_start_node, void* list_col_start, void* list_col_end, int num_nodes, int new_batch)
+{
+    return PrepareTrainCtx(default_context(), num_graphs, list_ids, list_start_node, list_col_start, list_col_end, num_nodes, new_batch);
+}
+
+int AddGraph(int graph_idx, int num_nodes, int num_edges, void* prev_row_ptr, void* prev_cols, void* prev_signs, void* edge_pairs, void* edge_signs, int n_left, int n_right)
+{
+    return AddGraphCtx(default_context(), graph_idx, num_nodes, num_edges, prev_row_ptr, prev_cols, prev_signs, edge_pairs, edge_signs, n_left, n_right);
+}
+
+int AddGraphDelta(int graph_idx, int prev_graph_idx, int num_added, void* added_pairs, int num_removed, void* removed_pairs)
+{
+    return AddGraphDeltaCtx(default_context(), graph_idx, prev_graph_idx, num_added, added_pairs, num_removed, removed_pairs);
+}
+
+int AddGraphFromStore(int graph_idx, GraphStore* store, int pair_id)
+{
+    return AddGraphFromStoreCtx(default_context(), graph_idx, store, pair_id);
+}
+
+int GetLeafLabels(int lr, int ar, int depth, void* _labels)
+{
+    return GetLeafLabelsCtx(default_context(), lr, ar, depth, _labels);
+}
+
+int GetLeafMask(int lr, int ar, int depth, void* _leaf_mask)
+{
+    return GetLeafMaskCtx(default_context(), lr, ar, depth, _leaf_mask);
+}
+
+int NumLeaves(int lr, int ar, int depth)
+{
+    return NumLeavesCtx(default_context(), lr, ar, depth);
+}
+
+int NumRowBot()
+{
+    return NumRowBotCtx(default_context());
+}
+
+int NumRowPrev()
+{
+    return NumRowPrevCtx(default_context());
+}
+
+int SetRowIndices(void* _bot_from, void* _bot_to, void* _prev_from, void* _prev_to)
+{
+    return SetRowIndicesCtx(default_context(), _bot_from, _bot_to, _prev_from, _prev_to);
+}
+
+int TotalTreeNodes()
+{
+    return TotalTreeNodesCtx(default_context());
+}
+
+int SetTreeEmbedIds(int depth, int lr, void* _bot_from, void* _bot_to, void* _prev_from, void* _prev_to)
+{
+    return SetTreeEmbedIdsCtx(default_context(), depth, lr, _bot_from, _bot_to, _prev_from, _prev_to);
+}
+
+int SetRowEmbedIds(int lr, int level, void* _bot_from, void* _bot_to, void* _prev_from, void* _prev_to, void* _past_from, void* _past_to)
+{
+    return SetRowEmbedIdsCtx(default_context(), lr, level, _bot_from, _bot_to, _prev_from, _prev_to, _past_from, _past_to);
+}
+
+int MaxTreeDepth()
+{
+    return MaxTreeDepthCtx(default_context());
+}
+
+int NumBottomDep(int depth, int lr)
+{
+    return NumBottomDepCtx(default_context(), depth, lr);
+}
+
+int NumPrevDep(int depth, int lr)
+{
+    return NumPrevDepCtx(default_context(), depth, lr);
+}
+
+int NumRowBottomDep(int lr)
+{
+    return NumRowBottomDepCtx(default_context(), lr);
+}
+
+int NumRowPastDep(int lv, int lr)
+{
+    return NumRowPastDepCtx(default_context(), lv, lr);
+}
+
+int NumRowTopDep(int lv, int lr)
+{
+    return NumRowTopDepCtx(default_context(), lv, lr);
+}
+
+int RowSumSteps()
+{
+    return RowSumStepsCtx(default_context());
+}
+
+int RowMergeSteps()
+{
+    return RowMergeStepsCtx(default_context());
+}
+
+int NumRowSumOut(int lr)
+{
+    return NumRowSumOutCtx(default_context(), lr);
+}
+
+int NumRowSumNext(int lr)
+{
+    return NumRowSumNextCtx(default_context(), lr);
+}
+
+int SetRowSumIds(int lr, void* _step_from, void* _step_to, void* _next_input, void* _next_states)
+{
+    return SetRowSumIdsCtx(default_context(), lr, _step_from, _step_to, _next_input, _next_states);
+}
+
+int SetRowSumInit(void* _init_idx)
+{
+    return SetRowSumInitCtx(default_context(), _init_idx);
+}
+
+int SetRowSumLast(void* _last_idx)
+{
+    return SetRowSumLastCtx(default_context(), _last_idx);
+}
+
+int HasChild(void* _has_child)
+{
+    return HasChildCtx(default_context(), _has_child);
+}
+
+int NumCurNodes(int depth)
+{
+    return NumCurNodesCtx(default_context(), depth);
+}
+
+int GetInternalMask(int depth, void* _internal_mask)
+{
+    return GetInternalMaskCtx(default_context(), depth, _internal_mask);
+}
+
+int NumInternalNodes(int depth)
+{
+    return NumInternalNodesCtx(default_context(), depth);
+}
+
+int GetChMask(int lr, int depth, void* _ch_mask)
+{
+    return GetChMaskCtx(default_context(), lr, depth, _ch_mask);
+}
+
+int GetNumCh(int lr, int depth, void* _num_ch)
+{
+    return GetNumChCtx(default_context(), lr, depth, _num_ch);
+}
+
+int SetLeftState(int depth, void* _bot_from, void* _bot_to, void* _prev_from, void* _prev_to)
+{
+    return SetLeftStateCtx(default_context(), depth, _bot_from, _bot_to, _prev_from, _prev_to);
+}
+
+int NumLeftBot(int depth)
+{
+    return NumLeftBotCtx(default_context(), depth);
+}
+
+int LeftRightSelect(int depth, void* _left_from, void* _left_to, void* _right_from, void* _right_to)
+{
+    return LeftRightSelectCtx(default_context(), depth, _left_from, _left_to, _right_from, _right_to);
+}
+
+int MaxBinFeatDepth()
+{
+    return MaxBinFeatDepthCtx(default_context());
+}
+
+int NumBinNodes(int depth)
+{
+    return NumBinNodesCtx(default_context(), depth);
+}
+
+int SetBinaryFeat(int d, void* _pos_feat_ptr, void* _neg_feat_ptr, int dev)
+{
+    return SetBinaryFeatCtx(default_context(), d, _pos_feat_ptr, _neg_feat_ptr, dev);
+}
+
+int BinaryFeatWidth()
+{
+    return BinaryFeatWidthCtx(default_context());
+}
+
+int GetBinaryPacked(int d, void* _lens, void* _bits_pos, void* _bits_neg)
+{
+    return GetBinaryPackedCtx(default_context(), d, _lens, _bits_pos, _bits_neg);
+}
+
+int GetNextStates(void* _state_idx)
+{
+    return GetNextStatesCtx(default_context(), _state_idx);
+}
+
+int GetNumNextStates()
+{
+    return GetNumNextStatesCtx(default_context());
+}
+
+int GetCurPos(void* _pos)
+{
+    return GetCurPosCtx(default_context(), _pos);
+}
+
+int GetIndexLayout(void* _layout)
+{
+    return GetIndexLayoutCtx(default_context(), _layout);
+}
+
+int ExportIndices(void* _offsets, void* _buf)
+{
+    return ExportIndicesCtx(default_context(), _offsets, _buf);
+}
+
+int GetStats(void* _buf)
+{
+    return GetStatsCtx(default_context(), _buf);
+}
+
+int ResetStats()
+{
+    return ResetStatsCtx(default_context());
+}
+
+int SetBatchMemo(int64_t max_bytes, const char* spill_path)
+{
+    return SetBatchMemoCtx(default_context(), max_bytes, spill_path);
+}
+
+int GraphJobProfile(int graph_id, int max_depth, void* _jobs)
+{
+    return GraphJobProfileCtx(default_context(), graph_id, max_depth, _jobs);
+}
+
+int ScheduleBatches(int num_graphs, void* _list_ids, int batch_size,
+                    double level_cost, void* _order, void* _batch_sizes,
+                    void* _batch_costs)
+{
+    return ScheduleBatchesCtx(default_context(), num_graphs, _list_ids,
+                              batch_size, level_cost, _order, _batch_sizes,
+                              _batch_costs);
+}
+
+int SliceRows(int graph_id, int num_slices, void* _starts)
+{
+    return SliceRowsCtx(default_context(), graph_id, num_slices, _starts);
+}
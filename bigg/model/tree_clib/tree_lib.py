@@ -14,6 +14,7 @@
 # limitations under the License.
 
 import ctypes
+import functools
 import numpy as np
 import random
 import os
@@ -44,18 +45,272 @@ class CtypeGraph(object):
             self.edge_signs[i] = adj[x, y]
 
 
+class CtypePrevGraph(object):
+    """Previous snapshot as a lower-triangle CSR: row i keeps its sorted
+    columns j < i in cols[row_ptr[i]:row_ptr[i + 1]] with the entry in signs."""
+    def __init__(self, num_nodes, row_ptr, cols, signs):
+        self.num_nodes = num_nodes
+        self.row_ptr = np.ascontiguousarray(row_ptr, dtype=np.int32)
+        self.cols = np.ascontiguousarray(cols, dtype=np.int32)
+        self.signs = np.ascontiguousarray(signs, dtype=np.int32)
+        assert self.row_ptr.shape[0] == num_nodes + 1
+
+    @staticmethod
+    def from_labels(labels, num_nodes):
+        # labels is the dense lower triangle, laid out row by row (i, j < i).
+        rows, cols = np.tril_indices(num_nodes, -1)
+        nz = np.flatnonzero(labels)
+        counts = np.bincount(rows[nz], minlength=num_nodes)
+        row_ptr = np.zeros((num_nodes + 1,), dtype=np.int32)
+        row_ptr[1:] = np.cumsum(counts)
+        return CtypePrevGraph(num_nodes, row_ptr, cols[nz], labels[nz])
+
+    @staticmethod
+    def from_graph(g):
+        num_nodes = len(g)
+        pairs = [(max(x, y), min(x, y), w) for x, y, w in g.edges(data='weight', default=1) if x != y]
+        pairs.sort()
+        counts = np.zeros((num_nodes,), dtype=np.int32)
+        for x, _, _ in pairs:
+            counts[x] += 1
+        row_ptr = np.zeros((num_nodes + 1,), dtype=np.int32)
+        row_ptr[1:] = np.cumsum(counts)
+        cols = [y for _, y, _ in pairs]
+        signs = [w for _, _, w in pairs]
+        return CtypePrevGraph(num_nodes, row_ptr, cols, signs)
+
+
+class GraphStoreWriter(object):
+    """Collects AddGraph pairs and writes them as one graph store file for
+    TreeLib.InsertGraphStore; see graph_store.h for the layout."""
+    header_dtype = np.dtype([('magic', 'S8'), ('version', '<i4'), ('num_snapshots', '<i4'),
+                             ('num_pairs', '<i4'), ('reserved', '<i4')])
+    snapshot_dtype = np.dtype([('num_nodes', '<i4'), ('reserved', '<i4'),
+                               ('row_ptr_offset', '<i8'), ('rows_offset', '<i8')])
+    pair_dtype = np.dtype([('snapshot', '<i4'), ('num_edges', '<i4'), ('n_left', '<i4'),
+                           ('n_right', '<i4'), ('edges_offset', '<i8')])
+
+    def __init__(self):
+        self.snapshots = []
+        self.pairs = []
+
+    def add_snapshot(self, prev_g):
+        """prev_g is a CtypePrevGraph or a networkx graph; returns its id."""
+        if not isinstance(prev_g, CtypePrevGraph):
+            prev_g = CtypePrevGraph.from_graph(prev_g)
+        self.snapshots.append(prev_g)
+        return len(self.snapshots) - 1
+
+    def add_pair(self, snapshot, nx_g, bipart_stats=None):
+        """Target nx_g (a networkx graph or CtypeGraph) on top of a snapshot,
+        like InsertGraph; returns the pair id."""
+        ctype_g = nx_g if isinstance(nx_g, CtypeGraph) else CtypeGraph(nx_g)
+        edges = np.stack([ctype_g.edge_pairs[0::2], ctype_g.edge_pairs[1::2], ctype_g.edge_signs], axis=1)
+        n, m = (-1, -1) if bipart_stats is None else bipart_stats
+        self.pairs.append((snapshot, edges.astype(np.int32), n, m))
+        return len(self.pairs) - 1
+
+    def add_series(self, ts):
+        """Every (t, t + 1) pair of a time series, with the signed lower-triangle
+        delta of compute_adj_delta(abs=False) as target; returns the pair ids."""
+        def tril(g):
+            return {(max(x, y), min(x, y)): w for x, y, w in g.edges(data='weight', default=1)}
+        pair_ids = []
+        cur = tril(ts[0])
+        for t in range(len(ts) - 1):
+            nxt = tril(ts[t + 1])
+            delta = [(x, y, nxt.get((x, y), 0) - cur.get((x, y), 0)) for x, y in set(cur) | set(nxt)]
+            delta = sorted(e for e in delta if e[2] != 0)
+            edges = np.array(delta, dtype=np.int32).reshape(-1, 3)
+            self.pairs.append((self.add_snapshot(ts[t]), edges, -1, -1))
+            pair_ids.append(len(self.pairs) - 1)
+            cur = nxt
+        return pair_ids
+
+    def write(self, path):
+        def aligned(n):
+            return (n + 7) // 8 * 8
+        offset = self.header_dtype.itemsize + self.snapshot_dtype.itemsize * len(self.snapshots) \
+            + self.pair_dtype.itemsize * len(self.pairs)
+        payload = []
+
+        def place(arr):
+            nonlocal offset
+            arr = np.ascontiguousarray(arr, dtype='<i4')
+            start = offset
+            payload.append((start, arr))
+            offset = aligned(start + arr.nbytes)
+            return start
+
+        snapshots = np.zeros((len(self.snapshots),), dtype=self.snapshot_dtype)
+        for i, g in enumerate(self.snapshots):
+            snapshots['num_nodes'][i] = g.num_nodes
+            snapshots['row_ptr_offset'][i] = place(g.row_ptr)
+            snapshots['rows_offset'][i] = place(np.stack([g.cols, g.signs], axis=1))
+        pairs = np.zeros((len(self.pairs),), dtype=self.pair_dtype)
+        for i, (snapshot, edges, n, m) in enumerate(self.pairs):
+            pairs['snapshot'][i] = snapshot
+            pairs['num_edges'][i] = edges.shape[0]
+            pairs['n_left'][i] = n
+            pairs['n_right'][i] = m
+            pairs['edges_offset'][i] = place(edges)
+        header = np.zeros((1,), dtype=self.header_dtype)
+        header['magic'][0] = b'BIGGSER1'
+        header['version'][0] = 1
+        header['num_snapshots'][0] = len(self.snapshots)
+        header['num_pairs'][0] = len(self.pairs)
+        with open(path, 'wb') as f:
+            f.write(header.tobytes())
+            f.write(snapshots.tobytes())
+            f.write(pairs.tobytes())
+            for start, arr in payload:
+                f.write(b'\0' * (start - f.tell()))
+                f.write(arr.tobytes())
+
+
+class _CtxLib(object):
+    """Routes lib.Foo(...) to libtree's FooCtx(ctx, ...)."""
+    def __init__(self, lib, ctx):
+        self._lib = lib
+        self._ctx = ctx
+
+    def __getattr__(self, name):
+        fn = getattr(self._lib, name + 'Ctx')
+        fn.restype = ctypes.c_int
+        return functools.partial(fn, self._ctx)
+
+
+class NativeSampler(object):
+    """Row-tree sampling driven by libtree's TreeSampler, see tree_clib.h."""
+    # Op codes and constant slots of tree_sampler.h.
+    P_HAS_CH, P_HAS_LEFT, P_HAS_RIGHT, P_SIGN = 0, 1, 2, 3
+    S_TOPDOWN_LEFT, S_L2R, S_TOPRIGHT, S_MERGE, S_BITS = 4, 5, 6, 7, 8
+    EMPTY_SLOT, POS_SLOT, NEG_SLOT = 0, 1, 2
+
+    def __init__(self, lib, seed, greedy_frac, ctx=None):
+        self.lib = lib
+        lib.SamplerCreate.restype = ctypes.c_void_p
+        lib.SamplerCreateCtx.restype = ctypes.c_void_p
+        lib.SamplerWalkLL.restype = ctypes.c_double
+        # Row trees follow the flags of ctx, or of Init without one.
+        if ctx is None:
+            handle = lib.SamplerCreate(seed, ctypes.c_float(greedy_frac))
+        else:
+            handle = lib.SamplerCreateCtx(ctx, seed, ctypes.c_float(greedy_frac))
+        self.handle = ctypes.c_void_p(handle)
+
+    def __del__(self):
+        if self.handle is not None:
+            self.lib.SamplerFree(self.handle)
+            self.handle = None
+
+    def add_row(self, graph_id, row, col_range, lb, ub, prev_cols):
+        """Returns (walk id, slot the row's initial state goes to). The walk's
+        random numbers are keyed by (graph_id, row)."""
+        col_start, col_end = col_range if col_range is not None else (-1, -1)
+        prev_cols = np.ascontiguousarray(prev_cols, dtype=np.int32)
+        walk = self.lib.SamplerAddRow(self.handle, graph_id, row, col_start, col_end, lb, ub,
+                                      len(prev_cols), ctypes.c_void_p(prev_cols.ctypes.data))
+        return walk, self.walk_info(walk)[0]
+
+    def add_rows(self, graph_ids, rows, lbs, ubs, list_prev_cols, col_ranges=None):
+        """Starts one walk per (graph_id, row); returns the walk ids."""
+        n = len(rows)
+        if col_ranges is None:
+            col_ranges = [(-1, -1)] * n
+        col_starts = np.array([r[0] for r in col_ranges], dtype=np.int32)
+        col_ends = np.array([r[1] for r in col_ranges], dtype=np.int32)
+        prev_ptr = np.zeros((n + 1,), dtype=np.int32)
+        prev_ptr[1:] = np.cumsum([len(p) for p in list_prev_cols])
+        prev_cols = np.zeros((max(int(prev_ptr[-1]), 1),), dtype=np.int32)
+        if prev_ptr[-1]:
+            prev_cols[:prev_ptr[-1]] = np.concatenate([np.asarray(p, dtype=np.int32) for p in list_prev_cols])
+        args = [np.ascontiguousarray(a, dtype=np.int32) for a in (graph_ids, rows, col_starts, col_ends, lbs, ubs)]
+        walks = np.empty((n,), dtype=np.int32)
+        self.lib.SamplerAddRows(self.handle, n, *[ctypes.c_void_p(a.ctypes.data) for a in args],
+                                ctypes.c_void_p(prev_ptr.ctypes.data), ctypes.c_void_p(prev_cols.ctypes.data),
+                                ctypes.c_void_p(walks.ctypes.data))
+        return walks
+
+    def walks_info(self, walks):
+        """(n, 4) array of walk_info rows."""
+        walks = np.ascontiguousarray(walks, dtype=np.int32)
+        info = np.empty((len(walks), 4), dtype=np.int32)
+        self.lib.SamplerGetWalks(self.handle, len(walks), ctypes.c_void_p(walks.ctypes.data),
+                                 ctypes.c_void_p(info.ctypes.data))
+        return info
+
+    def collect(self, walks, num_edges):
+        """lls of the done walks and their edges back to back; releases them."""
+        walks = np.ascontiguousarray(walks, dtype=np.int32)
+        lls = np.empty((len(walks),), dtype=np.float64)
+        total = max(int(np.sum(num_edges)), 1)
+        cols = np.empty((total,), dtype=np.int32)
+        signs = np.empty((total,), dtype=np.int32)
+        self.lib.SamplerCollect(self.handle, len(walks), ctypes.c_void_p(walks.ctypes.data),
+                                ctypes.c_void_p(lls.ctypes.data), ctypes.c_void_p(cols.ctypes.data),
+                                ctypes.c_void_p(signs.ctypes.data))
+        return lls, cols, signs
+
+    def step(self):
+        """Ops of the next round as an (n, 8) int32 array, None once all walks are done."""
+        n = self.lib.SamplerStep(self.handle)
+        if n == 0:
+            return None
+        ops = np.empty((n, 8), dtype=np.int32)
+        self.lib.SamplerGetOps(self.handle, ctypes.c_void_p(ops.ctypes.data))
+        return ops
+
+    def bits(self, width):
+        n = self.lib.SamplerNumBits(self.handle)
+        lens = np.empty((n,), dtype=np.int32)
+        bits_pos = np.empty((n, width), dtype=np.uint32)
+        bits_neg = np.empty((n, width), dtype=np.uint32)
+        self.lib.SamplerGetBits(self.handle, ctypes.c_void_p(lens.ctypes.data),
+                                ctypes.c_void_p(bits_pos.ctypes.data),
+                                ctypes.c_void_p(bits_neg.ctypes.data))
+        return lens, bits_pos, bits_neg
+
+    def set_probs(self, probs):
+        probs = np.ascontiguousarray(probs, dtype=np.float32)
+        self.lib.SamplerSetProbs(self.handle, ctypes.c_void_p(probs.ctypes.data))
+
+    def num_slots(self):
+        return self.lib.SamplerNumSlots(self.handle)
+
+    def walk_info(self, walk):
+        """(input_slot, done, summary_slot, num_edges)"""
+        info = np.empty((4,), dtype=np.int32)
+        self.lib.SamplerGetWalk(self.handle, walk, ctypes.c_void_p(info.ctypes.data))
+        return tuple(int(x) for x in info)
+
+    def walk_result(self, walk):
+        """(ll, cols, signs) of a done walk, which is released."""
+        num_edges = self.walk_info(walk)[3]
+        cols = np.empty((num_edges,), dtype=np.int32)
+        signs = np.empty((num_edges,), dtype=np.int32)
+        self.lib.SamplerGetEdges(self.handle, walk, ctypes.c_void_p(cols.ctypes.data),
+                                 ctypes.c_void_p(signs.ctypes.data))
+        ll = self.lib.SamplerWalkLL(self.handle, walk)
+        self.lib.SamplerRelease(self.handle, walk)
+        return ll, cols, signs
+
+
 class _tree_lib(object):
 
     def __init__(self):
         pass
 
-    def setup(self, config):
+    def setup(self, config, new_context=False):
+        """new_context gives this instance its own graphs and batch state, so
+        it can be used alongside other instances in the same process."""
         dir_path = os.path.dirname(os.path.realpath(__file__))
         self.lib = ctypes.CDLL('%s/build/dll/libtree.so' % dir_path)
 
         self.lib.Init.restype = ctypes.c_int
         self.lib.PrepareTrain.restype = ctypes.c_int
         self.lib.AddGraph.restype = ctypes.c_int
+        self.lib.AddGraphDelta.restype = ctypes.c_int
         self.lib.TotalTreeNodes.restype = ctypes.c_int
         self.lib.MaxTreeDepth.restype = ctypes.c_int
         self.lib.NumPrevDep.restype = ctypes.c_int
@@ -74,28 +329,115 @@ class _tree_lib(object):
         self.lib.GetLeafLabels.restype = ctypes.c_int
         self.lib.GetLeafMask.restype = ctypes.c_int
         self.lib.SetRowIndices.restype = ctypes.c_int
+        self.lib.GetIndexLayout.restype = ctypes.c_int
+        self.lib.ExportIndices.restype = ctypes.c_int
 
         # self.lib.GetLeafLabels.restype = ctypes.c_int
         # self.lib.NumLeafNodes.restype = ctypes.c_int
 
-        args = 'this -bits_compress %d -embed_dim %d -gpu %d -bfs_permute %d -seed %d -max_num_nodes %d' \
-               % (config.bits_compress, config.embed_dim, config.gpu, config.bfs_permute, config.seed, config.max_num_nodes)
+        args = 'this -bits_compress %d -embed_dim %d -gpu %d -bfs_permute %d -seed %d -max_num_nodes %d -parallel_build %d' \
+               ' -directed %d -self_loop %d' \
+               % (config.bits_compress, config.embed_dim, config.gpu, config.bfs_permute, config.seed, config.max_num_nodes,
+                  getattr(config, 'parallel_build', False), getattr(config, 'directed', False),
+                  getattr(config, 'self_loop', False))
         args = args.split()
         if sys.version_info[0] > 2:
             args = [arg.encode() for arg in args]  # str -> bytes for each element in args
 
         arr = (ctypes.c_char_p * len(args))()
         arr[:] = args
-        self.lib.Init(len(args), arr)
+        self.raw_lib = self.lib
+        self.ctx = None
+        if new_context:
+            self.lib.InitCtx.restype = ctypes.c_void_p
+            self.ctx = ctypes.c_void_p(self.lib.InitCtx(len(args), arr))
+            self.lib = _CtxLib(self.lib, self.ctx)
+        else:
+            self.lib.Init(len(args), arr)
+        # Graphs are always registered on the instance's own context, batch
+        # getters go to self.lib, which prefetching points at the acquired slot.
+        self.base_lib = self.lib
+        self.pipeline = None
         self.embed_dim = config.embed_dim
         self.device = config.device
         self.num_graphs = 0
         self.graph_stats = []
 
+    def CreateSampler(self, seed, greedy_frac=0.0):
+        return NativeSampler(self.raw_lib, seed, greedy_frac, self.ctx)
+
     def TotalTreeNodes(self):
         return self.lib.TotalTreeNodes()
 
+    # StatId order of tree_stats.h.
+    STAT_NAMES = ['add_graph_ns', 'edges_added', 'num_batches', 'prepare_ns',
+                  'realize_ns', 'add_job_ns', 'row_indices_ns', 'export_ns',
+                  'bytes_exported', 'rows_realized', 'nodes_allocated', 'jobs',
+                  'arena_high_water', 'arena_bytes', 'memo_hits']
+    _MAX_STAT_DEPTH = 32
+
+    def GetStats(self):
+        """Phase timers (ns) and counters of this instance's context since the
+        last ResetStats, plus 'jobs_per_depth'; None unless libtree.so was
+        built with make USE_STATS=1. Batches built by a prefetching pipeline
+        are counted on its own contexts, not here."""
+        buf = np.zeros((len(self.STAT_NAMES) + self._MAX_STAT_DEPTH,), dtype=np.int64)
+        n = self.base_lib.GetStats(ctypes.c_void_p(buf.ctypes.data))
+        if n == 0:
+            return None
+        assert n == len(buf)
+        stats = dict(zip(self.STAT_NAMES, [int(x) for x in buf]))
+        depths = buf[len(self.STAT_NAMES):]
+        nz = np.nonzero(depths)[0]
+        stats['jobs_per_depth'] = [int(x) for x in depths[:nz[-1] + 1]] if len(nz) else []
+        return stats
+
+    def ResetStats(self):
+        self.base_lib.ResetStats()
+
+    def SetBatchMemo(self, max_bytes, spill_path=None):
+        """Serves minibatches requested before (same graphs, node ranges and
+        col ranges, e.g. in a later epoch) from a memo of their exported
+        indices and binary features instead of rebuilding them. Keeps up to
+        max_bytes in memory, least recently used out first; with spill_path,
+        entries pushed out go to that file. SetBatchMemo(0) turns it off.
+        Not used by prefetched batches."""
+        path = spill_path.encode() if spill_path else None
+        self.base_lib.SetBatchMemo(ctypes.c_int64(max_bytes), ctypes.c_char_p(path))
+
+    def GraphJobProfile(self, gid, max_depth=64):
+        """Jobs the row trees of graph gid add at each tree depth, counted
+        from its edges without building them."""
+        jobs = np.zeros((max_depth,), dtype=np.int64)
+        n = self.base_lib.GraphJobProfile(gid, max_depth, ctypes.c_void_p(jobs.ctypes.data))
+        assert n <= max_depth
+        return jobs[:n]
+
+    def ScheduleBatches(self, list_gids, batch_size, level_cost=1000.0):
+        """Splits list_gids into batches of at most batch_size graphs with even
+        predicted tree work; level_cost is what one tree level costs in jobs,
+        whatever its width. Returns the list of gid lists and their costs."""
+        gids = np.array(list_gids, dtype=np.int32)
+        order = np.zeros((len(gids),), dtype=np.int32)
+        sizes = np.zeros((len(gids),), dtype=np.int32)
+        costs = np.zeros((len(gids),), dtype=np.float64)
+        n = self.base_lib.ScheduleBatches(len(gids), ctypes.c_void_p(gids.ctypes.data), batch_size,
+                                          ctypes.c_double(level_cost), ctypes.c_void_p(order.ctypes.data),
+                                          ctypes.c_void_p(sizes.ctypes.data), ctypes.c_void_p(costs.ctypes.data))
+        bounds = np.cumsum(sizes[:n])
+        return [list(order[b - s:b]) for b, s in zip(bounds, sizes[:n])], costs[:n]
+
+    def SliceRows(self, gid, num_slices):
+        """Boundaries of num_slices consecutive row slices of graph gid with
+        even predicted work; slice k is trained with
+        list_node_start=[starts[k]], num_nodes=starts[k + 1] - starts[k]."""
+        starts = np.zeros((num_slices + 1,), dtype=np.int32)
+        self.base_lib.SliceRows(gid, num_slices, ctypes.c_void_p(starts.ctypes.data))
+        return starts
+
     def InsertGraph(self, labels, nx_g, bipart_stats=None):
+        """labels is the previous snapshot: a CtypePrevGraph, a networkx graph,
+        or the dense lower triangle produced by preprocess_data."""
         gid = self.num_graphs
         self.num_graphs += 1
         if isinstance(nx_g, CtypeGraph):
@@ -107,12 +449,58 @@ class _tree_lib(object):
             n, m = -1, -1
         else:
             n, m = bipart_stats
-        labels = labels.astype(np.int32)
-        self.lib.AddGraph(gid, ctype_g.num_nodes, ctype_g.num_edges, ctypes.c_void_p(labels.ctypes.data),
-                          ctypes.c_void_p(ctype_g.edge_pairs.ctypes.data), ctypes.c_void_p(ctype_g.edge_signs.ctypes.data), n, m)
+        if isinstance(labels, CtypePrevGraph):
+            prev_g = labels
+        elif isinstance(labels, nx.Graph):
+            prev_g = CtypePrevGraph.from_graph(labels)
+        else:
+            prev_g = CtypePrevGraph.from_labels(np.asarray(labels).astype(np.int32), ctype_g.num_nodes)
+        self.base_lib.AddGraph(gid, ctype_g.num_nodes, ctype_g.num_edges,
+                               ctypes.c_void_p(prev_g.row_ptr.ctypes.data),
+                               ctypes.c_void_p(prev_g.cols.ctypes.data),
+                               ctypes.c_void_p(prev_g.signs.ctypes.data),
+                               ctypes.c_void_p(ctype_g.edge_pairs.ctypes.data), ctypes.c_void_p(ctype_g.edge_signs.ctypes.data), n, m)
         return gid
 
-    def PrepareMiniBatch(self, list_gids, list_node_start=None, num_nodes=-1, list_col_ranges=None, new_batch=True):
+    def InsertGraphDelta(self, prev_gid, added_pairs, removed_pairs):
+        """Registers the next pair of a time series: its previous snapshot is
+        the target of prev_gid, and its target adds added_pairs and removes
+        removed_pairs, both lists of (x, y) node pairs."""
+        gid = self.num_graphs
+        self.num_graphs += 1
+        added = np.ascontiguousarray(np.reshape(added_pairs, (-1,)), dtype=np.int32)
+        removed = np.ascontiguousarray(np.reshape(removed_pairs, (-1,)), dtype=np.int32)
+        num_nodes = self.graph_stats[prev_gid][0]
+        self.graph_stats.append((num_nodes, (added.shape[0] + removed.shape[0]) // 2))
+        self.base_lib.AddGraphDelta(gid, prev_gid,
+                                    added.shape[0] // 2, ctypes.c_void_p(added.ctypes.data),
+                                    removed.shape[0] // 2, ctypes.c_void_p(removed.ctypes.data))
+        return gid
+
+    def InsertGraphStore(self, path):
+        """Registers every pair of a graph store file, see GraphStoreWriter, in
+        order and returns their graph ids. The file is mmapped: rows are read
+        from it in place when a batch first touches them."""
+        self.raw_lib.StoreOpen.restype = ctypes.c_void_p
+        handle = self.raw_lib.StoreOpen(path.encode())
+        if not handle:
+            raise IOError('cannot open graph store %s: missing file or failed validation' % path)
+        store = ctypes.c_void_p(handle)
+        num_pairs = self.raw_lib.StoreNumPairs(store)
+        info = np.zeros((max(num_pairs, 1), 2), dtype=np.int32)
+        self.raw_lib.StoreGetPairs(store, ctypes.c_void_p(info.ctypes.data))
+        gids = []
+        for k in range(num_pairs):
+            gid = self.num_graphs
+            self.num_graphs += 1
+            self.graph_stats.append((int(info[k, 0]), int(info[k, 1])))
+            self.base_lib.AddGraphFromStore(gid, store, k)
+            gids.append(gid)
+        # The graphs hold on to the mapping.
+        self.raw_lib.StoreFree(store)
+        return gids
+
+    def _batch_args(self, list_gids, list_node_start, list_col_ranges):
         n_graphs = len(list_gids)
         list_gids = np.array(list_gids, dtype=np.int32)
         if list_node_start is None:
@@ -126,14 +514,9 @@ class _tree_lib(object):
             list_col_start, list_col_end = zip(*list_col_ranges)
             list_col_start = np.array(list_col_start, dtype=np.int32)
             list_col_end = np.array(list_col_end, dtype=np.int32)
+        return list_gids, list_node_start, list_col_start, list_col_end
 
-        self.lib.PrepareTrain(n_graphs,
-                              ctypes.c_void_p(list_gids.ctypes.data),
-                              ctypes.c_void_p(list_node_start.ctypes.data),
-                              ctypes.c_void_p(list_col_start.ctypes.data),
-                              ctypes.c_void_p(list_col_end.ctypes.data),
-                              num_nodes,
-                              int(new_batch))
+    def _num_batch_nodes(self, list_gids, list_node_start, num_nodes):
         list_nnodes = []
         for i, gid in enumerate(list_gids):
             tot_nodes = self.graph_stats[gid][0]
@@ -142,37 +525,141 @@ class _tree_lib(object):
             else:
                 cur_num = min(num_nodes, tot_nodes - list_node_start[i])
             list_nnodes.append(cur_num)
-        self.list_nnodes = list_nnodes
         return list_nnodes
 
-    def PrepareTreeEmbed(self):
-        max_d = self.lib.MaxTreeDepth()
+    def StartPrefetch(self, num_slots=2):
+        """Builds minibatches on a native worker thread from now on: batches
+        queued with EnqueueMiniBatch are handed over by PrepareMiniBatch in the
+        same order. All graphs must be inserted before this call."""
+        assert self.pipeline is None
+        self.raw_lib.PipelineCreate.restype = ctypes.c_void_p
+        self.raw_lib.PipelineAcquire.restype = ctypes.c_void_p
+        self.pipeline = ctypes.c_void_p(self.raw_lib.PipelineCreate(self.ctx, num_slots))
+        self.pending_batches = []
+
+    def StopPrefetch(self):
+        """Drops any batch queued but not handed over yet."""
+        self.raw_lib.PipelineFree(self.pipeline)
+        self.pipeline = None
+        self.pending_batches = []
+        self.lib = self.base_lib
+
+    def EnqueueMiniBatch(self, list_gids, list_node_start=None, num_nodes=-1, list_col_ranges=None):
+        args = self._batch_args(list_gids, list_node_start, list_col_ranges)
+        self.raw_lib.PipelineEnqueue(self.pipeline, len(list_gids),
+                                     *[ctypes.c_void_p(x.ctypes.data) for x in args],
+                                     num_nodes)
+        self.pending_batches.append((args, num_nodes))
 
+    def PrepareMiniBatch(self, list_gids, list_node_start=None, num_nodes=-1, list_col_ranges=None, new_batch=True):
+        n_graphs = len(list_gids)
+        args = self._batch_args(list_gids, list_node_start, list_col_ranges)
+        list_gids, list_node_start, list_col_start, list_col_end = args
+        if self.pipeline is not None:
+            # Hand over the oldest prefetched batch, queueing this one first
+            # if nothing is pending.
+            assert new_batch
+            if len(self.pending_batches) == 0:
+                self.EnqueueMiniBatch(list_gids, list_node_start, num_nodes, list_col_ranges)
+            queued, queued_num_nodes = self.pending_batches.pop(0)
+            assert queued_num_nodes == num_nodes
+            assert all(np.array_equal(x, y) for x, y in zip(queued, args)), 'minibatch was not the next one enqueued'
+            self.lib = _CtxLib(self.raw_lib, ctypes.c_void_p(self.raw_lib.PipelineAcquire(self.pipeline)))
+        else:
+            self.lib.PrepareTrain(n_graphs,
+                                  ctypes.c_void_p(list_gids.ctypes.data),
+                                  ctypes.c_void_p(list_node_start.ctypes.data),
+                                  ctypes.c_void_p(list_col_start.ctypes.data),
+                                  ctypes.c_void_p(list_col_end.ctypes.data),
+                                  num_nodes,
+                                  int(new_batch))
+        self.list_nnodes = self._num_batch_nodes(list_gids, list_node_start, num_nodes)
+        self.ExportIndices()
+        return self.list_nnodes
+
+    # Segment layout of the exported index buffer, see tree_clib.h.
+    _SEGS_PER_DEPTH = 8
+    _SEGS_PER_LEVEL = 17
+
+    def ExportIndices(self):
+        """Fetches every index array of the current minibatch in one call; the
+        getters below return views into self.index_buf."""
+        layout = np.empty((4,), dtype=np.int32)
+        self.lib.GetIndexLayout(ctypes.c_void_p(layout.ctypes.data))
+        self.num_depths, self.num_levels, num_segs, total = [int(x) for x in layout]
+        self.index_offsets = np.empty((num_segs + 1,), dtype=np.int32)
+        self.index_buf = np.empty((max(total, 1),), dtype=np.int32)
+        self.lib.ExportIndices(ctypes.c_void_p(self.index_offsets.ctypes.data),
+                               ctypes.c_void_p(self.index_buf.ctypes.data))
+        self.row_seg_base = self._SEGS_PER_DEPTH * self.num_depths
+        self.root_seg_base = self.row_seg_base + 4
+        self.level_seg_base = self.root_seg_base + 5
+        self.index_tensor = None
+
+    def GetIndexTensor(self):
+        """The whole index buffer on self.device as int64, copied over once per
+        minibatch. Segment k is index_tensor[index_offsets[k]:index_offsets[k + 1]]."""
+        if self.index_tensor is None:
+            self.index_tensor = torch.from_numpy(self.index_buf).to(self.device).long()
+        return self.index_tensor
+
+    def _seg(self, k, tensor=False):
+        buf = self.GetIndexTensor() if tensor else self.index_buf
+        return buf[self.index_offsets[k]:self.index_offsets[k + 1]]
+
+    def _level_seg(self, depth, slot, tensor=False):
+        if depth >= self.num_levels:
+            return (self.GetIndexTensor() if tensor else self.index_buf)[:0]
+        return self._seg(self.level_seg_base + depth * self._SEGS_PER_LEVEL + slot, tensor)
+
+    def PrepareTreeEmbed(self):
         all_ids = []
         # bot_froms handles the bottom nodes.
         # prev_froms handles the internal nodes.
-        for d in range(max_d + 1):
+        # Index arrays are views of GetIndexTensor, so none is copied on its own.
+        for d in range(self.num_depths):
             ids_d = []
             for i in range(2): # left, right
-                num_prev = self.lib.NumPrevDep(d, i)
-                num_bot = self.lib.NumBottomDep(d, i)
-
-                bot_froms = np.empty((num_bot,), dtype=np.int32)
-                bot_tos = np.empty((num_bot,), dtype=np.int32)
-
-                prev_froms = np.empty((num_prev,), dtype=np.int32)
-                prev_tos = np.empty((num_prev,), dtype=np.int32)
-                self.lib.SetTreeEmbedIds(d,
-                                         i,
-                                         ctypes.c_void_p(bot_froms.ctypes.data),
-                                         ctypes.c_void_p(bot_tos.ctypes.data),
-                                         ctypes.c_void_p(prev_froms.ctypes.data),
-                                         ctypes.c_void_p(prev_tos.ctypes.data))
-                ids_d.append((bot_froms, bot_tos, prev_froms, prev_tos))
+                base = d * self._SEGS_PER_DEPTH + i * 4
+                ids_d.append(tuple(self._seg(base + j, True) for j in range(4)))
             all_ids.append(ids_d)
         return all_ids
 
-    def PrepareBinary(self):
+    def PrepareBinaryPacked(self):
+        """Per depth (lens, bits_pos, bits_neg) as numpy arrays: NumBinNodes + 2
+        rows of BinaryFeatWidth uint32 words, see GetBinaryPacked."""
+        max_d = self.lib.MaxBinFeatDepth()
+        width = self.lib.BinaryFeatWidth()
+        all_packed = []
+        for d in range(max_d):
+            num_rows = self.lib.NumBinNodes(d) + 2
+            lens = np.empty((num_rows,), dtype=np.int32)
+            bits_pos = np.empty((num_rows, width), dtype=np.uint32)
+            bits_neg = np.empty((num_rows, width), dtype=np.uint32)
+            self.lib.GetBinaryPacked(d, ctypes.c_void_p(lens.ctypes.data),
+                                     ctypes.c_void_p(bits_pos.ctypes.data),
+                                     ctypes.c_void_p(bits_neg.ctypes.data))
+            all_packed.append((lens, bits_pos, bits_neg))
+        return all_packed
+
+    def _unpack_binary(self, lens, bits_pos, bits_neg):
+        # Same values as SetBinaryFeat + pos_feat - neg_feat, built on device
+        # from the packed words: bit difference below lens, -10 past it.
+        lens = torch.from_numpy(lens).to(self.device).long()
+        cols = torch.arange(self.embed_dim, device=self.device)
+        word = cols.clamp(max=bits_pos.shape[1] * 32 - 1) // 32
+        shift = cols % 32
+
+        def expand(bits):
+            bits = torch.from_numpy(bits.view(np.int32)).to(self.device).long() & 0xffffffff
+            return ((bits[:, word] >> shift) & 1).float()
+        diff = expand(bits_pos) - expand(bits_neg)
+        valid = cols.unsqueeze(0) < lens.unsqueeze(1)
+        return torch.where(valid, diff, torch.full_like(diff, -10.0))
+
+    def PrepareBinary(self, packed=False):
+        """With packed=True only the uint32 rows and lens leave the host and the
+        float features are expanded on self.device, ~32x less to transfer."""
         max_d = self.lib.MaxBinFeatDepth()
         all_bin_feats = []
         # base_feat = torch.zeros(2, self.embed_dim)
@@ -184,13 +671,17 @@ class _tree_lib(object):
         base_feat = base_feat.to(self.device)
         # The +2 provides 2 extra cells used to summarise empty rows. This is just to
         # save some memory so you don't end up allocating the 'empty' token many times.
+        all_packed = self.PrepareBinaryPacked() if packed else None
         for d in range(max_d):
             num_nodes = self.lib.NumBinNodes(d)
             if num_nodes == 0:
                 all_bin_feats.append(base_feat)
+            elif packed:
+                all_bin_feats.append(self._unpack_binary(*all_packed[d]))
             else:
                 if self.device == torch.device('cpu'):
-                    feat = torch.zeros(num_nodes + 2, self.embed_dim)
+                    pos_feat = torch.empty(num_nodes + 2, self.embed_dim).fill_(-5.0)
+                    neg_feat = torch.empty(num_nodes + 2, self.embed_dim).fill_(5.0)
                     dev = 0
                 else:
                     pos_feat = torch.cuda.FloatTensor(num_nodes + 2, self.embed_dim).fill_(-5.0)
@@ -202,19 +693,8 @@ class _tree_lib(object):
         return all_bin_feats, (base_feat, base_feat)
 
     def PrepareRowIndices(self):
-        num_bot = self.lib.NumRowBot()
-        num_prev = self.lib.NumRowPrev()
-
-        bot_froms = np.empty((num_bot,), dtype=np.int32)
-        bot_tos = np.empty((num_bot,), dtype=np.int32)
-        prev_froms = np.empty((num_prev,), dtype=np.int32)
-        prev_tos = np.empty((num_prev,), dtype=np.int32)
-
-        self.lib.SetRowIndices(ctypes.c_void_p(bot_froms.ctypes.data),
-                               ctypes.c_void_p(bot_tos.ctypes.data),
-                               ctypes.c_void_p(prev_froms.ctypes.data),
-                               ctypes.c_void_p(prev_tos.ctypes.data))
-        return (bot_froms, bot_tos, prev_froms, prev_tos)
+        # (bot_froms, bot_tos, prev_froms, prev_tos)
+        return tuple(self._seg(self.row_seg_base + j, True) for j in range(4))
 
     def PrepareRowEmbed(self):
         tot_levels = self.lib.RowMergeSteps()
@@ -280,83 +760,62 @@ class _tree_lib(object):
     # TODO: rename this to HasLeafMask
     def GetLeafMask(self, lr, ar, depth, tensorize=True):
         if lr == 0:
-            n = np.sum(self.list_nnodes)
+            has_leaf = self._seg(self.root_seg_base + (1 if ar < 0 else 2))
         else:
-            # TODO: use the leaf size for clarity, even though they will be the same.
-            n = self.lib.NumInternalNodes(depth)
-        if n == 0:
+            has_leaf = self._level_seg(depth, (5 if lr < 0 else 7) + (0 if ar < 0 else 1))
+        if has_leaf.shape[0] == 0:
             return None
-        has_leaf = np.empty((n,), dtype=np.int32)
-        self.lib.GetLeafMask(lr, ar, depth, ctypes.c_void_p(has_leaf.ctypes.data))
         return has_leaf.astype(np.bool)
 
     def GetLeafLabels(self, lr, ar, depth, dtype=None):
-        n = self.lib.NumLeaves(lr, ar, depth)
-        if n == 0:
+        if lr == 0:
+            labels = self._seg(self.root_seg_base + (4 if ar > 0 else 3))
+        else:
+            labels = self._level_seg(depth, (9 if lr < 0 else 11) + (1 if ar > 0 else 0))
+        if labels.shape[0] == 0:
             return None
-        labels = np.empty((n,), dtype=np.int32)
-        self.lib.GetLeafLabels(lr, ar, depth, ctypes.c_void_p(labels.ctypes.data))
         if dtype is not None:
             labels = labels.astype(dtype)
         return labels
 
     def GetChLabel(self, lr, depth=-1, dtype=None):
         if lr == 0:  # == root
-            total_nodes = np.sum(self.list_nnodes)
-            has_ch = np.empty((total_nodes,), dtype=np.int32)
-            self.lib.HasChild(ctypes.c_void_p(has_ch.ctypes.data))
+            has_ch = self._seg(self.root_seg_base)
             num_ch = None
         else: # left or right.
-            n = self.lib.NumInternalNodes(depth)
-            has_ch = np.empty((n,), dtype=np.int32)
-            self.lib.GetChMask(lr, depth,
-                               ctypes.c_void_p(has_ch.ctypes.data))
-            num_ch = np.empty((n,), dtype=np.int32)
-            self.lib.GetNumCh(lr, depth,
-                              ctypes.c_void_p(num_ch.ctypes.data))
-            num_ch = torch.tensor(num_ch, dtype=torch.float32).to(self.device)
+            slot = 1 if lr < 0 else 3
+            has_ch = self._level_seg(depth, slot)
+            num_ch = self._level_seg(depth, slot + 1, True).float()
         if dtype is not None:
             has_ch = has_ch.astype(dtype)
         return has_ch, num_ch
 
     def QueryNonLeaf(self, depth):
-        n = self.lib.NumCurNodes(depth)
-        if n == 0:
+        is_internal = self._level_seg(depth, 0)
+        if is_internal.shape[0] == 0:
             return None
-        is_internal = np.empty((n,), dtype=np.int32)
-        self.lib.GetInternalMask(depth, ctypes.c_void_p(is_internal.ctypes.data))
         return is_internal.astype(np.bool)
 
     def GetLeftRootStates(self, depth):
-        n = self.lib.NumInternalNodes(depth)
-        left_bot = self.lib.NumLeftBot(depth)
-        left_next = n - left_bot
-        bot_froms = np.empty((left_bot,), dtype=np.int32)
-        bot_tos = np.empty((left_bot,), dtype=np.int32)
-        next_froms = np.empty((left_next,), dtype=np.int32)
-        next_tos = np.empty((left_next,), dtype=np.int32)
-        self.lib.SetLeftState(depth,
-                              ctypes.c_void_p(bot_froms.ctypes.data),
-                              ctypes.c_void_p(bot_tos.ctypes.data),
-                              ctypes.c_void_p(next_froms.ctypes.data),
-                              ctypes.c_void_p(next_tos.ctypes.data))
-        if left_bot == 0:
+        bot_froms, bot_tos, next_froms, next_tos = [self._level_seg(depth, 13 + j, True) for j in range(4)]
+        if bot_froms.shape[0] == 0:
             bot_froms = bot_tos = None
-        if left_next == 0:
+        if next_froms.shape[0] == 0:
             next_froms = next_tos = None
         return bot_froms, bot_tos, next_froms, next_tos
 
     def GetLeftRightSelect(self, depth, num_left, num_right):
-        left_froms = np.empty((num_left,), dtype=np.int32)
-        left_tos = np.empty((num_left,), dtype=np.int32)
-        right_froms = np.empty((num_right,), dtype=np.int32)
-        right_tos = np.empty((num_right,), dtype=np.int32)
-
-        self.lib.LeftRightSelect(depth,
-                                 ctypes.c_void_p(left_froms.ctypes.data),
-                                 ctypes.c_void_p(left_tos.ctypes.data),
-                                 ctypes.c_void_p(right_froms.ctypes.data),
-                                 ctypes.c_void_p(right_tos.ctypes.data))
+        # Children are laid out node by node, left before right.
+        assert np.sum(self._level_seg(depth, 1)) == num_left
+        assert np.sum(self._level_seg(depth, 3)) == num_right
+        has_left = (self._level_seg(depth, 1, True) != 0).long()
+        has_right = (self._level_seg(depth, 3, True) != 0).long()
+        num_ch = has_left + has_right
+        pos = torch.cumsum(num_ch, 0) - num_ch
+        left_froms = torch.nonzero(has_left).view(-1)
+        left_tos = pos[left_froms]
+        right_froms = torch.nonzero(has_right).view(-1)
+        right_tos = (pos + has_left)[right_froms]
         return left_froms, left_tos, right_froms, right_tos
 
 
@@ -227,6 +227,34 @@ class BitsRepNet(nn.Module):
         return h, h
 
 
+class SamplerSlots(object):
+    """(h, c) of every TreeSampler slot, in buffers grown on demand."""
+    def __init__(self, embed_dim, device):
+        self.h_buf = torch.zeros(16, embed_dim, device=device)
+        self.c_buf = torch.zeros(16, embed_dim, device=device)
+
+    def reserve(self, num_slots):
+        if num_slots > self.h_buf.shape[0]:
+            n = max(num_slots, 2 * self.h_buf.shape[0])
+            self.h_buf = torch.cat([self.h_buf, self.h_buf.new_zeros(n - self.h_buf.shape[0], self.h_buf.shape[1])])
+            self.c_buf = torch.cat([self.c_buf, self.c_buf.new_zeros(n - self.c_buf.shape[0], self.c_buf.shape[1])])
+
+    def _index(self, ids):
+        return torch.as_tensor(np.asarray(ids, dtype=np.int64), device=self.h_buf.device)
+
+    def h(self, ids):
+        return self.h_buf[self._index(ids)]
+
+    def state(self, ids):
+        idx = self._index(ids)
+        return self.h_buf[idx], self.c_buf[idx]
+
+    def write(self, ids, h, c):
+        idx = self._index(ids)
+        self.h_buf[idx] = h.expand(len(idx), -1)
+        self.c_buf[idx] = c.expand(len(idx), -1)
+
+
 class RecurTreeGen(nn.Module):
     def __init__(self, args):
         super(RecurTreeGen, self).__init__()
@@ -234,6 +262,7 @@ class RecurTreeGen(nn.Module):
         self.self_loop = args.self_loop
         self.bits_compress = args.bits_compress
         self.greedy_frac = args.greedy_frac
+        self.native_gen = getattr(args, 'native_gen', False)
         self.share_param = args.share_param
         self.embed_dim = args.embed_dim
         self.dropout = args.dropout
@@ -491,8 +520,189 @@ class RecurTreeGen(nn.Module):
                 summary_state = self.lr2p_cell(left_state, right_state)
             return ll, summary_state, num_left + num_right
 
+    def controller_state(self, h, c, gnn_embeds, i, memory_mask=None):
+        """Row i's controller state for a batch of graphs: h is (B, i + 1, d),
+        gnn_embeds (B, n, d), memory_mask the padding of gnn_embeds if any."""
+        mask = generate_square_subsequent_mask(i + 1).to(gnn_embeds.device)
+        if self.use_st_attn:
+            new_h = self.decoder(h, gnn_embeds, tgt_mask=mask, memory_key_padding_mask=memory_mask)
+        else:
+            new_h = self.decoder(h, mask=mask)
+            new_h = torch.cat([new_h[:, [-1]], gnn_embeds[:, [i]]], dim=2)
+            new_h = self.fuser(new_h)
+        #new_h = new_h.squeeze(0)
+        new_h = new_h[:, -1]  # Get the last value
+        return (new_h, c)
+
+    def init_sampler_slots(self, slots):
+        # The constant states of TreeSampler's EMPTY_SLOT, POS_SLOT, NEG_SLOT.
+        if self.bits_compress:
+            states = [self.bit_rep_net([], 1), self.bit_rep_net([(0, 1)], 1), self.bit_rep_net([(0, -1)], 1)]
+        else:
+            states = [(self.empty_h0, self.empty_c0), (self.leaf_h0_pos, self.leaf_c0_pos),
+                      (self.leaf_h0_neg, self.leaf_c0_neg)]
+        for slot, (h, c) in enumerate(states):
+            slots.write([slot], h, c)
+
+    def eval_sampler_round(self, sampler, ops, slots):
+        """Evaluates one round of TreeSampler ops wave by wave, one batched call
+        per op kind (and depth, without share_param); returns the P_* probs."""
+        S = sampler
+        slots.reserve(sampler.num_slots())
+        bits = sampler.bits(TreeLib.lib.BinaryFeatWidth()) if (ops[:, 0] == S.S_BITS).any() else None
+        # Ops arrive sorted by (wave, op, leaf sign, depth): every model call
+        # below serves one contiguous run.
+        op = ops[:, 0]
+        per_depth = np.isin(op, (S.P_HAS_LEFT, S.P_HAS_RIGHT, S.S_TOPDOWN_LEFT, S.S_L2R, S.S_TOPRIGHT))
+        keys = np.stack([ops[:, 1], op, np.where(op == S.P_SIGN, ops[:, 6], 0),
+                         np.where(per_depth & (not self.share_param), ops[:, 5], 0)], axis=1)
+        starts = np.flatnonzero(np.concatenate([[True], np.any(keys[1:] != keys[:-1], axis=1)]))
+        ends = np.append(starts[1:], len(ops))
+        prob_idx, prob_vals = [], []
+        for st, ed in zip(starts, ends):
+            g = ops[st:ed]
+            kind, depth = g[0, 0], int(g[0, 5])
+            if kind <= S.P_SIGN:
+                x = slots.h(g[:, 3])
+                if kind == S.P_HAS_CH:
+                    logits = self.pred_has_ch(x)
+                elif kind == S.P_HAS_LEFT:
+                    logits = self.pred_has_left(x, depth)
+                elif kind == S.P_HAS_RIGHT:
+                    logits = self.pred_has_right(x, depth)
+                else:
+                    logits = self.pred_sign(x, g[0, 6])
+                prob_idx.append(np.arange(st, ed))
+                prob_vals.append(torch.sigmoid(logits).view(-1))
+                continue
+            state = slots.state(g[:, 3]) if kind != S.S_BITS else None
+            if kind == S.S_TOPDOWN_LEFT:
+                x = self.topdown_left_embed[g[:, 6].tolist()] + self.tree_pos_enc(g[:, 7].tolist())
+                h, c = self.cell_topdown(x, state, depth)
+            elif kind == S.S_L2R:
+                pos = self.tree_pos_enc(g[:, 7].tolist())
+                left_h, left_c = slots.state(g[:, 4])
+                h, c = self.l2r_cell(state, (left_h + pos, left_c + pos), depth)
+            elif kind == S.S_TOPRIGHT:
+                h, c = self.cell_topright(self.topdown_right_embed[g[:, 6].tolist()], state, depth)
+            elif kind == S.S_MERGE:
+                h, c = self.lr2p_cell(state, slots.state(g[:, 4]))
+            else:
+                lens, bits_pos, bits_neg = bits
+                rows = g[:, 7]
+                h = c = TreeLib._unpack_binary(lens[rows], bits_pos[rows], bits_neg[rows])
+            slots.write(g[:, 2], h, c)
+        probs = np.zeros((len(ops),), dtype=np.float32)
+        if prob_idx:
+            # The only host sync of the round.
+            probs[np.concatenate(prob_idx)] = torch.cat(prob_vals).cpu().numpy()
+        return probs
+
+    def run_sampler(self, sampler, slots):
+        ops = sampler.step()
+        while ops is not None:
+            sampler.set_probs(self.eval_sampler_round(sampler, ops, slots))
+            ops = sampler.step()
+
+    def forward_native(self, node_end, gnn_embeds, g, lb_list=None, ub_list=None,
+                       col_range=None, num_nodes=None, display=False):
+        """forward() with edge_list=None, with the row trees walked by
+        libtree's TreeSampler instead of gen_row."""
+        if num_nodes is None:
+            num_nodes = node_end
+        pbar = range(0, node_end)
+        if display:
+            pbar = tqdm(pbar)
+        sampler = TreeLib.CreateSampler(np.random.randint(2 ** 31 - 1), self.greedy_frac)
+        slots = SamplerSlots(self.embed_dim, gnn_embeds.device)
+        self.init_sampler_slots(slots)
+        total_ll = 0.0
+        edges = []
+        h = self.init_h0 + self.row_pos_enc([num_nodes])
+        c = self.init_c0
+        gnn_embeds = gnn_embeds.unsqueeze(0) # for transformer batching.
+        for i in pbar:
+            n_cols = i + int(self.self_loop) if col_range is None else col_range[1] - col_range[0]
+            lb = 0 if lb_list is None else lb_list[i]
+            ub = n_cols if ub_list is None else ub_list[i]
+            prev_cols = sorted(g.neighbors(i)) if g is not None and g.has_node(i) else []
+            row_range = (0, n_cols) if col_range is None else col_range
+            walk, in_slot = sampler.add_row(0, i, row_range, lb, ub, prev_cols)
+            controller_state = self.controller_state(h.unsqueeze(0), c, gnn_embeds, i)
+            slots.reserve(sampler.num_slots())
+            slots.write([in_slot], *controller_state)
+            self.run_sampler(sampler, slots)
+            summary = sampler.walk_info(walk)[2]
+            state_bot = slots.state([summary])
+            ll, cols, signs = sampler.walk_result(walk)
+            assert lb <= len(cols) <= ub
+            next_h = state_bot[0] + self.row_pos_enc([num_nodes - (i + 1)])
+            h = torch.concat([h, next_h])
+            c = state_bot[1]
+            edges += [(i, int(x), int(w)) for x, w in zip(cols, signs)]
+            total_ll = total_ll + ll
+        return torch.tensor(total_ll), edges, None
+
+    def forward_multi(self, list_node_end, list_gnn_embeds, list_g, list_num_nodes=None, display=False):
+        """Samples one graph per entry, like forward() with native_gen and no
+        edge_list, but for all of them at once: row i of every graph is walked
+        by one TreeSampler in the same rounds, so each model call scores the
+        pending decisions of all graphs together. Returns [(ll, edges)]."""
+        num_graphs = len(list_node_end)
+        if list_num_nodes is None:
+            list_num_nodes = list_node_end
+        device = list_gnn_embeds[0].device
+        with torch.no_grad():
+            sampler = TreeLib.CreateSampler(np.random.randint(2 ** 31 - 1), self.greedy_frac)
+            slots = SamplerSlots(self.embed_dim, device)
+            self.init_sampler_slots(slots)
+            max_n = max(e.shape[0] for e in list_gnn_embeds)
+            gnn_embeds = torch.zeros(num_graphs, max_n, self.embed_dim, device=device)
+            memory_mask = torch.ones(num_graphs, max_n, dtype=torch.bool, device=device)
+            for j, e in enumerate(list_gnn_embeds):
+                gnn_embeds[j, :e.shape[0]] = e
+                memory_mask[j, :e.shape[0]] = False
+            h = (self.init_h0 + self.row_pos_enc(list(list_num_nodes))).unsqueeze(1)
+            c = self.init_c0.expand(num_graphs, -1)
+            total_ll = np.zeros((num_graphs,))
+            edges = [[] for _ in range(num_graphs)]
+            pbar = range(max(list_node_end))
+            if display:
+                pbar = tqdm(pbar)
+            for i in pbar:
+                active = np.array([j for j in range(num_graphs) if i < list_node_end[j]])
+                idx = torch.as_tensor(active, device=device)
+                new_h, new_c = self.controller_state(h[idx], c[idx], gnn_embeds[idx], i,
+                                                     memory_mask[idx] if self.use_st_attn else None)
+                n_cols = i + int(self.self_loop)
+                prev = [sorted(list_g[j].neighbors(i)) if list_g[j] is not None and list_g[j].has_node(i) else []
+                        for j in active]
+                walks = sampler.add_rows(active, [i] * len(active), [0] * len(active), [n_cols] * len(active), prev,
+                                         col_ranges=[(0, n_cols)] * len(active))
+                slots.reserve(sampler.num_slots())
+                slots.write(sampler.walks_info(walks)[:, 0], new_h, new_c)
+                self.run_sampler(sampler, slots)
+                info = sampler.walks_info(walks)
+                state_h, state_c = slots.state(info[:, 2])
+                lls, cols, signs = sampler.collect(walks, info[:, 3])
+                offsets = np.concatenate([[0], np.cumsum(info[:, 3])])
+                for k, j in enumerate(active):
+                    total_ll[j] += lls[k]
+                    edges[j] += [(i, int(x), int(w)) for x, w in
+                                 zip(cols[offsets[k]:offsets[k + 1]], signs[offsets[k]:offsets[k + 1]])]
+                next_h = h.new_zeros(num_graphs, self.embed_dim)
+                next_h[idx] = state_h + self.row_pos_enc([list_num_nodes[j] - (i + 1) for j in active])
+                h = torch.cat([h, next_h.unsqueeze(1)], dim=1)
+                c = c.clone()
+                c[idx] = state_c
+        return [(torch.tensor(total_ll[j]), edges[j]) for j in range(num_graphs)]
+
     def forward(self, node_end, gnn_embeds, g, edge_list=None,
                 node_start=0, list_states=[], lb_list=None, ub_list=None, col_range=None, num_nodes=None, display=False):
+        if self.native_gen and edge_list is None:
+            with torch.no_grad():
+                return self.forward_native(node_end, gnn_embeds, g, lb_list, ub_list,
+                                           col_range, num_nodes, display)
         pos = 0
         total_ll = 0.0
         edges = []
@@ -520,16 +730,7 @@ class RecurTreeGen(nn.Module):
             cur_row = AdjRow(i, self.directed, self.self_loop, col_range=col_range)
             lb = 0 if lb_list is None else lb_list[i]
             ub = cur_row.root.n_cols if ub_list is None else ub_list[i]
-            mask = generate_square_subsequent_mask(i + 1).to(gnn_embeds.device)
-            if self.use_st_attn:
-                new_h = self.decoder(h.unsqueeze(0), gnn_embeds, tgt_mask=mask)
-            else:
-                new_h = self.decoder(h.unsqueeze(0), mask=mask)
-                new_h = torch.cat([new_h[:, [-1]], gnn_embeds[:, [i]]], dim=2)
-                new_h = self.fuser(new_h)
-            #new_h = new_h.squeeze(0)
-            new_h = new_h[0, [-1]]  # Get the last value
-            controller_state = (new_h, c)
+            controller_state = self.controller_state(h.unsqueeze(0), c, gnn_embeds, i)
             controller_states.append(controller_state)
 
             ll, state_bot, _ = self.gen_row(0, controller_state, cur_row.root, col_sm, lb, ub)
@@ -88,10 +88,22 @@ class Runner:
         train_start = time.time()
         self.train_start = time.time()
         epoch_time = 0
+        # With prefetch on, libtree builds the trees of the next batch on a
+        # worker thread while the current one trains.
+        prefetch = self.exp_args.train.get('prefetch', False)
+        if prefetch:
+            TreeLib.StartPrefetch()
         for epoch in range(self.exp_args.train.epochs):
             start = time.time()
             model.train()
-            for batch in train_loader:
+            batches = iter(train_loader)
+            batch = next(batches, None)
+            if prefetch and batch is not None:
+                TreeLib.EnqueueMiniBatch(batch.graph_id)
+            while batch is not None:
+                next_batch = next(batches, None)
+                if prefetch and next_batch is not None:
+                    TreeLib.EnqueueMiniBatch(next_batch.graph_id)
                 graph_ids = batch.graph_id
                 batch.to(device)
                 loss = model.forward_train(batch.x, batch.edge_index, graph_ids, num_nodes) / len(graph_ids)
@@ -113,6 +125,7 @@ class Runner:
                           f'Total Train Time: {(time.time() - train_start) / 60: .3f}m | '
                           f'Last Epoch Time: {epoch_time: .3f}s | ')
                 iter_count += 1
+                batch = next_batch
                       # f'LR: {scheduler.get_last_lr()[0]: .6f}')
             if epoch % self.args.experiment.validation.val_epochs == 0:
                 stop = self.validator.validate(epoch)
@@ -126,6 +139,8 @@ class Runner:
             if (epoch + 1) % snapshot_epochs == 0:
                 snapshot_model(model, epoch, self.args)
             epoch_time = time.time() - start
+        if prefetch:
+            TreeLib.StopPrefetch()
         pickle.dump(results, open(os.path.join(self.args.save_dir, 'train_stats.pkl'), 'wb'))
         self.save_training_info()
 